@@ -16,31 +16,72 @@ You should have received a copy of the GNU General Public License
 along with archive2sqfs.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <algorithm>
+#include <cctype>
 #include <cerrno>
+#include <chrono>
+#include <cstdio>
 #include <cstring>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <future>
 #include <iostream>
+#include <map>
 #include <memory>
+#include <numeric>
+#include <stdexcept>
 #include <string>
+#include <utility>
 #include <thread>
+#include <unordered_set>
 #include <vector>
 
 #include <archive.h>
 #include <archive_entry.h>
 
 #include "archive_reader.h"
+#include "block_cache.h"
+#include "block_ingest.h"
+#include "checkpoint.h"
 #include "compressor.h"
+#include "data_layout.h"
+#include "dir_ingest.h"
 #include "dirtree.h"
+#include "layer_stack.h"
+#include "mapped_input.h"
+#include "parallel_decoder.h"
+#include "path_filter.h"
+#include "reader_thread.h"
+#include "shard_plan.h"
 #include "sqsh_defs.h"
+#include "sqsh_import.h"
+#include "sqsh_ingest.h"
+#include "sqsh_reader.h"
 #include "sqsh_writer.h"
+#include "tar_ingest.h"
+#include "tar_spool.h"
+#include "zip_ingest.h"
+#include "tar_reader.h"
 
 using namespace std::literals;
 
 static int usage(std::string const & progname)
 {
   std::cerr << "usage: "s << progname
-            << " [--single-thread] [--enable-dedup]"s
-            << " [--strip=N] [--compressor=<type>]"s
-            << " outfile [infile]"s << std::endl;
+            << " [--single-thread] [--enable-dedup] [--stats]"s
+            << " [--native-tar] [--parallel-ingest] [--prescan] [--append]"s
+            << " [--checkpoint=<seconds>] [--resume]"s
+            << " [--strip=N] [--compressor=<type>] [--block-size=<bytes>]"s
+            << " [--include=<pattern>] [--exclude=<pattern>]"s
+            << " [--block-cache=<file>] [--block-cache-size=<bytes>]"s
+            << " [--shard-size=<bytes>] [--layout=<policy>]"s
+            << " [--hot-paths=<file>]"s
+            << " outfile [infile[:prefix]...]"s << std::endl;
+  std::cerr << "       "s << progname
+            << " [options] --layers outfile layer..."s << std::endl;
+  std::cerr << "       "s << progname
+            << " [options] --merge outfile image[:prefix]..."s << std::endl;
   return EINVAL;
 }
 
@@ -58,6 +99,25 @@ static constexpr char const * strip_path(size_t const strip,
   return pathname;
 }
 
+/* Joins the non-empty components of pathname, as dirtree sees them. */
+static std::string path_key(char const * pathname)
+{
+  std::string key;
+  for (auto p = pathname; *p != '\0';)
+    {
+      auto const end = std::strchr(p, '/');
+      auto const len = end ? std::size_t(end - p) : std::strlen(p);
+      if (len != 0)
+        {
+          if (!key.empty())
+            key += '/';
+          key.append(p, len);
+        }
+      p += end ? len + 1 : len;
+    }
+  return key;
+}
+
 static bool begins_with(std::string const & s, std::string const & prefix)
 {
   return prefix.size() <= s.size() &&
@@ -74,43 +134,108 @@ static bool proc_prefix_arg(std::string const & prefix,
   return matched;
 }
 
-int main(int argc, char * argv[])
+/* With the built-in tar parser, buff is a span of the mapped archive. It
+   is still copied once, into the writer's current block, as compression
+   runs on its own tasks and may outlive the reader that owns the
+   mapping. */
+template <typename R>
+static void append_data(dirtree_reg & reg, R & archive,
+                        int64_t const block_size)
 {
-  std::size_t strip = 0;
-  bool single_thread = false;
-  bool enable_dedup = false;
-  int block_log = SQFS_BLOCK_LOG_DEFAULT;
-  std::string compressor = COMPRESSOR_DEFAULT;
+  typename R::buffer_type buff;
+  int64_t i;
+  for (i = archive.filesize(); i >= block_size; i -= block_size)
+    {
+      archive.read(buff, block_size);
+      reg.append(buff);
+    }
+  if (i > 0)
+    {
+      archive.read(buff, i);
+      reg.append(buff);
+    }
+}
 
-  std::vector<std::string> args;
-  for (int i = 1; i < argc; ++i)
-    if (proc_prefix_arg("--strip=", argv[i], [&](auto s) {
-          strip = strtoll(s.data(), nullptr, 10);
-        }))
-      ;
-    else if (proc_prefix_arg("--compressor=", argv[i],
-                             [&](auto s) { compressor = s; }))
-      ;
-    else if ("--single-thread"s == argv[i])
-      single_thread = true;
-    else if ("--enable-dedup"s == argv[i])
-      enable_dedup = true;
-    else
-      args.push_back(argv[i]);
+template <typename S>
+static void append_data(dirtree_reg & reg, block_ingest<S> & archive,
+                        int64_t)
+{
+  for (auto block = archive.next_block(); block; block = archive.next_block())
+    reg.append(std::move(block->data), block->hash);
+}
 
-  if (args.size() < 1 || args.size() > 2)
-    return usage(argv[0]);
+static void append_data(dirtree_reg & reg, sqsh_ingest & archive, int64_t)
+{
+  archive.append_to(reg);
+}
+
+/* Counts the entries added from the input being read. With a checkpoint
+   path, the build is saved after an entry once interval has passed since
+   the last checkpoint. */
+struct build_progress
+{
+  using clock = std::chrono::steady_clock;
+
+  sqsh_writer * writer;
+  dirtree_dir * root;
+  std::string checkpoint_path;
+  clock::duration interval;
+  clock::time_point last = clock::now();
+  checkpoint_position position;
 
-  struct sqsh_writer writer(args[0], block_log, compressor, single_thread,
-                            enable_dedup);
-  archive_reader archive =
-      args.size() > 1 ? archive_reader(args[1]) : archive_reader(stdin);
-  dirtree_dir rootdir(&writer);
-  int64_t const block_size = writer.block_size();
+  build_progress(sqsh_writer * writer, dirtree_dir * root)
+      : writer(writer), root(root)
+  {
+  }
 
+  void entry_added()
+  {
+    ++position.entries;
+    if (checkpoint_path.empty() || clock::now() - last < interval)
+      return;
+    save_checkpoint(checkpoint_path, *writer, *root, position);
+    last = clock::now();
+  }
+
+  void input_done()
+  {
+    ++position.input;
+    position.entries = 0;
+  }
+};
+
+/* Skips the first count entries that selected accepts, which a resumed
+   build already has. */
+template <typename P> static auto skip_first(P selected, uint64_t const count)
+{
+  return [selected, count, seen = uint64_t(0)](auto const & entry) mutable {
+    return selected(entry) && seen++ >= count;
+  };
+}
+
+template <typename D, typename R, typename P>
+static void add_entries(D & rootdir, R & archive, P selected,
+                        std::size_t const strip, int64_t const block_size,
+                        build_progress & progress)
+{
   while (archive.next())
     {
+      if (!selected(archive))
+        {
+          archive.skip();
+          continue;
+        }
+
       auto const pathname = strip_path(strip, archive.pathname());
+      auto const hardlink_target = archive.hardlink_target();
+      if (hardlink_target != nullptr &&
+          rootdir.put_hardlink(pathname, strip_path(strip, hardlink_target)))
+        {
+          archive.skip();
+          progress.entry_added();
+          continue;
+        }
+
       switch (archive.filetype())
         {
           case AE_IFDIR:
@@ -119,56 +244,908 @@ int main(int argc, char * argv[])
 
           case AE_IFREG:
             {
-              std::vector<char> buff;
-              auto & reg = rootdir.put_file_with_metadata<dirtree_reg>(
-                  pathname, archive);
-
-              int64_t i;
-              for (i = archive.filesize(); i >= block_size; i -= block_size)
-                {
-                  archive.read(buff, block_size);
-                  reg.append(buff);
-                }
-              if (i > 0)
-                {
-                  archive.read(buff, i);
-                  reg.append(buff);
-                }
-
+              auto & reg =
+                  rootdir.template put_file_with_metadata<dirtree_reg>(
+                      pathname, archive);
+              append_data(reg, archive, block_size);
               reg.finalize();
             }
             break;
 
           case AE_IFLNK:
-            rootdir.put_file_with_metadata<dirtree_sym>(
+            rootdir.template put_file_with_metadata<dirtree_sym>(
                 pathname, archive, archive.symlink_target());
             break;
 
           case AE_IFBLK:
-            rootdir.put_file_with_metadata<dirtree_dev>(
+            rootdir.template put_file_with_metadata<dirtree_dev>(
                 pathname, archive, SQFS_INODE_TYPE_BLK, archive.rdev());
             break;
 
           case AE_IFCHR:
-            rootdir.put_file_with_metadata<dirtree_dev>(
+            rootdir.template put_file_with_metadata<dirtree_dev>(
                 pathname, archive, SQFS_INODE_TYPE_CHR, archive.rdev());
             break;
 
           case AE_IFSOCK:
-            rootdir.put_file_with_metadata<dirtree_ipc>(pathname, archive,
-                                                        SQFS_INODE_TYPE_SOCK);
+            rootdir.template put_file_with_metadata<dirtree_ipc>(
+                pathname, archive, SQFS_INODE_TYPE_SOCK);
             break;
 
           case AE_IFIFO:
-            rootdir.put_file_with_metadata<dirtree_ipc>(pathname, archive,
-                                                        SQFS_INODE_TYPE_PIPE);
+            rootdir.template put_file_with_metadata<dirtree_ipc>(
+                pathname, archive, SQFS_INODE_TYPE_PIPE);
             break;
         }
+      progress.entry_added();
+    }
+}
+
+/* Reads the entries of a layer that links holds back, by their number
+   among the selected entries, and adds each under its links' paths. */
+template <typename R, typename P>
+static void add_links(
+    dirtree_dir & rootdir, R & archive, P selected,
+    std::map<std::size_t, std::vector<std::string>> const & links,
+    int64_t const block_size)
+{
+  std::size_t index = 0;
+  while (archive.next())
+    {
+      auto const l = selected(archive) ? links.find(index++) : links.end();
+      if (l == links.end())
+        {
+          archive.skip();
+          continue;
+        }
+
+      auto const & paths = l->second;
+      auto & reg = rootdir.put_file_with_metadata<dirtree_reg>(paths[0],
+                                                               archive);
+      append_data(reg, archive, block_size);
+      reg.finalize();
+      for (std::size_t i = 1; i < paths.size(); ++i)
+        rootdir.put_hardlink(paths[i], paths[0]);
+    }
+}
+
+struct input_arg
+{
+  std::string path;
+  std::string prefix;
+};
+
+/* Splits infile[:prefix] at its last ':', so an infile whose name has a
+   ':' in it is given with a trailing ':' and no prefix. Only done when
+   there are several infiles, so that a single one is read as named. */
+static input_arg split_input(std::string const & arg)
+{
+  auto const sep = arg.rfind(':');
+  if (sep == arg.npos)
+    return {arg, ""s};
+  return {arg.substr(0, sep), arg.substr(sep + 1)};
+}
+
+/* Unless single_thread is set, compressed input split into independent
+   members or frames is decompressed on threads worker threads. */
+static std::unique_ptr<archive_reader>
+open_archive(char const * const infile, bool const single_thread,
+             std::size_t const threads = thread_count())
+{
+  if (infile == nullptr)
+    {
+      auto source = open_standard_input();
+      return source ? std::make_unique<archive_reader>(std::move(source))
+                    : std::make_unique<archive_reader>(stdin);
+    }
+
+  std::unique_ptr<input_source> source;
+  if (!single_thread)
+    source = parallel_decoder::open(infile, threads);
+  if (!source)
+    source = mapped_file::open(infile);
+  return source ? std::make_unique<archive_reader>(std::move(source))
+                : std::make_unique<archive_reader>(infile);
+}
+
+static std::unique_ptr<mapped_file>
+open_mapped(char const * const infile)
+{
+  auto file =
+      infile ? mapped_file::open(infile) : mapped_file::map(fileno(stdin));
+  if (!file)
+    throw std::runtime_error("built-in tar reader needs a mappable file"s);
+  return file;
+}
+
+/* Maps an uncompressed tar infile, or first spools any other input to a
+   tar file at spool_path. */
+static std::unique_ptr<mapped_file> open_tar(char const * const infile,
+                                             std::string const & spool_path,
+                                             bool const single_thread)
+{
+  auto file =
+      infile ? mapped_file::open(infile) : mapped_file::map(fileno(stdin));
+  if (file && tar_reader::recognizes(*file))
+    return file;
+  file.reset();
+  return spool_archive(*open_archive(infile, single_thread), spool_path);
+}
+
+struct archive_plan
+{
+  std::vector<bool> superseded;
+  std::size_t files = 0;
+  uint64_t data_size = 0;
+};
+
+/* Walks the headers of an archive without reading any data. A regular
+   file is superseded when a later entry replaces its path and no hardlink
+   in between refers to it, so its data never reaches the image. Links are
+   not counted as replacements, since they may fail to resolve. The
+   entries are numbered in the order selected() accepts them. With shards,
+   the entries that are not superseded are also added to it. */
+template <typename R, typename P>
+static archive_plan plan_archive(R & archive, P selected,
+                                 std::size_t const strip,
+                                 shard_plan * const shards = nullptr)
+{
+  struct planned_entry
+  {
+    std::string path;
+    std::string target;
+    bool regular;
+    bool replaces;
+    bool dir;
+    uint64_t size;
+  };
+
+  archive_plan plan;
+  std::vector<planned_entry> entries;
+  while (archive.next())
+    {
+      if (selected(archive))
+        {
+          auto const target = archive.hardlink_target();
+          bool const regular =
+              target == nullptr && archive.filetype() == AE_IFREG;
+          auto const filetype = archive.filetype();
+          uint64_t const size =
+              filetype == AE_IFLNK ? std::strlen(archive.symlink_target())
+                                   : archive.filesize();
+          entries.push_back(
+              {path_key(strip_path(strip, archive.pathname())),
+               target ? path_key(strip_path(strip, target)) : ""s,
+               regular, target == nullptr && filetype != 0,
+               filetype == AE_IFDIR, size});
+        }
+      archive.skip();
+    }
+
+  plan.superseded.resize(entries.size());
+  std::unordered_set<std::string> later;
+  std::unordered_set<std::string> targeted;
+  for (auto i = entries.size(); i-- > 0;)
+    {
+      auto const & e = entries[i];
+      plan.superseded[i] = e.regular && later.count(e.path) != 0 &&
+                           targeted.count(e.path) == 0;
+      if (e.regular && !plan.superseded[i])
+        {
+          ++plan.files;
+          plan.data_size += e.size;
+        }
+      if (e.replaces)
+        {
+          later.insert(e.path);
+          targeted.erase(e.path);
+        }
+      if (!e.target.empty())
+        targeted.insert(e.target);
+    }
+
+  if (shards)
+    for (std::size_t i = 0; i < entries.size(); ++i)
+      {
+        auto const & e = entries[i];
+        if (plan.superseded[i])
+          continue;
+        if (!e.target.empty())
+          shards->add_hardlink(e.path, e.target, e.size);
+        else if (e.dir)
+          shards->add_dir(e.path);
+        else if (e.regular)
+          shards->add_file(e.path, e.size);
+        else
+          shards->add_other(e.path, e.size);
+      }
+  return plan;
+}
+
+static void print_stall(char const * const what,
+                        std::chrono::steady_clock::duration const stall)
+{
+  std::cerr << what << ": "s << std::chrono::duration<double>(stall).count()
+            << " s"s << std::endl;
+}
+
+static void print_writer_stalls(sqsh_writer & w)
+{
+  print_stall("client stall on writer queue",
+              w.writer_queue.push_stall_time());
+  print_stall("writer stall", w.writer_queue.pop_stall_time());
+}
+
+/* Adds each entry below the root of the shard that plan puts it in. A
+   directory is made in every shard that has entries of it.
+
+   Each shard is an image of its own, outfile.0, outfile.1 and so on, with
+   its own writer thread, and is opened when its first entry is added.
+   When the entries come in the order they were planned in, a shard is
+   finished and its writer closed as soon as the last entry the plan puts
+   in it has been added, so only the shards still being filled are open.
+   Otherwise they are all finished at the end. */
+struct sharded_dir
+{
+  using opener = std::function<std::unique_ptr<sqsh_writer>(std::size_t)>;
+
+  shard_plan const & plan;
+  opener const open;
+  std::string const prefix;
+  build_progress const & progress;
+  bool const in_order;
+  bool const print_stats;
+
+  std::vector<std::unique_ptr<sqsh_writer>> writers;
+  std::vector<std::unique_ptr<dirtree_dir>> roots;
+  std::vector<dirtree_dir *> tops;
+  std::vector<bool> finished;
+  std::vector<std::size_t> const last;
+  std::vector<std::size_t> by_last;
+  std::size_t next_done = 0;
+  bool failed = false;
+
+  sharded_dir(shard_plan const & plan, opener open, std::string prefix,
+              build_progress const & progress, bool const in_order,
+              bool const print_stats)
+      : plan(plan), open(std::move(open)), prefix(std::move(prefix)),
+        progress(progress), in_order(in_order), print_stats(print_stats),
+        last(plan.last_entries())
+  {
+    writers.resize(last.size());
+    roots.resize(last.size());
+    tops.resize(last.size());
+    finished.resize(last.size());
+    by_last.resize(last.size());
+    std::iota(by_last.begin(), by_last.end(), std::size_t(0));
+    std::stable_sort(by_last.begin(), by_last.end(),
+                     [&](auto const a, auto const b) {
+                       return last[a] < last[b];
+                     });
+  }
+
+  void open_shard(std::size_t const i)
+  {
+    writers[i] = open(i);
+    roots[i] = std::make_unique<dirtree_dir>(writers[i].get());
+    tops[i] = &roots[i]->subdir_for_path(prefix);
+  }
+
+  void finish(std::size_t const i)
+  {
+    if (finished[i])
+      return;
+    if (!writers[i])
+      open_shard(i);
+    finished[i] = true;
+    failed = writers[i]->finish_data() || failed;
+    roots[i]->write_tables();
+    writers[i]->write_header();
+    if (print_stats)
+      {
+        auto const & path = writers[i]->outfilepath;
+        std::cerr << path << ": "s
+                  << std::ifstream(path, std::ios_base::ate).tellg()
+                  << " bytes"s << std::endl;
+        if (!writers[i]->single_threaded)
+          print_writer_stalls(*writers[i]);
+      }
+    tops[i] = nullptr;
+    roots[i].reset();
+    writers[i].reset();
+  }
+
+  /* Returns true if any data could not be written. */
+  bool finish_all()
+  {
+    for (std::size_t i = 0; i < writers.size(); ++i)
+      finish(i);
+    return failed;
+  }
+
+  /* The directory entries go under in shard i, which is opened if it is
+     not yet. Shards whose entries have all been added are finished
+     first. */
+  dirtree_dir & shard(std::size_t const i)
+  {
+    while (in_order && next_done < by_last.size() &&
+           last[by_last[next_done]] <= progress.position.entries)
+      finish(by_last[next_done++]);
+    if (finished[i])
+      throw std::runtime_error("entry added to a finished shard"s);
+    if (!writers[i])
+      open_shard(i);
+    return *tops[i];
+  }
+
+  struct subdirs
+  {
+    std::vector<dirtree_dir *> dirs;
+
+    template <typename MS> void update_metadata(MS const & ms)
+    {
+      for (auto const dir : dirs)
+        dir->update_metadata(ms);
+    }
+  };
+
+  subdirs subdir_for_path(char const * const path)
+  {
+    subdirs s;
+    for (auto const i : plan.shards_of_dir(path_key(path)))
+      s.dirs.push_back(&shard(i).subdir_for_path(path));
+    return s;
+  }
+
+  bool put_hardlink(char const * const path, char const * const target)
+  {
+    return shard(plan.shard_of(path_key(path))).put_hardlink(path, target);
+  }
+
+  template <typename T, typename MS, typename... A>
+  T & put_file_with_metadata(char const * const path, MS const & ms,
+                             A... a)
+  {
+    return shard(plan.shard_of(path_key(path)))
+        .put_file_with_metadata<T>(path, ms, a...);
+  }
+};
+
+template <typename D, typename R, typename P>
+static void read_archive(D & rootdir, std::unique_ptr<R> && reader,
+                         P selected, bool const single_thread,
+                         bool const print_stats, std::size_t const strip,
+                         int64_t const block_size, build_progress & progress)
+{
+  if (single_thread)
+    {
+      add_entries(rootdir, *reader, selected, strip, block_size, progress);
+      return;
+    }
+
+  reader_thread<R> archive(std::move(reader), selected, block_size);
+  add_entries(rootdir, archive, [](auto const &) { return true; }, strip,
+              block_size, progress);
+  if (print_stats)
+    {
+      print_stall("reader stall", archive.reader_stall_time());
+      print_stall("builder stall", archive.builder_stall_time());
+    }
+}
+
+/* Reads several inputs, each on its own reader thread, with up to
+   thread_count() of them in flight at once. The inputs are still added to
+   the tree one after another in the order given, so the image does not
+   depend on how the readers are scheduled. A reader runs ahead of the
+   tree builder by at most the bound of its queue, 64 chunks of one block
+   each, so an input other than the one being added is only decoded that
+   far before the builder reaches it. The data of all inputs goes through
+   the one writer, and its fragments, in order. open is given the number
+   of threads each input may decode on, a share of thread_count() among
+   the inputs in flight. */
+template <typename O, typename P>
+static void read_sources(dirtree_dir & rootdir,
+                         std::vector<input_arg> const & inputs, O open,
+                         P selected, bool const print_stats,
+                         std::size_t const strip, int64_t const block_size,
+                         build_progress & progress)
+{
+  using reader = typename decltype(open(nullptr, 0))::element_type;
+  auto const in_flight = std::min<std::size_t>(thread_count(), inputs.size());
+  auto const threads =
+      std::max<std::size_t>(1, thread_count() / std::max<std::size_t>(
+                                                    1, in_flight));
+  std::deque<std::unique_ptr<reader_thread<reader>>> started;
+  std::size_t next = 0;
+  for (auto const & input : inputs)
+    {
+      while (next < inputs.size() && started.size() < in_flight)
+        started.push_back(std::make_unique<reader_thread<reader>>(
+            open(inputs[next++].path.data(), threads), selected,
+            block_size));
+
+      auto & archive = *started.front();
+      add_entries(rootdir.subdir_for_path(input.prefix), archive,
+                  [](auto const &) { return true; }, strip, block_size,
+                  progress);
+      progress.input_done();
+      if (print_stats)
+        {
+          print_stall("reader stall", archive.reader_stall_time());
+          print_stall("builder stall", archive.builder_stall_time());
+        }
+      started.pop_front();
+    }
+}
+
+static int run(int argc, char * argv[])
+{
+  std::size_t strip = 0;
+  bool single_thread = false;
+  bool enable_dedup = false;
+  bool print_stats = false;
+  bool native_tar = false;
+  bool parallel_ingest = false;
+  bool prescan = false;
+  bool layers = false;
+  bool append = false;
+  bool resume = false;
+  bool merge = false;
+  long checkpoint_interval = 0;
+  int block_log = SQFS_BLOCK_LOG_DEFAULT;
+  std::string compressor = COMPRESSOR_DEFAULT;
+  std::string cache_path;
+  uint64_t cache_size = BLOCK_CACHE_SIZE_DEFAULT;
+  uint64_t shard_size = 0;
+  data_layout layout;
+  std::string hot_paths;
+  path_filter filter;
+
+  std::vector<std::string> args;
+  for (int i = 1; i < argc; ++i)
+    if (proc_prefix_arg("--strip=", argv[i], [&](auto s) {
+          strip = strtoll(s.data(), nullptr, 10);
+        }))
+      ;
+    else if (proc_prefix_arg("--compressor=", argv[i],
+                             [&](auto s) { compressor = s; }))
+      ;
+    else if (proc_prefix_arg("--block-size=", argv[i], [&](auto s) {
+               auto const size = strtoll(s.data(), nullptr, 10);
+               for (block_log = SQFS_BLOCK_LOG_MIN;
+                    block_log < SQFS_BLOCK_LOG_MAX &&
+                    (int64_t(1) << block_log) != size;
+                    ++block_log)
+                 ;
+               if ((int64_t(1) << block_log) != size)
+                 throw std::runtime_error("invalid block size: "s + s);
+             }))
+      ;
+    else if (proc_prefix_arg("--block-cache=", argv[i],
+                             [&](auto s) { cache_path = s; }))
+      ;
+    else if (proc_prefix_arg("--block-cache-size=", argv[i], [&](auto s) {
+               char * end;
+               errno = 0;
+               cache_size = strtoull(s.data(), &end, 10);
+               if (s.empty() || !std::isdigit(uint8_t(s[0])) || *end ||
+                   errno == ERANGE || cache_size == 0)
+                 throw std::runtime_error("invalid block cache size: "s + s);
+             }))
+      ;
+    else if (proc_prefix_arg("--shard-size=", argv[i], [&](auto s) {
+               shard_size = strtoull(s.data(), nullptr, 10);
+             }))
+      ;
+    else if (proc_prefix_arg("--layout=", argv[i], [&](auto s) {
+               layout.kind = data_layout::policy_named(s);
+             }))
+      ;
+    else if (proc_prefix_arg("--hot-paths=", argv[i],
+                             [&](auto s) { hot_paths = s; }))
+      ;
+    else if (proc_prefix_arg("--checkpoint=", argv[i], [&](auto s) {
+               checkpoint_interval = strtol(s.data(), nullptr, 10);
+             }))
+      ;
+    else if (proc_prefix_arg("--include=", argv[i],
+                             [&](auto s) { filter.include(s); }))
+      ;
+    else if (proc_prefix_arg("--exclude=", argv[i],
+                             [&](auto s) { filter.exclude(s); }))
+      ;
+    else if ("--single-thread"s == argv[i])
+      single_thread = true;
+    else if ("--enable-dedup"s == argv[i])
+      enable_dedup = true;
+    else if ("--stats"s == argv[i])
+      print_stats = true;
+    else if ("--native-tar"s == argv[i])
+      native_tar = true;
+    else if ("--parallel-ingest"s == argv[i])
+      parallel_ingest = true;
+    else if ("--prescan"s == argv[i])
+      prescan = true;
+    else if ("--layers"s == argv[i])
+      layers = true;
+    else if ("--append"s == argv[i])
+      append = true;
+    else if ("--resume"s == argv[i])
+      resume = true;
+    else if ("--merge"s == argv[i])
+      merge = true;
+    else
+      args.push_back(argv[i]);
+
+  if (args.size() < (layers || merge ? 2 : 1))
+    return usage(argv[0]);
+  std::vector<input_arg> inputs;
+  for (std::size_t i = 1; i < args.size(); ++i)
+    inputs.push_back(layers || args.size() == 2 ? input_arg{args[i], ""s}
+                                                : split_input(args[i]));
+  if (prescan && (layers || inputs.size() != 1))
+    throw std::runtime_error("--prescan needs a single named infile"s);
+  auto const infile = inputs.empty() ? nullptr : inputs[0].path.data();
+  if ((layers || merge) && (resume || checkpoint_interval > 0))
+    throw std::runtime_error("--layers and --merge cannot be checkpointed"s);
+  if (merge && (layers || append || prescan))
+    throw std::runtime_error(
+        "--merge cannot be used with --layers, --append or --prescan"s);
+  if (!hot_paths.empty())
+    {
+      std::ifstream hot(hot_paths);
+      if (!hot)
+        throw std::runtime_error("failed to open hot paths: "s + hot_paths);
+      for (std::string line; std::getline(hot, line);)
+        if (!line.empty())
+          layout.hot.push_back(path_key(line.data()));
+    }
+  if (!layout.keeps_archive_order() &&
+      (layers || merge || resume || checkpoint_interval > 0))
+    throw std::runtime_error("a layout cannot be used with --layers,"
+                             " --merge or checkpoints"s);
+  if (shard_size != 0 &&
+      (inputs.size() != 1 || dir_source::recognizes(infile) ||
+       sqsh_source::recognizes(infile)))
+    throw std::runtime_error("--shard-size needs a single archive infile"s);
+  if (shard_size != 0 &&
+      (layers || merge || append || resume || checkpoint_interval > 0))
+    throw std::runtime_error("--shard-size cannot be used with --layers,"
+                             " --merge, --append or checkpoints"s);
+
+  /* A build resumes if its checkpoint is there, and starts over if not. */
+  auto const checkpoint_path = args[0] + ".ckpt"s;
+  resume = resume && std::ifstream(checkpoint_path);
+
+  /* An appended image keeps its own block size and compressor, and merged
+     images all have those of the first. */
+  std::unique_ptr<sqsh_reader> image;
+  if (append || merge)
+    {
+      image = std::make_unique<sqsh_reader>(merge ? infile : args[0]);
+      block_log = image->super.block_log;
+      compressor = compressor_name(image->super.compression);
+    }
+
+  auto const filtered = [&](auto const & entry) {
+    return filter.selects(strip_path(strip, entry.pathname()),
+                          entry.filetype() == AE_IFDIR);
+  };
+
+  /* The headers are walked once up front for --prescan and for sharding.
+     A ZIP file read with --parallel-ingest is added in a different order,
+     so its superseded entries are not skipped, and its shards are only
+     finished once it is all added. */
+  archive_plan plan;
+  std::unique_ptr<shard_plan> shards;
+  bool shards_in_order = layout.keeps_archive_order();
+  if (shard_size != 0)
+    shards =
+        std::make_unique<shard_plan>(shard_size, uint64_t(1) << block_log);
+  if ((prescan || shards) && !dir_source::recognizes(infile) &&
+      !sqsh_source::recognizes(infile))
+    {
+      if (!native_tar && !parallel_ingest)
+        plan = plan_archive(*open_archive(infile, single_thread), filtered,
+                            strip, shards.get());
+      else if (!zip_source::recognizes(*open_mapped(infile)))
+        {
+          tar_reader archive(open_mapped(infile));
+          plan = plan_archive(archive, filtered, strip, shards.get());
+        }
+      else if (shards)
+        {
+          plan_archive(*open_archive(infile, single_thread), filtered, strip,
+                       shards.get());
+          shards_in_order = false;
+        }
+      if (prescan && print_stats)
+        std::cerr << "prescan: "s << plan.files << " files, "s
+                  << plan.data_size << " bytes, "s
+                  << std::count(plan.superseded.begin(),
+                                plan.superseded.end(), true)
+                  << " superseded"s << std::endl;
+    }
+
+  std::unique_ptr<block_cache> cache;
+  if (!cache_path.empty())
+    cache = std::make_unique<block_cache>(cache_path, cache_size);
+  if (shards)
+    shards->partition();
+
+  /* Without shards there is one image and one writer. The writers of
+     shards are opened by sharded_dir as they are needed. */
+  std::unique_ptr<sqsh_writer> writer;
+  std::unique_ptr<dirtree_dir> rootdir;
+  if (!shards)
+    {
+      writer = std::make_unique<sqsh_writer>(args[0], block_log, compressor,
+                                             single_thread, enable_dedup,
+                                             append || resume);
+      writer->cache = cache.get();
+      rootdir = std::make_unique<dirtree_dir>(writer.get());
+    }
+  build_progress progress(writer.get(), rootdir.get());
+  if (checkpoint_interval > 0)
+    {
+      progress.checkpoint_path = checkpoint_path;
+      progress.interval = std::chrono::seconds(checkpoint_interval);
+    }
+  checkpoint_position resumed;
+  if (resume)
+    progress.position = resumed =
+        load_checkpoint(checkpoint_path, *writer, *rootdir);
+  else if (image && append)
+    import_image(*image, *rootdir);
+  int64_t const block_size = int64_t(1) << block_log;
+  auto const launch =
+      single_thread ? std::launch::deferred : std::launch::async;
+  if (prescan && !shards)
+    writer->reserve(plan.files, plan.data_size);
+
+  /* Sources scanned up front hand out their entries in the layout's
+     order. */
+  auto const order = [&](std::vector<entry_header> const & entries) {
+    std::vector<data_layout::entry> keyed;
+    keyed.reserve(entries.size());
+    for (auto const & e : entries)
+      {
+        auto const target = e.hardlink_target();
+        keyed.push_back({path_key(strip_path(strip, e.pathname())),
+                         target ? path_key(strip_path(strip, target)) : ""s,
+                         e.filetype() == AE_IFDIR,
+                         !target && e.filetype() == AE_IFREG,
+                         uint64_t(e.filesize())});
+      }
+    return layout.order(keyed, block_size);
+  };
+
+  auto const ingest = [&](auto & root, char const * const path,
+                          auto selected) {
+    if (dir_source::recognizes(path))
+      {
+        dir_ingest archive(thread_count(), launch, path,
+                           selected, thread_count(), launch,
+                           block_size, enable_dedup, order);
+        add_entries(root, archive, [](auto const &) { return true; }, strip,
+                    block_size, progress);
+      }
+    else if (sqsh_source::recognizes(path))
+      {
+        sqsh_ingest archive(thread_count(), launch, path,
+                            selected, writer->comp->type, block_size,
+                            enable_dedup, order);
+        add_entries(root, archive, [](auto const &) { return true; }, strip,
+                    block_size, progress);
+      }
+    else if (!layout.keeps_archive_order())
+      {
+        tar_ingest archive(
+            thread_count(), launch,
+            open_tar(path, args[0] + ".spool~"s, single_thread), selected,
+            block_size, enable_dedup, order);
+        add_entries(root, archive, [](auto const &) { return true; }, strip,
+                    block_size, progress);
+      }
+    else if (parallel_ingest)
+      {
+        auto file = open_mapped(path);
+        auto const all = [](auto const &) { return true; };
+        if (zip_source::recognizes(*file))
+          {
+            zip_ingest archive(thread_count(), launch,
+                               std::move(file), selected, block_size,
+                               enable_dedup);
+            add_entries(root, archive, all, strip, block_size, progress);
+          }
+        else
+          {
+            tar_ingest archive(thread_count(), launch,
+                               std::move(file), selected, block_size,
+                               enable_dedup);
+            add_entries(root, archive, all, strip, block_size, progress);
+          }
+      }
+    else if (native_tar)
+      read_archive(root, std::make_unique<tar_reader>(open_mapped(path)),
+                   selected, single_thread, print_stats, strip, block_size,
+                   progress);
+    else
+      read_archive(root, open_archive(path, single_thread), selected,
+                   single_thread, print_stats, strip, block_size, progress);
+  };
+
+  bool failed = false;
+  if (merge)
+    for (std::size_t i = 0; i < inputs.size(); ++i)
+      {
+        if (i != 0)
+          image = std::make_unique<sqsh_reader>(inputs[i].path);
+        merge_image(*image, rootdir->subdir_for_path(inputs[i].prefix));
+      }
+  else if (layers)
+    {
+      layer_stack stack;
+      auto const visible = [&](auto const & entry) {
+        if (!filtered(entry))
+          return false;
+        auto const target = entry.hardlink_target();
+        auto const target_key =
+            target ? path_key(strip_path(strip, target)) : ""s;
+        return stack.admits(path_key(strip_path(strip, entry.pathname())),
+                            entry.filetype() == AE_IFDIR,
+                            target ? &target_key : nullptr);
+      };
+
+      for (auto i = inputs.size(); i-- > 0;)
+        {
+          auto const path = inputs[i].path.data();
+          ingest(*rootdir, path, visible);
+          /* Directory and image layers choose which of a set of linked
+             files holds the data after selecting them, so they never
+             hold links back. */
+          auto const links = stack.links();
+          if (!links.empty() && (dir_source::recognizes(path) ||
+                                 sqsh_source::recognizes(path)))
+            throw std::runtime_error("hard links held back in layer: "s +
+                                     path);
+          else if (!links.empty() && (native_tar || parallel_ingest))
+            {
+              tar_reader archive(open_mapped(path));
+              add_links(*rootdir, archive, filtered, links, block_size);
+            }
+          else if (!links.empty())
+            add_links(*rootdir, *open_archive(path, single_thread), filtered,
+                      links, block_size);
+          stack.end_layer();
+        }
+    }
+  else if (inputs.size() <= 1)
+    {
+      auto const planned = [&, index = std::size_t(0)](
+                               auto const & entry) mutable {
+        return filtered(entry) &&
+               (plan.superseded.empty() || !plan.superseded[index++]);
+      };
+      if (shards)
+        {
+          sharded_dir sharded(
+              *shards,
+              [&](std::size_t const i) {
+                auto w = std::make_unique<sqsh_writer>(
+                    args[0] + "."s + std::to_string(i), block_log,
+                    compressor, single_thread, enable_dedup);
+                w->cache = cache.get();
+                return w;
+              },
+              inputs[0].prefix, progress, shards_in_order, print_stats);
+          ingest(sharded, infile, planned);
+          failed = sharded.finish_all();
+        }
+      else
+        ingest(inputs.empty() ? *rootdir
+                              : rootdir->subdir_for_path(inputs[0].prefix),
+               infile, skip_first(planned, resumed.entries));
     }
+  else
+    {
+      auto next = std::min(resumed.input, inputs.size());
+      if (resumed.entries != 0 && next < inputs.size())
+        {
+          ingest(rootdir->subdir_for_path(inputs[next].prefix),
+                 inputs[next].path.data(),
+                 skip_first(filtered, resumed.entries));
+          progress.input_done();
+          ++next;
+        }
 
-  bool failed = writer.finish_data();
-  rootdir.write_tables();
-  writer.write_header();
+      std::vector<input_arg> const rest(inputs.begin() + next, inputs.end());
+      if (rest.size() > 1 && !single_thread && !parallel_ingest &&
+          layout.keeps_archive_order() &&
+          std::none_of(rest.begin(), rest.end(), [](auto const & in) {
+            return dir_source::recognizes(in.path.data()) ||
+                   sqsh_source::recognizes(in.path.data());
+          }))
+        {
+          if (native_tar)
+            read_sources(*rootdir, rest,
+                         [](char const * const path, std::size_t) {
+                           return std::make_unique<tar_reader>(
+                               open_mapped(path));
+                         },
+                         filtered, print_stats, strip, block_size, progress);
+          else
+            read_sources(*rootdir, rest,
+                         [](char const * const path,
+                            std::size_t const threads) {
+                           return open_archive(path, false, threads);
+                         },
+                         filtered, print_stats, strip, block_size, progress);
+        }
+      else
+        for (auto const & input : rest)
+          {
+            ingest(rootdir->subdir_for_path(input.prefix), input.path.data(),
+                   filtered);
+            progress.input_done();
+          }
+    }
+
+  image.reset();
+  if (writer)
+    failed = writer->finish_data() || failed;
+
+  if (print_stats && !shards)
+    {
+      auto & root = inputs.size() == 1
+                        ? rootdir->subdir_for_path(inputs[0].prefix)
+                        : *rootdir;
+      auto const locality = measure_locality(root, layout.hot);
+      std::cerr << "layout: "s << locality.sequential << " of "s
+                << locality.reads << " reads sequential ("s
+                << (locality.reads
+                        ? 100 * locality.sequential / locality.reads
+                        : 100)
+                << "%) in "s << (layout.hot.empty() ? "tree"s : "hot path"s)
+                << " order"s << std::endl;
+    }
+  if (cache)
+    cache->close();
+  if (writer)
+    {
+      rootdir->write_tables();
+      writer->write_header();
+    }
+  if (!failed)
+    std::remove(checkpoint_path.data());
+
+  if (print_stats && cache)
+    {
+      auto const stats = cache->stats();
+      auto const lookups = stats.hits + stats.misses;
+      std::cerr << "block cache: "s << stats.hits << " hits, "s
+                << stats.misses << " misses ("s
+                << (lookups ? 100 * stats.hits / lookups : 0)
+                << "% hit rate), "s << stats.collisions
+                << " collisions, "s << stats.added << " added, "s
+                << stats.evicted << " evicted"s << std::endl;
+    }
+
+  if (print_stats && !single_thread && writer)
+    print_writer_stalls(*writer);
 
   return failed;
 }
+
+int main(int argc, char * argv[])
+{
+  try
+    {
+      return run(argc, argv);
+    }
+  catch (std::exception const & e)
+    {
+      std::cerr << argv[0] << ": "s << e.what() << std::endl;
+      return 1;
+    }
+}
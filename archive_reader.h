@@ -20,23 +20,33 @@ along with archive2sqfs.  If not, see <http://www.gnu.org/licenses/>.
 #define LSL_ARCHIVE_READER_H
 
 #include <cstddef>
+#include <exception>
+#include <memory>
 #include <stdexcept>
 #include <string>
+#include <vector>
 
 using namespace std::literals;
 
 #include <archive.h>
 #include <archive_entry.h>
 
+#include "input_source.h"
+
 class archive_reader
 {
 public:
+  using buffer_type = std::vector<char>;
+
   archive_reader(char const *);
   template <typename S> archive_reader(S);
   archive_reader(std::FILE *);
+  archive_reader(std::unique_ptr<input_source> &&);
+  archive_reader(archive_reader const &) = delete;
   ~archive_reader();
 
   bool next();
+  void skip();
   void read(void *, std::size_t);
   template <typename T> void read(T &, std::size_t);
 
@@ -49,12 +59,19 @@ public:
   auto filesize() const { return archive_entry_size(entry); }
   auto rdev() const { return archive_entry_rdev(entry); }
   auto symlink_target() const { return archive_entry_symlink(entry); }
+  auto hardlink_target() const { return archive_entry_hardlink(entry); }
 
 private:
   struct archive * reader;
   struct archive_entry * entry;
+  std::unique_ptr<input_source> source;
+  std::exception_ptr source_error;
 
   archive_reader();
+  void check_source();
+
+  static la_ssize_t source_read(struct archive *, void *, void const **);
+  static la_int64_t source_skip(struct archive *, void *, la_int64_t);
 };
 
 static std::size_t constexpr reader_blocksize = 10240;
@@ -90,6 +107,61 @@ inline archive_reader::archive_reader(std::FILE * const handle)
     throw std::runtime_error("failed to open archive by handle"s);
 }
 
+inline archive_reader::archive_reader(std::unique_ptr<input_source> && src)
+    : archive_reader()
+{
+  source = std::move(src);
+  if (archive_read_set_callback_data(reader, this) != ARCHIVE_OK ||
+      archive_read_set_read_callback(reader, source_read) != ARCHIVE_OK ||
+      archive_read_set_skip_callback(reader, source_skip) != ARCHIVE_OK)
+    throw std::runtime_error("failed to set archive input callbacks"s);
+  if (archive_read_open1(reader) != ARCHIVE_OK)
+    {
+      check_source();
+      throw std::runtime_error("failed to open archive from input source"s);
+    }
+}
+
+inline la_ssize_t archive_reader::source_read(struct archive * const a,
+                                              void * const client,
+                                              void const ** const buff)
+{
+  auto const self = static_cast<archive_reader *>(client);
+  try
+    {
+      return self->source->read(*buff);
+    }
+  catch (...)
+    {
+      self->source_error = std::current_exception();
+      archive_set_error(a, -1, "input source failed");
+      return -1;
+    }
+}
+
+inline la_int64_t archive_reader::source_skip(struct archive * const a,
+                                              void * const client,
+                                              la_int64_t const request)
+{
+  auto const self = static_cast<archive_reader *>(client);
+  try
+    {
+      return self->source->skip(request);
+    }
+  catch (...)
+    {
+      self->source_error = std::current_exception();
+      archive_set_error(a, -1, "input source failed");
+      return ARCHIVE_FATAL;
+    }
+}
+
+inline void archive_reader::check_source()
+{
+  if (source_error)
+    std::rethrow_exception(source_error);
+}
+
 inline archive_reader::~archive_reader()
 {
   if (reader != nullptr)
@@ -100,14 +172,29 @@ inline bool archive_reader::next()
 {
   auto const result = archive_read_next_header(reader, &entry);
   if (result == ARCHIVE_FATAL)
-    throw std::runtime_error("fatal error in archive_read_next_header()"s);
+    {
+      check_source();
+      throw std::runtime_error("fatal error in archive_read_next_header()"s);
+    }
   return result == ARCHIVE_OK;
 }
 
+inline void archive_reader::skip()
+{
+  if (archive_read_data_skip(reader) == ARCHIVE_FATAL)
+    {
+      check_source();
+      throw std::runtime_error("fatal error in archive_read_data_skip()"s);
+    }
+}
+
 inline void archive_reader::read(void * const buff, std::size_t const len)
 {
   if (archive_read_data(reader, buff, len) != len)
-    throw std::runtime_error("failed to read data from archive"s);
+    {
+      check_source();
+      throw std::runtime_error("failed to read data from archive"s);
+    }
 }
 
 template <typename T>
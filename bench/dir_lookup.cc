@@ -0,0 +1,201 @@
+/*
+Copyright (C) 2018  Charles Cagle
+
+This file is part of archive2sqfs.
+
+archive2sqfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3.
+
+archive2sqfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with archive2sqfs.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Builds an image holding one large directory and looks up names in it
+   the way the kernel does, reading and decompressing directory table
+   blocks from the image with nothing cached. Each name is looked up
+   once starting where the directory index points, and once scanning the
+   listing from its start, as for a directory without an index.
+
+   usage: bench_dir_lookup [entries [lookups [scratch-image]]] */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace std::literals;
+
+#include "sqsh_builder.h"
+#include "sqsh_defs.h"
+#include "sqsh_reader.h"
+
+static std::string entry_name(std::size_t const i)
+{
+  std::ostringstream name;
+  name << "file" << std::setw(8) << std::setfill('0') << i;
+  return name.str();
+}
+
+static uint64_t le(char const * const p, std::size_t const len)
+{
+  uint64_t value = 0;
+  for (std::size_t i = len; i-- > 0;)
+    value = value << 8 | static_cast<unsigned char>(p[i]);
+  return value;
+}
+
+/* Reads a listing from the directory table one metadata block at a time,
+   counting the blocks it decompresses. */
+struct listing_cursor
+{
+  sqsh_reader & image;
+  uint64_t next_block;
+  std::size_t offset;
+  std::vector<char> block;
+  std::size_t blocks_read = 0;
+
+  listing_cursor(sqsh_reader & image, uint32_t const start_block,
+                 std::size_t const start_offset)
+      : image(image),
+        next_block(image.super.directory_table_start + start_block),
+        offset(start_offset)
+  {
+    read_block();
+  }
+
+  void read_block()
+  {
+    auto const header = image.read_bytes(next_block, 2);
+    auto const h = le(header.data(), 2);
+    auto const len = h & ~SQFS_META_BLOCK_COMPRESSED_BIT;
+    block = image.read_bytes(next_block + 2, len);
+    if (!(h & SQFS_META_BLOCK_COMPRESSED_BIT))
+      block = image.comp->decompress(std::move(block), SQFS_META_BLOCK_SIZE);
+    next_block += 2 + len;
+    ++blocks_read;
+  }
+
+  std::string take(std::size_t len)
+  {
+    std::string bytes;
+    while (len > 0)
+      {
+        if (offset >= block.size())
+          {
+            offset -= block.size();
+            read_block();
+          }
+        auto const n = std::min(len, block.size() - offset);
+        bytes.append(block.data() + offset, n);
+        offset += n;
+        len -= n;
+      }
+    return bytes;
+  }
+
+  uint64_t number(std::size_t const len) { return le(take(len).data(), len); }
+};
+
+/* Returns the number of directory table blocks read to find name. */
+static std::size_t lookup(sqsh_reader & image, sqsh_inode const & dir,
+                          std::string const & name, bool const use_index)
+{
+  uint32_t start_block = dir.listing.block;
+  std::size_t position = 3;
+  if (use_index)
+    for (auto const & entry : dir.index)
+      {
+        if (entry.name > name)
+          break;
+        start_block = entry.start_block;
+        position = entry.index + 3;
+      }
+
+  listing_cursor in(image, start_block,
+                    (dir.listing.offset + position - 3) %
+                        SQFS_META_BLOCK_SIZE);
+  while (position < dir.listing_size)
+    {
+      auto const count = in.number(4) + 1;
+      in.take(8);
+      position += SQFS_DIR_HEADER_SIZE;
+      for (uint64_t i = 0; i < count; ++i)
+        {
+          in.take(6);
+          auto const len = in.number(2) + 1;
+          auto const entry = in.take(len);
+          position += SQFS_DIR_ENTRY_SIZE + len;
+          if (entry == name)
+            return in.blocks_read;
+          if (entry > name)
+            throw std::runtime_error("not found: "s + name);
+        }
+    }
+  throw std::runtime_error("not found: "s + name);
+}
+
+int main(int argc, char * argv[])
+{
+  std::size_t const entries = argc > 1 ? std::strtoull(argv[1], nullptr, 10)
+                                       : 200000;
+  std::size_t const lookups = argc > 2 ? std::strtoull(argv[2], nullptr, 10)
+                                       : 2000;
+  std::string const path = argc > 3 ? argv[3] : "bench_dir_lookup.img";
+  if (entries == 0 || lookups == 0)
+    {
+      std::cerr << "usage: "s << argv[0]
+                << " [entries [lookups [scratch-image]]]\n"s;
+      return 1;
+    }
+
+  {
+    sqsh_builder builder(path);
+    for (std::size_t i = 0; i < entries; ++i)
+      builder.add_file("big/" + entry_name(i), sqsh_metadata(), nullptr, 0);
+    builder.finish();
+  }
+
+  sqsh_reader image(path);
+  sqsh_inode dir;
+  auto const root = image.inode(image.super.root_inode);
+  for (auto const & entry : image.directory(root))
+    if (entry.name == "big")
+      dir = image.inode(entry.inode);
+  std::cout << "directory: "s << entries << " entries, "s
+            << dir.index.size() << " index entries\n"s;
+
+  std::mt19937_64 random(1);
+  std::vector<std::string> names;
+  for (std::size_t i = 0; i < lookups; ++i)
+    names.push_back(entry_name(random() % entries));
+
+  for (auto const use_index : {true, false})
+    {
+      std::size_t blocks = 0;
+      auto const start = std::chrono::steady_clock::now();
+      for (auto const & name : names)
+        blocks += lookup(image, dir, name, use_index);
+      auto const secs = std::chrono::duration<double>(
+                            std::chrono::steady_clock::now() - start)
+                            .count();
+      std::cout << (use_index ? "with index: "s : "linear scan: "s)
+                << secs * 1e6 / lookups << " us/lookup, "s
+                << double(blocks) / lookups << " blocks/lookup\n"s;
+    }
+
+  std::remove(path.data());
+  return 0;
+}
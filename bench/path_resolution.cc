@@ -0,0 +1,156 @@
+/*
+Copyright (C) 2018  Charles Cagle
+
+This file is part of archive2sqfs.
+
+archive2sqfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3.
+
+archive2sqfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with archive2sqfs.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Times dirtree_dir::put_file on a deep tree of generated paths, first in
+   the order an archive lists them, grouped by directory, and then
+   shuffled, where the last-directory cache rarely helps. Then times
+   sorting every directory, as write_inode does.
+
+   usage: bench_path_resolution [entries [scratch-image]] */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <numeric>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace std::literals;
+
+#include "compressor.h"
+#include "dirtree.h"
+#include "sqsh_defs.h"
+#include "sqsh_writer.h"
+#include "string_view.h"
+
+static constexpr std::size_t depth = 6;
+static constexpr std::size_t fanout = 4;
+
+struct path_list
+{
+  std::string chars;
+  std::vector<std::size_t> ends;
+
+  std::size_t size() const { return ends.size(); }
+
+  string_view operator[](std::size_t const i) const
+  {
+    auto const begin = i == 0 ? 0 : ends[i - 1];
+    return string_view(chars).substr(begin, ends[i] - begin);
+  }
+};
+
+/* Lists count files spread evenly over the leaves of a tree depth
+   directories deep, in depth-first order. */
+static path_list make_paths(std::size_t const count)
+{
+  std::size_t leaves = 1;
+  for (std::size_t i = 0; i < depth; ++i)
+    leaves *= fanout;
+
+  path_list paths;
+  paths.ends.reserve(count);
+  for (std::size_t leaf = 0; leaf < leaves; ++leaf)
+    {
+      std::string dir;
+      for (std::size_t level = 0, rest = leaf; level < depth; ++level)
+        {
+          dir += "dir" + std::to_string(level) + "_" +
+                 std::to_string(rest % fanout) + "/";
+          rest /= fanout;
+        }
+
+      auto const files = count / leaves + (leaf < count % leaves ? 1 : 0);
+      for (std::size_t i = 0; i < files; ++i)
+        {
+          paths.chars += dir + "file" + std::to_string(i);
+          paths.ends.push_back(paths.chars.size());
+        }
+    }
+  return paths;
+}
+
+static double seconds_since(std::chrono::steady_clock::time_point const t)
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - t)
+      .count();
+}
+
+static void report(char const * const what, std::size_t const count,
+                   double const secs)
+{
+  std::cout << what << ": "s << count << " entries in "s << secs << " s, "s
+            << secs * 1e9 / count << " ns/entry\n"s;
+}
+
+static void sort_all(dirtree_dir & dir, std::size_t & count)
+{
+  auto const sorted = dir.sorted_entries();
+  count += sorted.size();
+  for (auto const entry : sorted)
+    if (entry->second->inode_type == SQFS_INODE_TYPE_DIR)
+      sort_all(static_cast<dirtree_dir &>(*entry->second), count);
+}
+
+static void run(path_list const & paths,
+                std::vector<std::size_t> const & order,
+                char const * const what, std::string const & image,
+                bool const sort)
+{
+  sqsh_writer writer(image, SQFS_BLOCK_LOG_DEFAULT, COMPRESSOR_DEFAULT, true);
+  dirtree_dir root(&writer);
+
+  auto start = std::chrono::steady_clock::now();
+  for (auto const i : order)
+    root.put_file<dirtree_reg>(paths[i]);
+  report(what, order.size(), seconds_since(start));
+
+  if (sort)
+    {
+      std::size_t count = 0;
+      start = std::chrono::steady_clock::now();
+      sort_all(root, count);
+      report("sorting directories", count, seconds_since(start));
+    }
+}
+
+int main(int argc, char * argv[])
+{
+  std::size_t const count = argc > 1 ? std::strtoull(argv[1], nullptr, 10)
+                                     : 5000000;
+  std::string const image = argc > 2 ? argv[2] : "bench_path_resolution.img";
+  if (count == 0)
+    {
+      std::cerr << "usage: "s << argv[0] << " [entries [scratch-image]]\n"s;
+      return 1;
+    }
+
+  auto const paths = make_paths(count);
+  std::vector<std::size_t> order(paths.size());
+  std::iota(order.begin(), order.end(), std::size_t(0));
+  run(paths, order, "archive order", image, true);
+
+  std::shuffle(order.begin(), order.end(), std::mt19937_64(1));
+  run(paths, order, "shuffled order", image, false);
+
+  std::remove(image.data());
+  return 0;
+}
@@ -0,0 +1,361 @@
+/*
+Copyright (C) 2018  Charles Cagle
+
+This file is part of archive2sqfs.
+
+archive2sqfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3.
+
+archive2sqfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with archive2sqfs.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+using namespace std::literals;
+
+#include "block_cache.h"
+#include "compressor.h"
+#include "content_hash.h"
+#include "endian_buffer.h"
+#include "filesystem.h"
+#include "posix_io.h"
+#include "sqsh_defs.h"
+
+/* "afqs-bc1" */
+static constexpr uint64_t CACHE_MAGIC = 0x3163622d73716661;
+static constexpr std::size_t CACHE_HEADER_SIZE = 16;
+static constexpr std::size_t CACHE_ENTRY_SIZE = 32;
+
+static uint64_t le(char const * const p, std::size_t const len)
+{
+  uint64_t value = 0;
+  for (std::size_t i = len; i-- > 0;)
+    value = value << 8 | static_cast<unsigned char>(p[i]);
+  return value;
+}
+
+static std::size_t data_size(uint32_t const stored_size)
+{
+  return stored_size & ~SQFS_BLOCK_COMPRESSED_BIT;
+}
+
+static void write_header(std::ostream & out, uint32_t const generation)
+{
+  endian_buffer<CACHE_HEADER_SIZE> header;
+  header.l64(CACHE_MAGIC);
+  header.l32(generation);
+  header.l32(0);
+  out.seekp(0);
+  out.write(header.data(), header.size());
+}
+
+template <typename E>
+static void write_entry(std::ostream & out, uint64_t const hash,
+                        E const & e)
+{
+  endian_buffer<CACHE_ENTRY_SIZE> buff;
+  buff.l64(hash);
+  buff.l32(e.size);
+  buff.l32(e.stored_size);
+  buff.l16(e.type);
+  buff.l16(e.level);
+  buff.l16(e.block_log);
+  buff.l16(0);
+  buff.l32(e.generation);
+  buff.l32(0);
+  out.write(buff.data(), buff.size());
+}
+
+block_cache::block_cache(std::string const & path, uint64_t const limit)
+    : path(path), limit(limit)
+{
+  load();
+}
+
+block_cache::~block_cache()
+{
+  if (file.is_open())
+    file.close();
+  unlock();
+}
+
+/* Locks the cache file, creating it empty if it is not there. A lock
+   taken on a file that a compaction replaced in the meantime is dropped
+   and taken again on the new file. */
+void block_cache::lock()
+{
+#if LSL_HAVE_FLOCK
+  for (;;)
+    {
+      lock_fd = ::open(path.data(), O_RDWR | O_CREAT, 0644);
+      if (lock_fd < 0)
+        throw std::runtime_error("cannot create block cache "s + path);
+      if (flock(lock_fd, LOCK_EX | LOCK_NB) != 0)
+        {
+          unlock();
+          throw std::runtime_error("block cache in use: "s + path);
+        }
+
+      struct stat locked, named;
+      if (fstat(lock_fd, &locked) == 0 && stat(path.data(), &named) == 0 &&
+          locked.st_dev == named.st_dev && locked.st_ino == named.st_ino)
+        return;
+      unlock();
+    }
+#endif
+}
+
+void block_cache::unlock()
+{
+#if LSL_HAVE_FLOCK
+  if (lock_fd >= 0)
+    ::close(lock_fd);
+#endif
+  lock_fd = -1;
+}
+
+/* Reads the index of an existing cache file, or makes a new one in place
+   of a missing or empty file. A record cut short by an interrupted build
+   is dropped. */
+void block_cache::load()
+{
+  auto const mode =
+      std::ios_base::binary | std::ios_base::in | std::ios_base::out;
+  lock();
+  file.open(path, mode);
+  if (file.is_open() && file.seekg(0, std::ios_base::end).tellg() == 0)
+    file.close();
+  if (!file.is_open())
+    {
+      file.open(path, mode | std::ios_base::trunc);
+      if (!file.is_open())
+        throw std::runtime_error("cannot create block cache "s + path);
+      generation = 1;
+      write_header(file, generation);
+      file_size = CACHE_HEADER_SIZE;
+      return;
+    }
+
+  char header[CACHE_HEADER_SIZE];
+  file.seekg(0);
+  if (!file.read(header, sizeof header) || le(header, 8) != CACHE_MAGIC)
+    throw std::runtime_error("not a block cache: "s + path);
+  generation = le(header + 8, 4) + 1;
+
+  file.seekg(0, std::ios_base::end);
+  uint64_t const length = file.tellg();
+  file.seekg(CACHE_HEADER_SIZE);
+
+  file_size = CACHE_HEADER_SIZE;
+  char buff[CACHE_ENTRY_SIZE];
+  while (length - file_size >= CACHE_ENTRY_SIZE &&
+         file.read(buff, sizeof buff))
+    {
+      entry e;
+      e.offset = file_size;
+      e.size = le(buff + 8, 4);
+      e.stored_size = le(buff + 12, 4);
+      e.type = le(buff + 16, 2);
+      e.level = le(buff + 18, 2);
+      e.block_log = le(buff + 20, 2);
+      e.generation = le(buff + 24, 4);
+      auto const next =
+          file_size + CACHE_ENTRY_SIZE + data_size(e.stored_size);
+      if (next > length)
+        break;
+      entries.emplace(le(buff, 8), e);
+      file_size = next;
+      file.seekg(file_size);
+    }
+
+  file.close();
+  filesystem::resize_file(path, file_size);
+  file.open(path, mode);
+  if (!file.is_open())
+    throw std::runtime_error("cannot open block cache "s + path);
+}
+
+/* Marks an entry as used by this build. Called with the mutex held. */
+void block_cache::touch(entry & e)
+{
+  if (e.generation == generation)
+    return;
+  e.generation = generation;
+  endian_buffer<4> buff;
+  buff.l32(generation);
+  file.seekp(e.offset + 24);
+  file.write(buff.data(), buff.size());
+}
+
+void block_cache::add(uint64_t const hash, entry e,
+                      block_type const & data)
+{
+  std::lock_guard<decltype(mutex)> lock(mutex);
+  e.offset = file_size;
+  e.generation = generation;
+  file.seekp(file_size);
+  write_entry(file, hash, e);
+  file.write(data.data(), data.size());
+  if (!file)
+    throw std::runtime_error("cannot write block cache "s + path);
+  file_size += CACHE_ENTRY_SIZE + data.size();
+  entries.emplace(hash, e);
+  ++counts.added;
+}
+
+compression_result block_cache::compress(compressor & comp,
+                                         block_type && in,
+                                         uint16_t const block_log)
+{
+  if (in.empty())
+    return comp.compress(std::move(in));
+
+  content_hash hash;
+  hash.update(in);
+  auto const key = hash.value();
+
+  /* Candidates are read under the lock and checked outside it. */
+  std::vector<std::pair<entry *, block_type>> candidates;
+  {
+    std::lock_guard<decltype(mutex)> lock(mutex);
+    auto const range = entries.equal_range(key);
+    for (auto i = range.first; i != range.second; ++i)
+      {
+        auto & e = i->second;
+        if (e.size != in.size() || e.type != comp.type ||
+            e.level != uint16_t(comp.level) || e.block_log != block_log)
+          continue;
+
+        block_type stored(data_size(e.stored_size));
+        file.seekg(e.offset + CACHE_ENTRY_SIZE);
+        if (!file.read(stored.data(), stored.size()))
+          {
+            file.clear();
+            continue;
+          }
+        candidates.emplace_back(&e, std::move(stored));
+      }
+  }
+
+  for (auto & candidate : candidates)
+    {
+      auto & stored = candidate.second;
+      bool const compressed =
+          !(candidate.first->stored_size & SQFS_BLOCK_COMPRESSED_BIT);
+      bool same = !compressed;
+      if (compressed)
+        try
+          {
+            same = comp.decompress(block_type(stored), in.size()) == in;
+          }
+        catch (std::runtime_error const &)
+          {
+          }
+
+      std::lock_guard<decltype(mutex)> lock(mutex);
+      if (!same)
+        {
+          ++counts.collisions;
+          continue;
+        }
+      touch(*candidate.first);
+      ++counts.hits;
+      return compressed ? compression_result{std::move(stored), true}
+                        : compression_result{std::move(in), false};
+    }
+
+  entry e;
+  e.size = in.size();
+  e.type = comp.type;
+  e.level = comp.level;
+  e.block_log = block_log;
+  auto result = comp.compress(std::move(in));
+  e.stored_size = result.compressed ? result.block.size()
+                                    : SQFS_BLOCK_COMPRESSED_BIT;
+  add(key, e, result.compressed ? result.block : block_type());
+  {
+    std::lock_guard<decltype(mutex)> lock(mutex);
+    ++counts.misses;
+  }
+  return result;
+}
+
+/* Keeps the most recently used entries that fit in the limit, in the
+   order they had in the file. */
+void block_cache::compact()
+{
+  std::vector<std::pair<uint64_t, entry const *>> order;
+  for (auto const & i : entries)
+    order.emplace_back(i.first, &i.second);
+  std::sort(order.begin(), order.end(), [](auto const & a, auto const & b) {
+    return a.second->generation != b.second->generation
+               ? a.second->generation > b.second->generation
+               : a.second->offset < b.second->offset;
+  });
+
+  uint64_t kept_size = CACHE_HEADER_SIZE;
+  std::size_t kept = 0;
+  for (; kept < order.size(); ++kept)
+    {
+      auto const size =
+          CACHE_ENTRY_SIZE + data_size(order[kept].second->stored_size);
+      if (kept_size + size > limit)
+        break;
+      kept_size += size;
+    }
+  counts.evicted += order.size() - kept;
+  order.resize(kept);
+  std::sort(order.begin(), order.end(), [](auto const & a, auto const & b) {
+    return a.second->offset < b.second->offset;
+  });
+
+  auto const temp = path + "~";
+  std::ofstream out(temp, std::ios_base::binary | std::ios_base::trunc);
+  write_header(out, generation);
+  for (auto const & i : order)
+    {
+      block_type data(data_size(i.second->stored_size));
+      file.seekg(i.second->offset + CACHE_ENTRY_SIZE);
+      file.read(data.data(), data.size());
+      write_entry(out, i.first, *i.second);
+      out.write(data.data(), data.size());
+    }
+  out.close();
+  if (!file || !out)
+    throw std::runtime_error("cannot compact block cache "s + path);
+
+  file.close();
+  if (std::rename(temp.data(), path.data()) != 0)
+    throw std::runtime_error("cannot replace block cache "s + path);
+}
+
+void block_cache::close()
+{
+  std::lock_guard<decltype(mutex)> lock(mutex);
+  if (!file.is_open())
+    return;
+  write_header(file, generation);
+  if (file_size > limit)
+    compact();
+  file.close();
+  unlock();
+}
+
+block_cache_stats block_cache::stats()
+{
+  std::lock_guard<decltype(mutex)> lock(mutex);
+  return counts;
+}
@@ -0,0 +1,99 @@
+/*
+Copyright (C) 2018  Charles Cagle
+
+This file is part of archive2sqfs.
+
+archive2sqfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3.
+
+archive2sqfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with archive2sqfs.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef LSL_BLOCK_CACHE_H
+#define LSL_BLOCK_CACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "compressor.h"
+
+#define BLOCK_CACHE_SIZE_DEFAULT (uint64_t(1) << 30)
+
+struct block_cache_stats
+{
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+  uint64_t collisions = 0;
+  uint64_t added = 0;
+  uint64_t evicted = 0;
+};
+
+/* A cache of compressed data blocks that persists across builds in one
+   file. Entries are found by a hash of the uncompressed block together
+   with its size, the compressor, its level and the block size, and a hit
+   is only used after the stored block decompresses to the same bytes.
+   Blocks that do not compress are remembered without their data.
+
+   New entries are appended to the file as they are made. When the cache
+   is closed and the file is larger than its limit, the entries used
+   longest ago are dropped by writing the rest to a new file. The file is
+   locked from opening the cache to closing it, where the system has
+   flock, so that two builds do not append to it at once. */
+class block_cache
+{
+  struct entry
+  {
+    uint64_t offset;
+    uint32_t size;
+    uint32_t stored_size;
+    uint16_t type;
+    uint16_t level;
+    uint16_t block_log;
+    uint32_t generation;
+  };
+
+  std::string const path;
+  uint64_t const limit;
+  std::fstream file;
+  std::mutex mutex;
+  std::unordered_multimap<uint64_t, entry> entries;
+  uint64_t file_size;
+  uint32_t generation;
+  block_cache_stats counts;
+  int lock_fd = -1;
+
+  void lock();
+  void unlock();
+  void load();
+  void touch(entry &);
+  void add(uint64_t, entry, block_type const &);
+  void compact();
+
+public:
+  block_cache(std::string const & path, uint64_t limit);
+  ~block_cache();
+
+  /* Compresses a block with comp, or takes it from the cache. */
+  compression_result compress(compressor & comp, block_type && in,
+                              uint16_t block_log);
+
+  /* Writes the cache out, dropping old entries if it is over its limit.
+     It is not used afterwards. */
+  void close();
+
+  block_cache_stats stats();
+};
+
+#endif
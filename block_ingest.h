@@ -0,0 +1,144 @@
+/*
+Copyright (C) 2018  Charles Cagle
+
+This file is part of archive2sqfs.
+
+archive2sqfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3.
+
+archive2sqfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with archive2sqfs.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef LSL_BLOCK_INGEST_H
+#define LSL_BLOCK_INGEST_H
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <future>
+#include <utility>
+#include <vector>
+
+#include "content_hash.h"
+#include "entry_header.h"
+#include "optional.h"
+
+/* A block of file data, and the hash of just that block if the source
+   was asked for it. */
+struct ingest_block
+{
+  std::vector<char> data;
+  optional<content_hash> hash;
+
+  void compute_hash()
+  {
+    content_hash h;
+    h.update(data);
+    hash = std::move(h);
+  }
+};
+
+/* Hands out the entries that source S scanned ahead of time, and their
+   file data as blocks. S splits the blocks into ranges, which tasks
+   prepare up to window ranges ahead of the tree builder. Blocks are still
+   handed out in entry order, so the image is the same as one built
+   serially. S provides entries, first_block (the index of each entry's
+   first block, plus the total), range_ends, and prepare(first, last). */
+template <typename S> class block_ingest
+{
+  S source;
+  std::size_t const window;
+  std::launch const policy;
+  std::deque<std::future<std::vector<ingest_block>>> ranges;
+  std::size_t next_range = 0;
+  std::vector<ingest_block> range;
+  std::size_t range_offset = 0;
+
+  std::size_t position = 0;
+  std::size_t next_block_index = 0;
+
+  entry_header const & current() const
+  {
+    return source.entries[position - 1];
+  }
+
+  ingest_block take_block()
+  {
+    if (range_offset == range.size())
+      {
+        auto const & ends = source.range_ends;
+        while (ranges.size() < window && next_range < ends.size())
+          {
+            auto const first = next_range ? ends[next_range - 1] : 0;
+            auto const last = ends[next_range++];
+            ranges.push_back(std::async(policy, [this, first, last]() {
+              return source.prepare(first, last);
+            }));
+          }
+
+        range = ranges.front().get();
+        ranges.pop_front();
+        range_offset = 0;
+      }
+
+    ++next_block_index;
+    return std::move(range[range_offset++]);
+  }
+
+public:
+  template <typename... A>
+  block_ingest(std::size_t const window, std::launch const policy,
+               A &&... a)
+      : source(std::forward<A>(a)...), window(window), policy(policy)
+  {
+  }
+
+  block_ingest(block_ingest const &) = delete;
+
+  bool next()
+  {
+    skip();
+    if (position == source.entries.size())
+      return false;
+    ++position;
+    return true;
+  }
+
+  void skip()
+  {
+    while (next_block_index < source.first_block[position])
+      take_block();
+  }
+
+  /* Returns the next block of the current entry's data. */
+  optional<ingest_block> next_block()
+  {
+    if (next_block_index == source.first_block[position])
+      return {};
+    return take_block();
+  }
+
+  /* The source, and the index of the current entry among its entries. */
+  S const & scanned() const { return source; }
+  std::size_t index() const { return position - 1; }
+
+  auto pathname() const { return current().pathname(); }
+  auto filetype() const { return current().filetype(); }
+  auto mode() const { return current().mode(); }
+  auto uid() const { return current().uid(); }
+  auto gid() const { return current().gid(); }
+  auto mtime() const { return current().mtime(); }
+  auto filesize() const { return current().filesize(); }
+  auto rdev() const { return current().rdev(); }
+  auto symlink_target() const { return current().symlink_target(); }
+  auto hardlink_target() const { return current().hardlink_target(); }
+};
+
+#endif
@@ -19,6 +19,7 @@ along with archive2sqfs.  If not, see <http://www.gnu.org/licenses/>.
 #ifndef LSL_BOUNDED_WORK_QUEUE_H
 #define LSL_BOUNDED_WORK_QUEUE_H
 
+#include <chrono>
 #include <condition_variable>
 #include <cstddef>
 #include <mutex>
@@ -29,12 +30,29 @@ along with archive2sqfs.  If not, see <http://www.gnu.org/licenses/>.
 
 template <typename T> class bounded_work_queue
 {
+public:
+  using clock = std::chrono::steady_clock;
+
+private:
   bool finished;
   std::size_t bound;
   std::queue<T> queue;
   std::mutex mutex;
   std::condition_variable popped;
   std::condition_variable pushed;
+  clock::duration push_stall{0};
+  clock::duration pop_stall{0};
+
+  template <typename P>
+  void wait(std::unique_lock<std::mutex> & lock, std::condition_variable & cv,
+            clock::duration & stall, P ready)
+  {
+    if (ready())
+      return;
+    auto const start = clock::now();
+    cv.wait(lock, ready);
+    stall += clock::now() - start;
+  }
 
 public:
   bounded_work_queue(std::size_t bound) : finished(false), bound(bound) {}
@@ -42,7 +60,7 @@ public:
   void push(T && e)
   {
     std::unique_lock<decltype(mutex)> lock(mutex);
-    popped.wait(lock, [&]() { return queue.size() < bound; });
+    wait(lock, popped, push_stall, [&]() { return queue.size() < bound; });
     queue.push(std::move(e));
     pushed.notify_all();
   }
@@ -50,7 +68,8 @@ public:
   optional<T> pop()
   {
     std::unique_lock<decltype(mutex)> lock(mutex);
-    pushed.wait(lock, [&]() { return finished || !queue.empty(); });
+    wait(lock, pushed, pop_stall,
+         [&]() { return finished || !queue.empty(); });
     if (queue.empty())
       return {};
     auto e = std::move(queue.front());
@@ -65,6 +84,20 @@ public:
     finished = true;
     pushed.notify_all();
   }
+
+  /* Total time producers spent blocked on a full queue. */
+  clock::duration push_stall_time()
+  {
+    std::lock_guard<decltype(mutex)> guard(mutex);
+    return push_stall;
+  }
+
+  /* Total time consumers spent blocked on an empty queue. */
+  clock::duration pop_stall_time()
+  {
+    std::lock_guard<decltype(mutex)> guard(mutex);
+    return pop_stall;
+  }
 };
 
 #endif
@@ -0,0 +1,390 @@
+/*
+Copyright (C) 2018  Charles Cagle
+
+This file is part of archive2sqfs.
+
+archive2sqfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3.
+
+archive2sqfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with archive2sqfs.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+using namespace std::literals;
+
+#include "checkpoint.h"
+#include "dirtree.h"
+#include "endian_buffer.h"
+#include "posix_io.h"
+#include "sqsh_defs.h"
+#include "sqsh_writer.h"
+
+/* "afqs-ck1" */
+static constexpr uint64_t CHECKPOINT_MAGIC = 0x316b632d73716661;
+
+static std::runtime_error invalid_checkpoint(std::string const & path)
+{
+  return std::runtime_error("invalid checkpoint: "s + path);
+}
+
+static void put_bytes(endian_buffer<0> & out, char const * const data,
+                      std::size_t const len)
+{
+  out.l64(len);
+  for (std::size_t i = 0; i < len; ++i)
+    out.l8(data[i]);
+}
+
+static void put_node(endian_buffer<0> & out, dirtree const & node,
+                     std::unordered_map<uint32_t, bool> & saved)
+{
+  out.l32(node.inode_number);
+  if (!saved.emplace(node.inode_number, true).second)
+    return;
+
+  out.l16(node.inode_type);
+  out.l16(node.mode);
+  out.l32(node.uid);
+  out.l32(node.gid);
+  out.l32(node.mtime);
+  out.l32(node.nlink);
+  switch (node.inode_type)
+    {
+      case SQFS_INODE_TYPE_DIR:
+        {
+          auto const & dir = static_cast<dirtree_dir const &>(node);
+          auto const sorted = dir.sorted_entries();
+          out.l32(sorted.size());
+          for (auto const entry : sorted)
+            {
+              put_bytes(out, entry->first.data(), entry->first.size());
+              put_node(out, *entry->second, saved);
+            }
+        }
+        break;
+
+      case SQFS_INODE_TYPE_REG:
+        {
+          auto const & reg = static_cast<dirtree_reg const &>(node);
+          out.l64(reg.file_size);
+          out.l64(reg.sparse);
+          out.l64(reg.block_count);
+        }
+        break;
+
+      case SQFS_INODE_TYPE_SYM:
+        {
+          auto const & sym = static_cast<dirtree_sym const &>(node);
+          put_bytes(out, sym.target.data(), sym.target.size());
+        }
+        break;
+
+      case SQFS_INODE_TYPE_BLK:
+      case SQFS_INODE_TYPE_CHR:
+        out.l32(static_cast<dirtree_dev const &>(node).rdev);
+        break;
+    }
+}
+
+static void put_dedup(endian_buffer<0> & out, dedup_index const & index)
+{
+  out.l64(index.size());
+  index.for_each([&](uint64_t const key, uint32_t const value) {
+    out.l64(key);
+    out.l32(value);
+  });
+}
+
+/* Flushes a file or directory to disk, and returns false if that fails.
+   Where there is no fsync, nothing is done. */
+static bool sync_path(std::string const & path)
+{
+#if LSL_HAVE_FSYNC
+  int const fd = open(path.data(), O_RDONLY);
+  if (fd < 0)
+    return false;
+  bool const synced = fsync(fd) == 0;
+  close(fd);
+  return synced;
+#else
+  (void)path;
+  return true;
+#endif
+}
+
+void save_checkpoint(std::string const & path, sqsh_writer & wr,
+                     dirtree_dir & root, checkpoint_position const position)
+{
+  wr.sync();
+
+  endian_buffer<0> out;
+  out.l64(CHECKPOINT_MAGIC);
+  out.l64(position.input);
+  out.l64(position.entries);
+  out.l16(wr.comp->type);
+  out.l16(wr.super.block_log);
+  out.l8(wr.dedup_enabled);
+  out.l64(wr.outfile.tellp());
+  out.l32(wr.next_inode);
+
+  out.l32(wr.fragment_count);
+  for (auto const & frag : wr.fragments)
+    {
+      out.l64(frag.start_block);
+      out.l32(frag.size);
+    }
+  put_bytes(out, wr.current_fragment.data(), wr.current_fragment.size());
+
+  out.l64(wr.fragment_indices.size());
+  for (auto const & i : wr.fragment_indices)
+    {
+      out.l32(i.first);
+      out.l32(i.second.fragment);
+      out.l32(i.second.offset);
+    }
+
+  out.l64(wr.reports.size());
+  for (auto const & r : wr.reports)
+    {
+      out.l32(r.first);
+      out.l64(r.second.start_block);
+      out.l64(r.second.sizes.size());
+      for (auto const size : r.second.sizes)
+        out.l32(size);
+    }
+
+  put_dedup(out, wr.fragmented_duplicates);
+  put_dedup(out, wr.blocked_duplicates);
+
+  std::unordered_map<uint32_t, bool> saved;
+  put_node(out, root, saved);
+
+  auto const temp = path + "~";
+  std::ofstream file(temp, std::ios_base::binary | std::ios_base::trunc);
+  file.write(out.data(), out.size());
+  file.close();
+  if (!file || !sync_path(temp) || std::rename(temp.data(), path.data()) != 0)
+    throw std::runtime_error("cannot write checkpoint "s + path);
+
+  /* The rename itself is only on disk once the directory is. */
+  auto const slash = path.rfind('/');
+  sync_path(slash == std::string::npos ? "."s
+                                       : path.substr(0, slash ? slash : 1));
+}
+
+/* Reads the fields of a checkpoint in order. */
+struct checkpoint_cursor
+{
+  std::string const & path;
+  std::vector<char> const & data;
+  std::size_t position = 0;
+
+  uint64_t take(std::size_t const len)
+  {
+    if (data.size() - position < len)
+      throw invalid_checkpoint(path);
+    uint64_t value = 0;
+    for (std::size_t i = len; i-- > 0;)
+      value = value << 8 | static_cast<unsigned char>(data[position + i]);
+    position += len;
+    return value;
+  }
+
+  uint8_t u8() { return take(1); }
+  uint16_t u16() { return take(2); }
+  uint32_t u32() { return take(4); }
+  uint64_t u64() { return take(8); }
+
+  std::vector<char> bytes()
+  {
+    auto const len = u64();
+    if (data.size() - position < len)
+      throw invalid_checkpoint(path);
+    std::vector<char> v(data.begin() + position,
+                        data.begin() + position + len);
+    position += len;
+    return v;
+  }
+
+  std::string string()
+  {
+    auto const v = bytes();
+    return std::string(v.begin(), v.end());
+  }
+};
+
+static std::shared_ptr<dirtree>
+get_node(checkpoint_cursor & in, sqsh_writer & wr,
+         std::unordered_map<uint32_t, std::shared_ptr<dirtree>> & loaded,
+         dirtree_dir * const root = nullptr)
+{
+  auto const inode_number = in.u32();
+  auto const found = loaded.find(inode_number);
+  if (found != loaded.end())
+    return found->second;
+
+  auto const type = in.u16();
+  auto const mode = in.u16();
+  auto const uid = in.u32();
+  auto const gid = in.u32();
+  auto const mtime = in.u32();
+  auto const nlink = in.u32();
+  if (root != nullptr && type != SQFS_INODE_TYPE_DIR)
+    throw invalid_checkpoint(in.path);
+
+  std::shared_ptr<dirtree> node;
+  switch (type)
+    {
+      case SQFS_INODE_TYPE_DIR:
+        {
+          auto dir = root;
+          if (dir == nullptr)
+            {
+              auto made =
+                  std::make_shared<dirtree_dir>(&wr, mode, uid, gid, mtime);
+              dir = made.get();
+              node = std::move(made);
+            }
+          for (auto count = in.u32(); count > 0; --count)
+            {
+              auto const name = in.string();
+              dir->put_child(name, get_node(in, wr, loaded));
+            }
+        }
+        break;
+
+      case SQFS_INODE_TYPE_REG:
+        {
+          auto reg =
+              std::make_shared<dirtree_reg>(&wr, mode, uid, gid, mtime);
+          reg->file_size = in.u64();
+          reg->sparse = in.u64();
+          reg->block_count = in.u64();
+          node = reg;
+        }
+        break;
+
+      case SQFS_INODE_TYPE_SYM:
+        node = std::make_shared<dirtree_sym>(&wr, in.string(), mode, uid, gid,
+                                             mtime);
+        break;
+
+      case SQFS_INODE_TYPE_BLK:
+      case SQFS_INODE_TYPE_CHR:
+        node = std::make_shared<dirtree_dev>(&wr, type, in.u32(), mode, uid,
+                                             gid, mtime);
+        break;
+
+      case SQFS_INODE_TYPE_PIPE:
+      case SQFS_INODE_TYPE_SOCK:
+        node = std::make_shared<dirtree_ipc>(&wr, type, mode, uid, gid,
+                                             mtime);
+        break;
+
+      default:
+        throw invalid_checkpoint(in.path);
+    }
+
+  dirtree & restored = node ? *node : *root;
+  restored.inode_number = inode_number;
+  restored.nlink = nlink;
+  if (root != nullptr)
+    {
+      root->mode = mode;
+      root->uid = uid;
+      root->gid = gid;
+      root->mtime = mtime;
+    }
+  if (node)
+    loaded.emplace(inode_number, node);
+  return node;
+}
+
+static void get_dedup(checkpoint_cursor & in, dedup_index & index)
+{
+  auto const count = in.u64();
+  index.reserve(count);
+  for (uint64_t i = 0; i < count; ++i)
+    {
+      auto const key = in.u64();
+      index.insert(key, in.u32());
+    }
+}
+
+checkpoint_position load_checkpoint(std::string const & path,
+                                    sqsh_writer & wr, dirtree_dir & root)
+{
+  std::ifstream file(path, std::ios_base::binary);
+  if (!file)
+    throw std::runtime_error("cannot read checkpoint "s + path);
+  std::vector<char> const data{std::istreambuf_iterator<char>(file),
+                               std::istreambuf_iterator<char>()};
+  checkpoint_cursor in{path, data};
+
+  if (in.u64() != CHECKPOINT_MAGIC)
+    throw invalid_checkpoint(path);
+  checkpoint_position position;
+  position.input = in.u64();
+  position.entries = in.u64();
+  if (in.u16() != wr.comp->type || in.u16() != wr.super.block_log ||
+      in.u8() != wr.dedup_enabled)
+    throw std::runtime_error(
+        "checkpoint was saved with other image settings"s);
+  auto const data_end = in.u64();
+  auto const next_inode = in.u32();
+
+  wr.fragment_count = in.u32();
+  wr.fragments.clear();
+  for (uint32_t i = 0; i < wr.fragment_count; ++i)
+    {
+      auto const start_block = in.u64();
+      wr.fragments.push_back({start_block, in.u32()});
+    }
+  wr.current_fragment = in.bytes();
+
+  for (auto count = in.u64(); count > 0; --count)
+    {
+      auto & index = wr.fragment_indices[in.u32()];
+      index.fragment = in.u32();
+      index.offset = in.u32();
+    }
+
+  for (auto count = in.u64(); count > 0; --count)
+    {
+      auto & report = wr.reports[in.u32()];
+      report.start_block = in.u64();
+      report.sizes.resize(in.u64());
+      for (auto & size : report.sizes)
+        size = in.u32();
+    }
+
+  get_dedup(in, wr.fragmented_duplicates);
+  get_dedup(in, wr.blocked_duplicates);
+
+  std::unordered_map<uint32_t, std::shared_ptr<dirtree>> loaded;
+  get_node(in, wr, loaded, &root);
+  if (in.position != data.size())
+    throw invalid_checkpoint(path);
+
+  wr.next_inode = next_inode;
+  wr.outfile.seekp(data_end);
+  return position;
+}
@@ -0,0 +1,51 @@
+/*
+Copyright (C) 2018  Charles Cagle
+
+This file is part of archive2sqfs.
+
+archive2sqfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3.
+
+archive2sqfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with archive2sqfs.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef LSL_CHECKPOINT_H
+#define LSL_CHECKPOINT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "dirtree.h"
+#include "sqsh_writer.h"
+
+/* How far the inputs had been read: the number of the input being read,
+   and the number of its selected entries already in the tree. */
+struct checkpoint_position
+{
+  std::size_t input = 0;
+  uint64_t entries = 0;
+};
+
+/* Saves the state of a build between two entries to path, replacing the
+   previous checkpoint. The writer is synced first, so the data that the
+   checkpoint refers to is on disk before it is. The state is the tree,
+   the writer's block reports, fragments and dedup indexes, the fragment
+   being filled, and the end of the data written so far. */
+void save_checkpoint(std::string const & path, sqsh_writer &,
+                     dirtree_dir & root, checkpoint_position);
+
+/* Restores a build saved by save_checkpoint into a writer opened in
+   append mode on the same output and an empty root, and returns where
+   reading the inputs should continue. */
+checkpoint_position load_checkpoint(std::string const & path, sqsh_writer &,
+                                    dirtree_dir & root);
+
+#endif
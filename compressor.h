@@ -22,6 +22,7 @@ along with archive2sqfs.  If not, see <http://www.gnu.org/licenses/>.
 #include <cstddef>
 #include <future>
 #include <memory>
+#include <stdexcept>
 #include <string>
 #include <utility>
 #include <vector>
@@ -41,6 +42,7 @@ struct compression_result
 struct compressor
 {
   uint16_t const type;
+  int const level;
   virtual compression_result compress(block_type &&) = 0;
   virtual block_type decompress(block_type &&, std::size_t) = 0;
   virtual ~compressor() = default;
@@ -52,14 +54,14 @@ struct compressor
     return std::async(policy, &compressor::compress, this, std::move(in));
   }
 
-  compressor(uint16_t type) : type(type) {}
+  compressor(uint16_t type, int level) : type(type), level(level) {}
 };
 
 struct compressor_zlib : public compressor
 {
   virtual compression_result compress(block_type &&);
   virtual block_type decompress(block_type &&, std::size_t);
-  compressor_zlib() : compressor(SQFS_COMPRESSION_TYPE_ZLIB) {}
+  compressor_zlib() : compressor(SQFS_COMPRESSION_TYPE_ZLIB, 9) {}
 };
 
 #if LSL_ENABLE_COMP_zstd
@@ -67,7 +69,7 @@ struct compressor_zstd : public compressor
 {
   virtual compression_result compress(block_type &&);
   virtual block_type decompress(block_type &&, std::size_t);
-  compressor_zstd() : compressor(SQFS_COMPRESSION_TYPE_ZSTD) {}
+  compressor_zstd() : compressor(SQFS_COMPRESSION_TYPE_ZSTD, 15) {}
 };
 #endif
 
@@ -83,7 +85,7 @@ struct compressor_none : public compressor
     return std::move(in);
   }
 
-  compressor_none() : compressor(SQFS_COMPRESSION_TYPE_ZLIB) {}
+  compressor_none() : compressor(SQFS_COMPRESSION_TYPE_ZLIB, 0) {}
 };
 
 static inline compressor * get_compressor_for(std::string const & type)
@@ -100,6 +102,19 @@ static inline compressor * get_compressor_for(std::string const & type)
 #undef RETURN_IF
 }
 
+static inline std::string compressor_name(uint16_t const type)
+{
+  switch (type)
+    {
+      case SQFS_COMPRESSION_TYPE_ZLIB:
+        return "zlib"s;
+      case SQFS_COMPRESSION_TYPE_ZSTD:
+        return "zstd"s;
+    }
+  throw std::runtime_error("unknown compression type: "s +
+                           std::to_string(type));
+}
+
 static std::string const COMPRESSOR_DEFAULT = "zlib";
 
 template <typename C>
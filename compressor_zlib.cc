@@ -29,13 +29,14 @@ using namespace std::literals;
 #include "compressor.h"
 #include "sqsh_defs.h"
 
-static void compress_zlib(block_type & out, block_type const & in)
+static void compress_zlib(block_type & out, block_type const & in,
+                          int const level)
 {
   auto zsize = compressBound(in.size());
   out.resize(zsize);
   if (compress2(reinterpret_cast<Bytef *>(out.data()), &zsize,
                 reinterpret_cast<Bytef const *>(in.data()), in.size(),
-                9) != Z_OK)
+                level) != Z_OK)
     throw std::runtime_error("failure in zlib::compress2"s);
   out.resize(zsize);
 }
@@ -43,7 +44,10 @@ static void compress_zlib(block_type & out, block_type const & in)
 compression_result compressor_zlib::compress(block_type && in)
 {
   block_type out;
-  bool const compressed = compress_data(compress_zlib, out, std::move(in));
+  auto const comp = [&](auto & out, auto const & in) {
+    compress_zlib(out, in, level);
+  };
+  bool const compressed = compress_data(comp, out, std::move(in));
   return {std::move(out), compressed};
 }
 
@@ -31,11 +31,12 @@ using namespace std::literals;
 #include "compressor.h"
 #include "sqsh_defs.h"
 
-static void compress_zstd(block_type & out, block_type const & in)
+static void compress_zstd(block_type & out, block_type const & in,
+                          int const level)
 {
   out.resize(ZSTD_compressBound(in.size()));
   auto const result =
-      ZSTD_compress(out.data(), out.size(), in.data(), in.size(), 15);
+      ZSTD_compress(out.data(), out.size(), in.data(), in.size(), level);
   if (ZSTD_isError(result))
     throw std::runtime_error("failure in ZSTD_compress"s);
   out.resize(result);
@@ -44,7 +45,10 @@ static void compress_zstd(block_type & out, block_type const & in)
 compression_result compressor_zstd::compress(block_type && in)
 {
   block_type out;
-  bool const compressed = compress_data(compress_zstd, out, std::move(in));
+  auto const comp = [&](auto & out, auto const & in) {
+    compress_zstd(out, in, level);
+  };
+  bool const compressed = compress_data(comp, out, std::move(in));
   return {std::move(out), compressed};
 }
 
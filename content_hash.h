@@ -0,0 +1,66 @@
+/*
+Copyright (C) 2018  Charles Cagle
+
+This file is part of archive2sqfs.
+
+archive2sqfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3.
+
+archive2sqfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with archive2sqfs.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef LSL_CONTENT_HASH_H
+#define LSL_CONTENT_HASH_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include <zlib.h>
+
+/* Both checksums can be combined from those of consecutive pieces, so
+   pieces of a file can be hashed apart and the results chained. */
+struct content_hash
+{
+  uLong crc;
+  uLong adler;
+  uint64_t size = 0;
+
+  content_hash() : crc(crc32_z(0, Z_NULL, 0)), adler(adler32_z(0, Z_NULL, 0))
+  {
+  }
+
+  void update(char const * const data, std::size_t const len)
+  {
+    auto const bytes = reinterpret_cast<Bytef const *>(data);
+    crc = crc32_z(crc, bytes, len);
+    adler = adler32_z(adler, bytes, len);
+    size += len;
+  }
+
+  /* Extends the hash with the data that next was computed over. */
+  void append(content_hash const & next)
+  {
+    crc = crc32_combine(crc, next.crc, z_off_t(next.size));
+    adler = adler32_combine(adler, next.adler, z_off_t(next.size));
+    size += next.size;
+  }
+
+  template <typename C> void update(C const & c)
+  {
+    update(c.data(), c.size());
+  }
+
+  uint64_t value() const
+  {
+    return (uint64_t(crc & 0xffffffffu) << 32) | (adler & 0xffffffffu);
+  }
+};
+
+#endif
@@ -0,0 +1,223 @@
+/*
+Copyright (C) 2018  Charles Cagle
+
+This file is part of archive2sqfs.
+
+archive2sqfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3.
+
+archive2sqfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with archive2sqfs.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+using namespace std::literals;
+
+#include "data_layout.h"
+#include "dirtree.h"
+
+data_layout::policy data_layout::policy_named(std::string const & name)
+{
+  if (name == "archive"s)
+    return ARCHIVE;
+  if (name == "directory"s)
+    return DIRECTORY;
+  if (name == "name"s)
+    return NAME;
+  if (name == "extension"s)
+    return EXTENSION;
+  throw std::runtime_error("unknown layout: "s + name);
+}
+
+/* A key that sorts paths in the order of the tree, with a directory's
+   entries right after it. */
+static std::string tree_order(std::string key)
+{
+  std::replace(key.begin(), key.end(), '/', '\0');
+  return key;
+}
+
+static std::string base_name(std::string const & key)
+{
+  auto const sep = key.rfind('/');
+  return sep == key.npos ? key : key.substr(sep + 1);
+}
+
+static std::string extension(std::string const & key)
+{
+  auto const name = base_name(key);
+  auto const dot = name.rfind('.');
+  return dot == name.npos || dot == 0 ? ""s : name.substr(dot + 1);
+}
+
+std::vector<std::size_t>
+data_layout::order(std::vector<entry> const & entries,
+                   uint64_t const block_size) const
+{
+  std::vector<std::size_t> order(entries.size());
+  std::iota(order.begin(), order.end(), std::size_t(0));
+  if (keeps_archive_order())
+    return order;
+
+  std::unordered_map<std::string, std::size_t> uses;
+  std::unordered_set<std::string> others;
+  for (auto const & e : entries)
+    {
+      ++uses[e.key];
+      if (!e.dir)
+        others.insert(e.key);
+    }
+  for (auto const & e : entries)
+    {
+      if (!e.target.empty() && (uses[e.key] > 1 || uses[e.target] > 1))
+        return order;
+      for (auto sep = e.key.find('/'); sep != e.key.npos;
+           sep = e.key.find('/', sep + 1))
+        if (others.count(e.key.substr(0, sep)) != 0)
+          return order;
+    }
+
+  std::unordered_map<std::string, std::size_t> rank;
+  for (std::size_t i = 0; i < hot.size(); ++i)
+    rank.emplace(hot[i], i);
+
+  struct sort_key
+  {
+    int group;
+    std::size_t rank;
+    std::string first;
+    std::string second;
+  };
+
+  /* Entries with the same path share the key of the first of them. */
+  std::unordered_map<std::string, std::size_t> first;
+  std::vector<sort_key> keys;
+  keys.reserve(entries.size());
+  for (auto const & e : entries)
+    {
+      auto const seen = first.emplace(e.key, keys.size());
+      if (!seen.second)
+        {
+          keys.push_back(keys[seen.first->second]);
+          continue;
+        }
+
+      sort_key k{2, 0, ""s, ""s};
+      auto const r = rank.find(e.key);
+      if (!e.target.empty())
+        k.group = 3;
+      else if (r != rank.end())
+        {
+          k.group = e.regular && e.size < block_size ? 0 : 1;
+          k.rank = r->second;
+        }
+      else if (kind == DIRECTORY)
+        k.first = tree_order(e.key);
+      else if (kind == NAME)
+        {
+          k.first = base_name(e.key);
+          k.second = tree_order(e.key);
+        }
+      else if (kind == EXTENSION)
+        {
+          k.first = extension(e.key);
+          k.second = tree_order(e.key);
+        }
+      keys.push_back(std::move(k));
+    }
+
+  std::stable_sort(order.begin(), order.end(),
+                   [&](std::size_t const a, std::size_t const b) {
+                     auto const & x = keys[a];
+                     auto const & y = keys[b];
+                     return std::tie(x.group, x.rank, x.first, x.second) <
+                            std::tie(y.group, y.rank, y.first, y.second);
+                   });
+  return order;
+}
+
+struct locality_counter
+{
+  sqsh_writer & wr;
+  read_locality counted;
+  bool started = false;
+  uint64_t end = 0;
+  std::unordered_set<uint64_t> cached;
+
+  explicit locality_counter(sqsh_writer & wr) : wr(wr) {}
+
+  void read(uint64_t const start, uint64_t const len)
+  {
+    if (len == 0)
+      return;
+    if (started)
+      {
+        ++counted.reads;
+        if (start == end)
+          ++counted.sequential;
+      }
+    started = true;
+    end = start + len;
+  }
+
+  void read_file(dirtree_reg const & reg)
+  {
+    auto const report = wr.reports.find(reg.inode_number);
+    if (report != wr.reports.end())
+      read(report->second.start_block, report->second.range_len());
+
+    auto const index = wr.fragment_indices.find(reg.inode_number);
+    if (index == wr.fragment_indices.end() ||
+        index->second.fragment == SQFS_FRAGMENT_NONE)
+      return;
+    auto const entry = wr.get_fragment_entry(index->second.fragment);
+    if (!entry)
+      return;
+    if (cached.insert(entry->start_block).second)
+      read(entry->start_block, entry->size & ~SQFS_BLOCK_COMPRESSED_BIT);
+  }
+
+  void read_tree(dirtree_dir const & dir)
+  {
+    for (auto const entry : dir.sorted_entries())
+      {
+        auto const & child = *entry->second;
+        if (child.inode_type == SQFS_INODE_TYPE_DIR)
+          read_tree(static_cast<dirtree_dir const &>(child));
+        else if (child.inode_type == SQFS_INODE_TYPE_REG)
+          read_file(static_cast<dirtree_reg const &>(child));
+      }
+  }
+};
+
+read_locality measure_locality(dirtree_dir & root,
+                               std::vector<std::string> const & paths)
+{
+  locality_counter counter(*root.wr);
+  if (paths.empty())
+    counter.read_tree(root);
+  for (auto const & path : paths)
+    {
+      auto const found = root.find(path);
+      if (found && found->inode_type == SQFS_INODE_TYPE_REG)
+        counter.read_file(static_cast<dirtree_reg const &>(*found));
+    }
+  return counter.counted;
+}
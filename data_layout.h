@@ -0,0 +1,90 @@
+/*
+Copyright (C) 2018  Charles Cagle
+
+This file is part of archive2sqfs.
+
+archive2sqfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3.
+
+archive2sqfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with archive2sqfs.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef LSL_DATA_LAYOUT_H
+#define LSL_DATA_LAYOUT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct dirtree_dir;
+
+/* Chooses where the data of an input's entries goes in the image, by
+   the order in which the entries are added to the tree. The tree itself
+   does not depend on it. Entries may be kept in archive order, put in
+   the order of the image's directories, or sorted by file name or by
+   extension. Paths on a hot list come first, in its order, with the hot
+   files smaller than a block before the others so that they share
+   fragment blocks. Paths are keys as dirtree sees them. */
+class data_layout
+{
+public:
+  enum policy
+  {
+    ARCHIVE,
+    DIRECTORY,
+    NAME,
+    EXTENSION
+  };
+
+  struct entry
+  {
+    std::string key;
+    std::string target;
+    bool dir;
+    bool regular;
+    uint64_t size;
+  };
+
+  policy kind = ARCHIVE;
+  std::vector<std::string> hot;
+
+  /* Throws for an unknown policy name. */
+  static policy policy_named(std::string const &);
+
+  bool keeps_archive_order() const { return kind == ARCHIVE && hot.empty(); }
+
+  /* Returns the order in which to add entries, which are given in archive
+     order. Hardlinks are added last, and entries with the same path keep
+     their order. Archive order is kept where moving entries could change
+     the tree: when a hardlink's path or target is given by more than one
+     entry, or when something other than a directory has entries below
+     it. */
+  std::vector<std::size_t> order(std::vector<entry> const & entries,
+                                 uint64_t block_size) const;
+};
+
+struct read_locality
+{
+  std::size_t reads = 0;
+  std::size_t sequential = 0;
+};
+
+/* Counts how many reads of file data would follow on from the previous
+   one when the files below root are read whole, in the order of paths or,
+   with no paths, in the order of the tree. A file is read as its run of
+   blocks and then its fragment block, unless that fragment block was read
+   before and is still cached. A read is sequential if it starts where the
+   previous one ended. Only valid once the writer has finished the data. */
+read_locality measure_locality(dirtree_dir & root,
+                               std::vector<std::string> const & paths);
+
+#endif
@@ -0,0 +1,144 @@
+/*
+Copyright (C) 2018  Charles Cagle
+
+This file is part of archive2sqfs.
+
+archive2sqfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3.
+
+archive2sqfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with archive2sqfs.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef LSL_DEDUP_INDEX_H
+#define LSL_DEDUP_INDEX_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "optional.h"
+
+/* Open-addressing multimap from a (file size, content hash) key to inode
+   numbers, with a Bloom filter rejecting most absent keys before the table
+   is probed. Each slot costs 12 bytes and the load factor stays within
+   [3/8, 3/4), plus one byte of filter per slot. Inode number 0 is never
+   allocated, so it marks an empty slot. */
+class dedup_index
+{
+  std::vector<uint64_t> keys;
+  std::vector<uint32_t> values;
+  std::vector<uint64_t> bloom;
+  std::size_t count = 0;
+
+  static constexpr unsigned bloom_probes = 3;
+
+  static uint64_t mix(uint64_t x)
+  {
+    x ^= x >> 30;
+    x *= UINT64_C(0xbf58476d1ce4e5b9);
+    x ^= x >> 27;
+    x *= UINT64_C(0x94d049bb133111eb);
+    return x ^ (x >> 31);
+  }
+
+  std::size_t mask() const { return keys.size() - 1; }
+
+  template <typename F> void for_each_bloom_bit(uint64_t const key, F f)
+  {
+    auto const bits = bloom.size() * 64 - 1;
+    uint64_t const h = mix(key);
+    uint64_t const step = (h >> 32) | 1;
+    for (unsigned i = 0; i < bloom_probes; ++i)
+      {
+        auto const bit = (h + i * step) & bits;
+        f(bloom[bit / 64], uint64_t(1) << (bit % 64));
+      }
+  }
+
+  bool bloom_maybe(uint64_t const key)
+  {
+    bool maybe = true;
+    for_each_bloom_bit(key, [&](auto & word, auto const bit) {
+      maybe = maybe && (word & bit) != 0;
+    });
+    return maybe;
+  }
+
+  void place(uint64_t const key, uint32_t const value)
+  {
+    auto slot = key & mask();
+    while (values[slot] != 0)
+      slot = (slot + 1) & mask();
+    keys[slot] = key;
+    values[slot] = value;
+    for_each_bloom_bit(key, [](auto & word, auto const bit) { word |= bit; });
+  }
+
+  void rehash(std::size_t const capacity)
+  {
+    auto old_keys = std::move(keys);
+    auto old_values = std::move(values);
+    keys.assign(capacity, 0);
+    values.assign(capacity, 0);
+    bloom.assign(capacity / 8 > 0 ? capacity / 8 : 1, 0);
+    for (std::size_t i = 0; i < old_values.size(); ++i)
+      if (old_values[i] != 0)
+        place(old_keys[i], old_values[i]);
+  }
+
+public:
+  dedup_index(std::size_t const capacity = 1024) { rehash(capacity); }
+
+  static uint64_t key_for(uint64_t const size, uint64_t const hash)
+  {
+    return mix(hash ^ mix(size));
+  }
+
+  void reserve(std::size_t const n)
+  {
+    std::size_t capacity = keys.size();
+    while (n * 4 >= capacity * 3)
+      capacity *= 2;
+    if (capacity != keys.size())
+      rehash(capacity);
+  }
+
+  void insert(uint64_t const key, uint32_t const value)
+  {
+    reserve(count + 1);
+    place(key, value);
+    ++count;
+  }
+
+  /* Calls same() on each candidate stored under key until one is
+     confirmed, and returns that candidate. */
+  template <typename F> optional<uint32_t> find(uint64_t const key, F same)
+  {
+    if (!bloom_maybe(key))
+      return {};
+
+    for (auto slot = key & mask(); values[slot] != 0;
+         slot = (slot + 1) & mask())
+      if (keys[slot] == key && same(values[slot]))
+        return uint32_t{values[slot]};
+    return {};
+  }
+
+  std::size_t size() const { return count; }
+
+  template <typename F> void for_each(F f) const
+  {
+    for (std::size_t i = 0; i < values.size(); ++i)
+      if (values[i] != 0)
+        f(keys[i], values[i]);
+  }
+};
+
+#endif
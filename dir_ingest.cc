@@ -0,0 +1,305 @@
+/*
+Copyright (C) 2018  Charles Cagle
+
+This file is part of archive2sqfs.
+
+archive2sqfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3.
+
+archive2sqfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with archive2sqfs.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <future>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+using namespace std::literals;
+
+#include <archive_entry.h>
+
+#include "block_ingest.h"
+#include "dir_ingest.h"
+#include "posix_io.h"
+
+#if LSL_HAVE_DIRENT
+
+static std::runtime_error system_error(std::string const & what,
+                                       std::string const & path)
+{
+  return std::runtime_error(what + " failed on "s + path);
+}
+
+static unsigned file_type(mode_t const mode)
+{
+  if (S_ISREG(mode))
+    return AE_IFREG;
+  if (S_ISDIR(mode))
+    return AE_IFDIR;
+  if (S_ISLNK(mode))
+    return AE_IFLNK;
+  if (S_ISBLK(mode))
+    return AE_IFBLK;
+  if (S_ISCHR(mode))
+    return AE_IFCHR;
+  if (S_ISFIFO(mode))
+    return AE_IFIFO;
+  if (S_ISSOCK(mode))
+    return AE_IFSOCK;
+  return 0;
+}
+
+static dir_entry make_entry(std::string path, struct stat const & st)
+{
+  dir_entry e;
+  e.path = std::move(path);
+  e.type = file_type(st.st_mode);
+  e.perm = st.st_mode & 07777;
+  e.user = st.st_uid;
+  e.group = st.st_gid;
+  e.time = st.st_mtime;
+  e.size = st.st_size;
+  e.device = e.type == AE_IFBLK || e.type == AE_IFCHR ? st.st_rdev : 0;
+  e.filesystem = st.st_dev;
+  e.inode = st.st_ino;
+  e.links = st.st_nlink;
+  return e;
+}
+
+static std::string full_path(std::string const & root,
+                             std::string const & path)
+{
+  return path.empty() ? root : root + '/' + path;
+}
+
+/* Lists the directory at path below root, sorted by name. */
+static std::vector<dir_entry> scan_directory(std::string const & root,
+                                             std::string const & path)
+{
+  auto const dirpath = full_path(root, path);
+  auto const dir = opendir(dirpath.data());
+  if (dir == nullptr)
+    throw system_error("opendir()"s, dirpath);
+
+  std::vector<dir_entry> listing;
+  try
+    {
+      auto const fd = dirfd(dir);
+      for (auto d = readdir(dir); d != nullptr; d = readdir(dir))
+        {
+          std::string const name = d->d_name;
+          if (name == "." || name == "..")
+            continue;
+
+          struct stat st;
+          if (fstatat(fd, name.data(), &st, AT_SYMLINK_NOFOLLOW) != 0)
+            throw system_error("fstatat()"s, full_path(dirpath, name));
+          listing.push_back(
+              make_entry(path.empty() ? name : path + '/' + name, st));
+
+          auto & e = listing.back();
+          if (e.type == AE_IFLNK)
+            {
+              e.link.resize(e.size + 1);
+              auto const len = readlinkat(fd, name.data(), &e.link[0],
+                                          e.link.size());
+              if (len < 0 || std::size_t(len) >= e.link.size())
+                throw system_error("readlinkat()"s, full_path(dirpath, name));
+              e.link.resize(len);
+            }
+        }
+    }
+  catch (...)
+    {
+      closedir(dir);
+      throw;
+    }
+  closedir(dir);
+
+  std::sort(listing.begin(), listing.end(),
+            [](auto const & a, auto const & b) { return a.path < b.path; });
+  return listing;
+}
+
+std::vector<dir_entry> dir_source::walk(std::string const & root,
+                                        std::size_t const window,
+                                        std::launch const policy)
+{
+  /* The root is followed if it is a symlink, as recognizes does. */
+  struct stat st;
+  if (stat(root.data(), &st) != 0)
+    throw system_error("stat()"s, root);
+  if (!S_ISDIR(st.st_mode))
+    throw std::runtime_error("not a directory: "s + root);
+
+  /* Directories are scanned a level at a time. */
+  std::unordered_map<std::string, std::vector<dir_entry>> listings;
+  std::vector<std::string> level = {""s};
+  while (!level.empty())
+    {
+      std::vector<std::string> next_level;
+      std::deque<std::pair<std::string, std::future<std::vector<dir_entry>>>>
+          scans;
+      auto const collect = [&]() {
+        auto listing = scans.front().second.get();
+        for (auto const & e : listing)
+          if (e.type == AE_IFDIR)
+            next_level.push_back(e.path);
+        listings.emplace(std::move(scans.front().first), std::move(listing));
+        scans.pop_front();
+      };
+
+      for (auto & path : level)
+        {
+          if (scans.size() >= window)
+            collect();
+          auto task = std::async(policy, scan_directory, root, path);
+          scans.emplace_back(std::move(path), std::move(task));
+        }
+      while (!scans.empty())
+        collect();
+      level = std::move(next_level);
+    }
+
+  std::vector<dir_entry> result;
+  result.push_back(make_entry(""s, st));
+  std::vector<std::vector<dir_entry> *> stack = {&listings[""s]};
+  std::vector<std::size_t> positions = {0};
+  while (!stack.empty())
+    {
+      auto & listing = *stack.back();
+      if (positions.back() == listing.size())
+        {
+          stack.pop_back();
+          positions.pop_back();
+          continue;
+        }
+
+      auto & e = listing[positions.back()++];
+      result.push_back(std::move(e));
+      if (result.back().type == AE_IFDIR)
+        {
+          stack.push_back(&listings[result.back().path]);
+          positions.push_back(0);
+        }
+    }
+
+  return result;
+}
+
+/* Reads blocks first to last of file e, hashing each of them. */
+void dir_source::read_file(dir_entry const & e, std::size_t const first,
+                           std::size_t const last,
+                           std::vector<ingest_block> & blocks) const
+{
+  auto const path = full_path(root, e.path);
+  auto const fd = open(path.data(), O_RDONLY);
+  if (fd < 0)
+    throw system_error("open()"s, path);
+
+  try
+    {
+      uint64_t const begin = uint64_t(first) * block_size;
+      uint64_t const end = std::min<uint64_t>(e.size, last * block_size);
+#if defined(POSIX_FADV_SEQUENTIAL)
+      posix_fadvise(fd, begin, end - begin, POSIX_FADV_SEQUENTIAL);
+#endif
+      for (auto off = begin; off < end; off += block_size)
+        {
+          ingest_block b;
+          b.data.resize(std::min<uint64_t>(block_size, e.size - off));
+          std::size_t done = 0;
+          while (done < b.data.size())
+            {
+              auto const len = pread(fd, b.data.data() + done,
+                                     b.data.size() - done, off + done);
+              if (len <= 0)
+                throw std::runtime_error("file changed while reading "s +
+                                         path);
+              done += len;
+            }
+          if (hash)
+            b.compute_hash();
+          blocks.push_back(std::move(b));
+        }
+    }
+  catch (...)
+    {
+      close(fd);
+      throw;
+    }
+  close(fd);
+}
+
+bool dir_source::recognizes(char const * const path)
+{
+  struct stat st;
+  return path != nullptr && stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+#else
+
+std::vector<dir_entry> dir_source::walk(std::string const &, std::size_t,
+                                        std::launch)
+{
+  throw std::runtime_error("directory input is not supported"s);
+}
+
+void dir_source::read_file(dir_entry const &, std::size_t, std::size_t,
+                           std::vector<ingest_block> &) const
+{
+}
+
+bool dir_source::recognizes(char const *) { return false; }
+
+#endif
+
+/* Makes each file other than a directory that shares an inode with an
+   earlier one a hard link to it. */
+void dir_source::link_files(std::vector<dir_entry> & files)
+{
+  std::map<std::pair<uint64_t, uint64_t>, std::string> first_paths;
+  for (auto & e : files)
+    if (e.type != AE_IFDIR && e.links > 1)
+      {
+        auto const placed = first_paths.emplace(
+            std::make_pair(e.filesystem, e.inode), e.path);
+        if (!placed.second)
+          {
+            e.has_hardlink = true;
+            e.hardlink = placed.first->second;
+          }
+      }
+}
+
+std::vector<ingest_block> dir_source::prepare(std::size_t const first,
+                                              std::size_t const last) const
+{
+  std::vector<ingest_block> blocks;
+  std::size_t i =
+      std::upper_bound(first_block.begin(), first_block.end(), first) -
+      first_block.begin() - 1;
+  for (; i < files.size() && first_block[i] < last; ++i)
+    {
+      auto const begin = std::max(first, first_block[i]);
+      auto const end = std::min(last, first_block[i + 1]);
+      if (begin < end)
+        read_file(files[i], begin - first_block[i], end - first_block[i],
+                  blocks);
+    }
+  return blocks;
+}
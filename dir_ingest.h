@@ -0,0 +1,151 @@
+/*
+Copyright (C) 2018  Charles Cagle
+
+This file is part of archive2sqfs.
+
+archive2sqfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3.
+
+archive2sqfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with archive2sqfs.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef LSL_DIR_INGEST_H
+#define LSL_DIR_INGEST_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <future>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <archive_entry.h>
+
+#include "block_ingest.h"
+#include "entry_header.h"
+
+/* One file found in a directory tree, with the same accessors as
+   archive_reader. Paths are relative to the root of the tree, which is
+   itself the entry with the empty path. */
+struct dir_entry
+{
+  std::string path;
+  std::string link;
+  std::string hardlink;
+  bool has_hardlink = false;
+  unsigned type;
+  uint16_t perm;
+  int64_t user;
+  int64_t group;
+  int64_t time;
+  uint64_t size;
+  uint64_t device;
+  uint64_t filesystem;
+  uint64_t inode;
+  uint64_t links;
+
+  char const * pathname() const { return path.data(); }
+  unsigned filetype() const { return type; }
+  uint16_t mode() const { return perm; }
+  int64_t uid() const { return user; }
+  int64_t gid() const { return group; }
+  int64_t mtime() const { return time; }
+  int64_t filesize() const { return type == AE_IFREG ? size : 0; }
+  uint64_t rdev() const { return device; }
+  char const * symlink_target() const { return link.data(); }
+
+  char const * hardlink_target() const
+  {
+    return has_hardlink ? hardlink.data() : nullptr;
+  }
+};
+
+/* Walks a directory tree with one task per directory, window directories
+   at a time, and lists it in sorted depth-first order so that the image
+   does not depend on the order the tasks finish in. Files that share an
+   inode become hard links to the first of them. File data is cut into
+   ranges of whole blocks, so a large file is spread over several ranges,
+   which block_ingest's tasks read with pread and hash as they go. The
+   entries are handed out in the order that order returns for them. */
+class dir_source
+{
+  std::string const root;
+  std::size_t const block_size;
+  bool const hash;
+  std::vector<dir_entry> files;
+
+  static std::vector<dir_entry> walk(std::string const &, std::size_t,
+                                     std::launch);
+  static void link_files(std::vector<dir_entry> &);
+  void read_file(dir_entry const &, std::size_t, std::size_t,
+                 std::vector<ingest_block> &) const;
+
+public:
+  std::vector<entry_header> entries;
+  std::vector<std::size_t> first_block;
+  std::vector<std::size_t> range_ends;
+
+  template <typename P, typename O>
+  dir_source(std::string const & root, P selected, std::size_t window,
+             std::launch policy, std::size_t block_size, bool hash,
+             O order);
+
+  /* Returns whether path names a directory that can be walked. */
+  static bool recognizes(char const * path);
+
+  std::vector<ingest_block> prepare(std::size_t, std::size_t) const;
+};
+
+using dir_ingest = block_ingest<dir_source>;
+
+template <typename P, typename O>
+dir_source::dir_source(std::string const & root, P selected,
+                       std::size_t const window, std::launch const policy,
+                       std::size_t const block_size, bool const hash,
+                       O order)
+    : root(root), block_size(block_size), hash(hash)
+{
+  static uint64_t constexpr range_bytes = 4 << 20;
+  static std::size_t constexpr range_blocks = 1024;
+
+  std::vector<dir_entry> walked;
+  for (auto & entry : walk(root, window, policy))
+    if (selected(entry))
+      walked.push_back(std::move(entry));
+  link_files(walked);
+
+  std::vector<entry_header> scanned(walked.begin(), walked.end());
+  std::size_t blocks = 0;
+  uint64_t bytes = 0;
+  for (auto const i : order(scanned))
+    {
+      files.push_back(std::move(walked[i]));
+      entries.push_back(std::move(scanned[i]));
+      first_block.push_back(blocks);
+      uint64_t const size = entries.back().filesize();
+      for (uint64_t off = 0; off < size; off += block_size)
+        {
+          ++blocks;
+          bytes += std::min<uint64_t>(block_size, size - off);
+          auto const first = range_ends.empty() ? 0 : range_ends.back();
+          if (bytes >= range_bytes || blocks - first >= range_blocks)
+            {
+              range_ends.push_back(blocks);
+              bytes = 0;
+            }
+        }
+    }
+  first_block.push_back(blocks);
+  if (range_ends.empty() || range_ends.back() != blocks)
+    range_ends.push_back(blocks);
+}
+
+#endif
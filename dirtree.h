@@ -21,13 +21,16 @@ along with archive2sqfs.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <cstdint>
 #include <iostream>
-#include <map>
 #include <memory>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
+#include "content_hash.h"
+#include "optional.h"
 #include "sqsh_defs.h"
 #include "sqsh_writer.h"
+#include "string_view.h"
 
 struct dirtree
 {
@@ -40,6 +43,7 @@ struct dirtree
   meta_address inode_address;
   uint32_t nlink;
   uint32_t xattr;
+  bool inode_written = false;
   sqsh_writer * wr;
 
   dirtree(sqsh_writer * wr, uint16_t inode_type, uint16_t mode = 0644,
@@ -60,7 +64,6 @@ struct dirtree
     mtime = ms.mtime();
   }
 
-  virtual void write_inode(uint32_t) = 0;
   void write_tables();
 
   virtual ~dirtree() = default;
@@ -73,8 +76,6 @@ struct dirtree_ipc : public dirtree
       : dirtree(wr, type, mode, uid, gid, mtime)
   {
   }
-
-  virtual void write_inode(uint32_t);
 };
 
 struct dirtree_reg : public dirtree
@@ -93,10 +94,16 @@ struct dirtree_reg : public dirtree
     block_count = 0;
   }
 
+  void hash_block(std::vector<char> const &, optional<content_hash> const &);
   void append(char const *, std::size_t);
+  void append(std::vector<char> &&,
+              optional<content_hash> const & = optional<content_hash>());
+  void append_raw(std::vector<char> &&, uint32_t, std::size_t,
+                  optional<content_hash> const & = optional<content_hash>());
+  void append_raw_fragment(fragment_index, std::size_t);
   void flush();
+  void end_blocks();
   void finalize();
-  virtual void write_inode(uint32_t);
 
   template <typename T> void append(T & con)
   {
@@ -115,8 +122,6 @@ struct dirtree_sym : public dirtree
         target(target)
   {
   }
-
-  virtual void write_inode(uint32_t);
 };
 
 struct dirtree_dev : public dirtree
@@ -129,14 +134,53 @@ struct dirtree_dev : public dirtree
       : dirtree(wr, type, mode, uid, gid, mtime), rdev(rdev)
   {
   }
+};
+
+struct dirtree_dir;
+
+struct path_cache
+{
+  uint64_t generation = 0;
+  std::string names;
+  std::vector<std::size_t> ends;
+  std::vector<dirtree_dir *> dirs;
+
+  std::size_t depth() const { return dirs.size(); }
+
+  string_view name(std::size_t const i) const
+  {
+    auto const begin = i == 0 ? 0 : ends[i - 1];
+    return string_view(names).substr(begin, ends[i] - begin);
+  }
+
+  void truncate(std::size_t const depth)
+  {
+    if (depth >= dirs.size())
+      return;
+    names.resize(depth == 0 ? 0 : ends[depth - 1]);
+    ends.resize(depth);
+    dirs.resize(depth);
+  }
 
-  virtual void write_inode(uint32_t);
+  void push(string_view const name, dirtree_dir * const dir)
+  {
+    names.append(name.data(), name.size());
+    ends.push_back(names.size());
+    dirs.push_back(dir);
+  }
 };
 
 struct dirtree_dir : public dirtree
 {
-  std::map<std::string, std::unique_ptr<dirtree>> entries;
+  using entry_type = std::pair<std::string const, std::shared_ptr<dirtree>>;
+
+  std::unordered_map<std::string, std::shared_ptr<dirtree>> entries;
+  std::unique_ptr<path_cache> cache;
+  /* The entries in order, sorted ahead of writing the tables. */
+  std::unique_ptr<std::vector<entry_type const *>> presorted;
   uint32_t filesize;
+  /* The number of the directory table block the listing starts in, which
+     the directory table's writer turns into where that block starts. */
   uint32_t dtable_start_block;
   uint16_t dtable_start_offset;
 
@@ -147,24 +191,29 @@ struct dirtree_dir : public dirtree
   }
 
   dirtree & put_child(std::string const & name,
-                      std::unique_ptr<dirtree> && child)
+                      std::shared_ptr<dirtree> && child)
   {
-    return *(entries[name] = std::move(child));
+    auto & slot = entries[name];
+    if (slot && slot->inode_type == SQFS_INODE_TYPE_DIR)
+      ++wr->tree_generation;
+    return *(slot = std::move(child));
   }
 
-  dirtree_dir & get_subdir(std::string const &);
-  virtual void write_inode(uint32_t);
-  dirtree_dir & subdir_for_path(std::string const &);
-  dirtree & put_file(std::string const &, std::unique_ptr<dirtree> &&);
+  std::vector<entry_type const *> sorted_entries() const;
+  dirtree_dir & get_subdir(string_view);
+  dirtree_dir & subdir_for_path(string_view);
+  dirtree & put_file(string_view, std::shared_ptr<dirtree> &&);
+  std::shared_ptr<dirtree> find(string_view);
+  bool put_hardlink(string_view, string_view);
 
   template <typename T, typename... A>
-  T & put_file(std::string const & name, A... a)
+  T & put_file(string_view const name, A... a)
   {
-    return static_cast<T &>(put_file(name, std::make_unique<T>(wr, a...)));
+    return static_cast<T &>(put_file(name, std::make_shared<T>(wr, a...)));
   }
 
   template <typename T, typename MS, typename... A>
-  T & put_file_with_metadata(std::string const & name, MS const & ms, A... a)
+  T & put_file_with_metadata(string_view const name, MS const & ms, A... a)
   {
     return put_file<T>(name, a..., ms.mode(), ms.uid(), ms.gid(), ms.mtime());
   }
@@ -17,42 +17,125 @@ along with archive2sqfs.  If not, see <http://www.gnu.org/licenses/>.
 */
 
 #include <algorithm>
-#include <iostream>
 #include <memory>
-#include <sstream>
+#include <string>
 #include <vector>
 
 #include "dirtree.h"
 #include "sqsh_defs.h"
 #include "sqsh_writer.h"
+#include "string_view.h"
 
-dirtree_dir & dirtree_dir::subdir_for_path(std::string const & path)
+template <typename F>
+static void for_each_component(string_view const path, F f)
 {
+  std::size_t begin = 0;
+  while (begin <= path.size())
+    {
+      auto end = path.find('/', begin);
+      if (end == path.npos)
+        end = path.size();
+      if (end != begin)
+        f(path.substr(begin, end - begin));
+      begin = end + 1;
+    }
+}
+
+dirtree_dir & dirtree_dir::subdir_for_path(string_view const path)
+{
+  if (!cache)
+    cache = std::make_unique<path_cache>();
+  if (cache->generation != wr->tree_generation)
+    {
+      cache->truncate(0);
+      cache->generation = wr->tree_generation;
+    }
+
   auto subdir = this;
-  std::istringstream pathtokens(path);
-  std::string component;
-  while (std::getline(pathtokens, component, '/'))
-    if (!component.empty())
-      subdir = &subdir->get_subdir(component);
+  std::size_t depth = 0;
+  for_each_component(path, [&](string_view const component) {
+    if (depth < cache->depth() && cache->name(depth) == component)
+      subdir = cache->dirs[depth];
+    else
+      {
+        cache->truncate(depth);
+        subdir = &subdir->get_subdir(component);
+        cache->push(component, subdir);
+      }
+    ++depth;
+  });
+  cache->truncate(depth);
   return *subdir;
 }
 
-dirtree & dirtree_dir::put_file(std::string const & path,
-                                std::unique_ptr<dirtree> && child)
+dirtree & dirtree_dir::put_file(string_view const path,
+                                std::shared_ptr<dirtree> && child)
 {
-  auto sep = path.rfind('/');
-  auto name = sep == path.npos ? path : path.substr(sep + 1);
-  auto parent = sep == path.npos ? "/" : path.substr(0, sep);
-  return subdir_for_path(parent).put_child(name, std::move(child));
+  auto const sep = path.rfind('/');
+  auto const name = sep == path.npos ? path : path.substr(sep + 1);
+  auto & parent =
+      subdir_for_path(sep == path.npos ? string_view{} : path.substr(0, sep));
+
+  auto & slot = parent.entries[std::string(name)];
+  if (slot && slot->inode_type == SQFS_INODE_TYPE_DIR)
+    ++wr->tree_generation;
+  else if (slot && slot.use_count() > 1)
+    --slot->nlink;
+  return *(slot = std::move(child));
 }
 
-dirtree_dir & dirtree_dir::get_subdir(std::string const & name)
+std::shared_ptr<dirtree> dirtree_dir::find(string_view const path)
 {
-  auto entry = entries.find(name);
-  if (entry != entries.end() &&
-      entry->second->inode_type == SQFS_INODE_TYPE_DIR)
-    return *static_cast<dirtree_dir *>(entry->second.get());
+  std::shared_ptr<dirtree> found;
+  dirtree_dir * dir = this;
+  for_each_component(path, [&](string_view const component) {
+    if (dir == nullptr)
+      {
+        found = nullptr;
+        return;
+      }
+
+    auto const entry = dir->entries.find(std::string(component));
+    found = entry == dir->entries.end() ? nullptr : entry->second;
+    dir = found && found->inode_type == SQFS_INODE_TYPE_DIR
+              ? static_cast<dirtree_dir *>(found.get())
+              : nullptr;
+  });
+  return found;
+}
 
-  entries[name] = std::make_unique<dirtree_dir>(wr);
-  return *static_cast<dirtree_dir *>(entries[name].get());
+bool dirtree_dir::put_hardlink(string_view const path,
+                               string_view const target_path)
+{
+  auto target = find(target_path);
+  if (!target || target->inode_type == SQFS_INODE_TYPE_DIR)
+    return false;
+
+  auto & linked = put_file(path, std::move(target));
+  ++linked.nlink;
+  return true;
+}
+
+dirtree_dir & dirtree_dir::get_subdir(string_view const name)
+{
+  auto & entry = entries[std::string(name)];
+  if (!entry || entry->inode_type != SQFS_INODE_TYPE_DIR)
+    {
+      if (entry && entry.use_count() > 1)
+        --entry->nlink;
+      entry = std::make_shared<dirtree_dir>(wr);
+    }
+  return *static_cast<dirtree_dir *>(entry.get());
+}
+
+std::vector<dirtree_dir::entry_type const *>
+dirtree_dir::sorted_entries() const
+{
+  std::vector<entry_type const *> sorted;
+  sorted.reserve(entries.size());
+  for (auto const & entry : entries)
+    sorted.push_back(&entry);
+  std::sort(sorted.begin(), sorted.end(),
+            [](auto const a, auto const b) { return a->first < b->first; });
+  return sorted;
 }
@@ -18,10 +18,13 @@ along with archive2sqfs.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <cstddef>
 #include <cstdint>
+#include <utility>
 #include <vector>
 
 #include "compressor.h"
+#include "content_hash.h"
 #include "dirtree.h"
+#include "optional.h"
 #include "sqsh_defs.h"
 #include "sqsh_writer.h"
 
@@ -39,22 +42,84 @@ void dirtree_reg::flush()
     }
 }
 
-void dirtree_reg::finalize()
+/* Adds a block of the file to its hash, using the hash of the block if
+   the caller has it. */
+void dirtree_reg::hash_block(std::vector<char> const & block,
+                             optional<content_hash> const & hash)
+{
+  if (!wr->dedup_enabled)
+    return;
+  if (hash)
+    wr->file_hash.append(*hash);
+  else
+    wr->file_hash.update(block);
+}
+
+/* Takes over a block that starts at a block boundary of the file. */
+void dirtree_reg::append(std::vector<char> && block,
+                         optional<content_hash> const & hash)
+{
+  if (!wr->current_block.empty())
+    {
+      append(block.data(), block.size());
+      return;
+    }
+
+  hash_block(block, hash);
+  file_size += block.size();
+  wr->current_block = std::move(block);
+  if (wr->current_block.size() == wr->block_size())
+    flush();
+}
+
+/* Takes over len bytes of the file as a block stored in another image,
+   with its size field. The file must be at a block boundary. */
+void dirtree_reg::append_raw(std::vector<char> && block, uint32_t const size,
+                             std::size_t const len,
+                             optional<content_hash> const & hash)
+{
+  hash_block(block, hash);
+  file_size += len;
+  wr->enqueue_raw_block(inode_number, std::move(block), size);
+  ++block_count;
+}
+
+/* Ends the file with len bytes that are already in a fragment. */
+void dirtree_reg::append_raw_fragment(fragment_index const index,
+                                      std::size_t const len)
+{
+  file_size += len;
+  wr->fragment_indices[inode_number] = index;
+}
+
+/* Hands the data blocks of the file to dedup. A duplicate is dropped by
+   moving back over the bytes written last, so this comes before anything
+   else is written after the blocks. */
+void dirtree_reg::end_blocks()
 {
   flush();
-  if (block_count != 0)
-    wr->enqueue_dedup(inode_number);
+  if (block_count != 0 && !wr->file_blocks_ended)
+    wr->enqueue_dedup(inode_number, file_size);
+  wr->file_blocks_ended = true;
+}
+
+void dirtree_reg::finalize()
+{
+  end_blocks();
+  wr->file_hash = {};
+  wr->file_blocks_ended = false;
 }
 
 void dirtree_reg::append(char const * buff, std::size_t len)
 {
+  if (wr->dedup_enabled)
+    wr->file_hash.update(buff, len);
   file_size += len;
   while (len != 0)
     {
       auto const remaining = wr->block_size() - wr->current_block.size();
       auto const added = len > remaining ? remaining : len;
-      for (std::size_t i = 0; i < added; ++i)
-        wr->current_block.push_back(buff[i]);
+      wr->current_block.insert(wr->current_block.end(), buff, buff + added);
 
       if (wr->current_block.size() == wr->block_size())
         flush();
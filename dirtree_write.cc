@@ -17,7 +17,12 @@ along with archive2sqfs.  If not, see <http://www.gnu.org/licenses/>.
 */
 
 #include <algorithm>
+#include <atomic>
 #include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
 #include <memory>
 #include <stdexcept>
 #include <string>
@@ -48,118 +53,238 @@ struct dirtable_header
            within16(inode_number, inode.inode_number);
   }
 
-  template <typename IT> std::size_t segment_len(IT it, IT const limit)
+  /* Segments also end where the next entry would start in a later
+     metadata block, so that every block holding part of a large listing
+     begins a header that a directory index can point at. */
+  template <typename IT>
+  std::size_t segment_len(IT it, IT const limit, std::size_t position)
   {
     size_t i = 0;
-    for (; it != limit && works(*it->second); ++i, ++it)
-      ;
+    position += SQFS_DIR_HEADER_SIZE;
+    for (; it != limit && i < SQFS_DIR_COUNT && works(*(*it)->second) &&
+           (i == 0 || position < SQFS_META_BLOCK_SIZE);
+         ++i, ++it)
+      position += SQFS_DIR_ENTRY_SIZE + (*it)->first.size();
     return i;
   }
 };
 
+struct dirtable_index
+{
+  uint32_t index;
+  uint32_t start_block;
+  std::string const * name;
+};
+
+/* A run of records of the inode or directory table, encoded from where it
+   starts in the table, with the fields in it that hold where blocks
+   start. It is put to its metadata_writer as one record. */
+struct table_run
+{
+  uint64_t position;
+  std::vector<char> data;
+  std::vector<metadata_writer::block_ref> refs;
+
+  meta_address get_address() const
+  {
+    auto const at = position + data.size();
+    return meta_address(at / SQFS_META_BLOCK_SIZE, at % SQFS_META_BLOCK_SIZE);
+  }
+
+  template <typename C>
+  meta_address put(C const & c,
+                   std::vector<metadata_writer::block_ref> const & r = {})
+  {
+    auto const addr = get_address();
+    for (auto ref : r)
+      {
+        ref.field += data.size();
+        refs.push_back(ref);
+      }
+    data.insert(data.end(), c.data(), c.data() + c.size());
+    return addr;
+  }
+};
+
+static uint64_t table_position(meta_address const addr)
+{
+  return uint64_t(addr.block) * SQFS_META_BLOCK_SIZE + addr.offset;
+}
+
 template <typename IT>
-static void dirtree_write_dirtable_segment(dirtree_dir & dir, IT & it)
+static void
+dirtree_write_dirtable_segment(dirtree_dir const & dir, IT & it,
+                               IT const limit, table_run & dentries,
+                               std::vector<dirtable_index> & index)
 {
-  auto & first = it->second;
+  auto & first = (*it)->second;
   struct dirtable_header header = {0, first->inode_address.block,
                                    first->inode_number};
-  header.count = header.segment_len(it, dir.entries.cend());
+  meta_address const addr = dentries.get_address();
+  header.count = header.segment_len(it, limit, addr.offset);
+
+  if (addr.block != dir.dtable_start_block &&
+      (index.empty() || index.back().start_block != addr.block))
+    index.push_back({uint32_t(table_position(addr) -
+                              table_position(meta_address(
+                                  dir.dtable_start_block,
+                                  dir.dtable_start_offset))),
+                     addr.block, &(*it)->first});
 
   endian_buffer<12> buff;
   buff.l32(header.count - 1);
   buff.l32(header.start_block);
   buff.l32(header.inode_number);
-  dir.wr->dentry_writer.put(buff);
-  dir.filesize += buff.size();
+  dentries.put(buff, {{4, &dir.wr->inode_writer, header.start_block}});
 
   for (size_t i = 0; i < header.count; ++i, ++it)
     {
-      size_t const len_name = it->first.size();
-      if (len_name > 0xff)
-        throw std::runtime_error("filename longer than 255 bytes"s);
+      auto const & name = (*it)->first;
+      auto const & child = (*it)->second;
       endian_buffer<0> buff;
 
-      buff.l16(it->second->inode_address.offset);
-      buff.l16(it->second->inode_number - header.inode_number);
-      buff.l16(it->second->inode_type - 7);
-      buff.l16(len_name - 1);
-      for (auto const c : it->first)
+      buff.l16(child->inode_address.offset);
+      buff.l16(child->inode_number - header.inode_number);
+      buff.l16(child->inode_type - 7);
+      buff.l16(name.size() - 1);
+      for (auto const c : name)
         buff.l8(c);
-
-      dir.wr->dentry_writer.put(buff);
-      dir.filesize += buff.size();
-      if (it->second->inode_type == SQFS_INODE_TYPE_DIR)
-        dir.nlink++;
+      dentries.put(buff);
     }
 }
 
-static void dirtree_write_dirtable(dirtree_dir & dir)
+template <typename C>
+static std::vector<dirtable_index>
+dirtree_write_dirtable(dirtree_dir const & dir, C const & sorted,
+                       table_run & dentries)
 {
-  meta_address const addr = dir.wr->dentry_writer.get_address();
-  dir.dtable_start_block = addr.block;
-  dir.dtable_start_offset = addr.offset;
-  dir.nlink = 2;
-  dir.filesize = 3;
-
-  auto it = dir.entries.cbegin();
-  while (it != dir.entries.cend())
-    dirtree_write_dirtable_segment(dir, it);
+  std::vector<dirtable_index> index;
+  auto it = sorted.cbegin();
+  while (it != sorted.cend())
+    dirtree_write_dirtable_segment(dir, it, sorted.cend(), dentries, index);
+  return index;
 }
 
+/* The uid and gid indexes are left as zero, to be filled in by
+   dirtree_put_inode once the ids are numbered. */
 template <std::size_t N>
-static inline void dirtree_inode_common(struct dirtree * const dt,
+static inline void dirtree_inode_common(struct dirtree const & dt,
                                         endian_buffer<N> & buff)
 {
-  buff.l16(dt->inode_type);
-  buff.l16(dt->mode);
-  buff.l16(dt->wr->id_lookup(dt->uid));
-  buff.l16(dt->wr->id_lookup(dt->gid));
-  buff.l32(dt->mtime);
-  buff.l32(dt->inode_number);
+  buff.l16(dt.inode_type);
+  buff.l16(dt.mode);
+  buff.l16(0);
+  buff.l16(0);
+  buff.l32(dt.mtime);
+  buff.l32(dt.inode_number);
+}
+
+/* The ids were all numbered in the order the inodes are put when the
+   tables were laid out, so id_lookup only finds them here. */
+template <std::size_t N>
+static void
+dirtree_put_inode(table_run & inodes, dirtree const & dt,
+                  endian_buffer<N> & buff,
+                  std::vector<metadata_writer::block_ref> const & refs = {})
+{
+  buff.l16(4, dt.wr->id_lookup(dt.uid));
+  buff.l16(6, dt.wr->id_lookup(dt.gid));
+  if (uint64_t(inodes.get_address()) != uint64_t(dt.inode_address))
+    throw std::runtime_error("inode not where it was laid out"s);
+  inodes.put(buff, refs);
 }
 
-static void dirtree_reg_write_inode_blocks(dirtree_reg & reg)
+static void
+dirtree_dir_write_inode_index(table_run & inodes, dirtree_dir const & dir,
+                              std::vector<dirtable_index> const & index)
 {
   endian_buffer<0> buff;
-  for (auto const b : reg.wr->reports[reg.inode_number].sizes)
-    buff.l32(b);
-  reg.wr->inode_writer.put(buff);
+  std::vector<metadata_writer::block_ref> refs;
+  for (auto const & entry : index)
+    {
+      buff.l32(entry.index);
+      refs.push_back(
+          {buff.size(), &dir.wr->dentry_writer, entry.start_block});
+      buff.l32(entry.start_block);
+      buff.l32(entry.name->size() - 1);
+      for (auto const c : *entry.name)
+        buff.l8(c);
+    }
+  inodes.put(buff, refs);
+}
+
+static bool dirtree_dir_extended(dirtree_dir const & dir,
+                                 std::size_t const index_size)
+{
+  return dir.filesize > 0xffffu || dir.xattr != 0xffffffffu ||
+         index_size != 0;
 }
 
-static inline void dirtree_write_inode_dir(endian_buffer<40> & buff,
-                                           dirtree_dir & dir,
-                                           uint32_t const parent_inode_number)
+/* Returns where the start of the listing is in the inode. */
+static inline std::size_t
+dirtree_write_inode_dir(endian_buffer<40> & buff, dirtree_dir const & dir,
+                        uint32_t const parent_inode_number,
+                        std::vector<dirtable_index> const & index)
 {
-  if (dir.filesize > 0xffffu || dir.xattr != 0xffffffffu)
+  std::size_t field;
+  if (dirtree_dir_extended(dir, index.size()))
     {
       buff.l32(dir.nlink);
       buff.l32(dir.filesize);
+      field = buff.size();
       buff.l32(dir.dtable_start_block);
       buff.l32(parent_inode_number);
-      buff.l16(0);
+      buff.l16(index.size());
       buff.l16(dir.dtable_start_offset);
       buff.l32(dir.xattr);
     }
   else
     {
       buff.l16(0, dir.inode_type - 7);
+      field = buff.size();
       buff.l32(dir.dtable_start_block);
       buff.l32(dir.nlink);
       buff.l16(dir.filesize);
       buff.l16(dir.dtable_start_offset);
       buff.l32(parent_inode_number);
     }
+  return field;
+}
+
+/* Only looks up the writer's tables, so that a file without blocks or a
+   fragment adds no entries to them. */
+static block_report const & dirtree_reg_blocks(dirtree_reg const & reg)
+{
+  static block_report const no_blocks{};
+  auto const report = reg.wr->reports.find(reg.inode_number);
+  return report != reg.wr->reports.end() ? report->second : no_blocks;
+}
+
+static fragment_index const & dirtree_reg_fragment(dirtree_reg const & reg)
+{
+  static fragment_index const no_fragment{};
+  auto const fragment = reg.wr->fragment_indices.find(reg.inode_number);
+  return fragment != reg.wr->fragment_indices.end() ? fragment->second
+                                                    : no_fragment;
 }
 
-static inline void dirtree_inode_reg(endian_buffer<56> & buff,
-                                     dirtree_reg & reg)
+static bool dirtree_reg_extended(dirtree_reg const & reg,
+                                 block_report const & blocks)
 {
-  auto const start_block = reg.wr->reports[reg.inode_number].start_block;
-  auto const findex = reg.wr->fragment_indices[reg.inode_number];
-  if (start_block > 0xffffu || reg.file_size > 0xffffu ||
-      reg.xattr != 0xffffffffu || reg.nlink != 1)
+  return blocks.start_block > 0xffffu || reg.file_size > 0xffffu ||
+         reg.xattr != 0xffffffffu || reg.nlink != 1;
+}
+
+static void dirtree_inode_reg(endian_buffer<0> & buff,
+                              dirtree_reg const & reg)
+{
+  auto const & blocks = dirtree_reg_blocks(reg);
+  auto const & findex = dirtree_reg_fragment(reg);
+
+  dirtree_inode_common(reg, buff);
+  if (dirtree_reg_extended(reg, blocks))
     {
-      buff.l64(start_block);
+      buff.l64(blocks.start_block);
       buff.l64(reg.file_size);
       buff.l64(reg.sparse);
       buff.l32(reg.nlink);
@@ -170,86 +295,332 @@ static inline void dirtree_inode_reg(endian_buffer<56> & buff,
   else
     {
       buff.l16(0, reg.inode_type - 7);
-      buff.l32(start_block);
+      buff.l32(blocks.start_block);
       buff.l32(findex.fragment);
       buff.l32(findex.offset);
       buff.l32(reg.file_size);
     }
+
+  for (auto const b : blocks.sizes)
+    buff.l32(b);
 }
 
-void dirtree_reg::write_inode(uint32_t)
+static void dirtree_inode_sym(endian_buffer<0> & buff,
+                              dirtree_sym const & sym)
 {
-  endian_buffer<56> buff;
-  dirtree_inode_common(this, buff);
-  dirtree_inode_reg(buff, *this);
-  inode_address = wr->inode_writer.put(buff);
-  dirtree_reg_write_inode_blocks(*this);
+  dirtree_inode_common(sym, buff);
+  buff.l32(sym.nlink);
+  buff.l32(sym.target.size());
+  for (auto const c : sym.target)
+    buff.l8(c);
+
+  if (sym.xattr != SQFS_XATTR_NONE)
+    buff.l32(sym.xattr);
+  else
+    buff.l16(0, sym.inode_type - 7);
 }
 
-void dirtree_dir::write_inode(uint32_t const parent_inode_number)
+static void dirtree_inode_dev(endian_buffer<0> & buff,
+                              dirtree_dev const & dev)
 {
-  for (auto & entry : entries)
-    entry.second->write_inode(inode_number);
+  dirtree_inode_common(dev, buff);
+  buff.l32(dev.nlink);
+  buff.l32(dev.rdev);
 
-  dirtree_write_dirtable(*this);
-  endian_buffer<40> buff;
-  dirtree_inode_common(this, buff);
-  dirtree_write_inode_dir(buff, *this, parent_inode_number);
-  inode_address = wr->inode_writer.put(buff);
+  if (dev.xattr != SQFS_XATTR_NONE)
+    buff.l32(dev.xattr);
+  else
+    buff.l16(0, dev.inode_type - 7);
+}
+
+static void dirtree_inode_ipc(endian_buffer<0> & buff,
+                              dirtree_ipc const & ipc)
+{
+  dirtree_inode_common(ipc, buff);
+  buff.l32(ipc.nlink);
+
+  if (ipc.xattr != SQFS_XATTR_NONE)
+    buff.l32(ipc.xattr);
+  else
+    buff.l16(0, ipc.inode_type - 7);
 }
 
-void dirtree_sym::write_inode(uint32_t)
+/* The size of the inode of anything but a directory, as
+   dirtree_write_inode encodes it. */
+static std::size_t dirtree_inode_size(dirtree const & dt)
+{
+  std::size_t const xattr = dt.xattr != SQFS_XATTR_NONE ? 4 : 0;
+  switch (dt.inode_type)
+    {
+      case SQFS_INODE_TYPE_REG:
+        {
+          auto const & reg = static_cast<dirtree_reg const &>(dt);
+          auto const & blocks = dirtree_reg_blocks(reg);
+          return (dirtree_reg_extended(reg, blocks) ? 56 : 32) +
+                 4 * blocks.sizes.size();
+        }
+      case SQFS_INODE_TYPE_SYM:
+        return 24 + static_cast<dirtree_sym const &>(dt).target.size() +
+               xattr;
+      case SQFS_INODE_TYPE_BLK:
+      case SQFS_INODE_TYPE_CHR:
+        return 24 + xattr;
+      default:
+        return 20 + xattr;
+    }
+}
+
+static void dirtree_write_inode(table_run & inodes, dirtree const & dt)
 {
   endian_buffer<0> buff;
+  switch (dt.inode_type)
+    {
+      case SQFS_INODE_TYPE_REG:
+        dirtree_inode_reg(buff, static_cast<dirtree_reg const &>(dt));
+        break;
+      case SQFS_INODE_TYPE_SYM:
+        dirtree_inode_sym(buff, static_cast<dirtree_sym const &>(dt));
+        break;
+      case SQFS_INODE_TYPE_BLK:
+      case SQFS_INODE_TYPE_CHR:
+        dirtree_inode_dev(buff, static_cast<dirtree_dev const &>(dt));
+        break;
+      default:
+        dirtree_inode_ipc(buff, static_cast<dirtree_ipc const &>(dt));
+        break;
+    }
+  dirtree_put_inode(inodes, dt, buff);
+}
 
-  dirtree_inode_common(this, buff);
-  buff.l32(nlink);
-  buff.l32(target.size());
-  for (auto const c : target)
-    buff.l8(c);
+static void dirtree_write_dir(table_run & inodes, table_run & dentries,
+                              dirtree_dir & dir,
+                              uint32_t const parent_inode_number)
+{
+  auto const sorted = std::move(*dir.presorted);
+  dir.presorted.reset();
+  if (uint64_t(dentries.get_address()) !=
+      uint64_t(meta_address(dir.dtable_start_block, dir.dtable_start_offset)))
+    throw std::runtime_error("listing not where it was laid out"s);
 
-  if (xattr != SQFS_XATTR_NONE)
-    buff.l32(xattr);
-  else
-    buff.l16(0, inode_type - 7);
+  auto const index = dirtree_write_dirtable(dir, sorted, dentries);
+  endian_buffer<40> buff;
+  dirtree_inode_common(dir, buff);
+  auto const field =
+      dirtree_write_inode_dir(buff, dir, parent_inode_number, index);
+  dirtree_put_inode(
+      inodes, dir, buff,
+      {{field, &dir.wr->dentry_writer, dir.dtable_start_block}});
+  dirtree_dir_write_inode_index(inodes, dir, index);
+}
 
-  inode_address = wr->inode_writer.put(buff);
+/* Sorts the entries of every directory ahead of writing the tables, on
+   several threads at once. */
+static void dirtree_prepare_tables(dirtree_dir & root)
+{
+  std::vector<dirtree_dir *> dirs{&root};
+  for (std::size_t i = 0; i < dirs.size(); ++i)
+    for (auto const & entry : dirs[i]->entries)
+      if (entry.second->inode_type == SQFS_INODE_TYPE_DIR)
+        dirs.push_back(static_cast<dirtree_dir *>(entry.second.get()));
+
+  std::atomic<std::size_t> next{0};
+  auto const prepare = [&]() {
+    for (auto i = next++; i < dirs.size(); i = next++)
+      dirs[i]->presorted = std::make_unique<std::vector<
+          dirtree_dir::entry_type const *>>(dirs[i]->sorted_entries());
+  };
+
+  std::vector<std::future<void>> tasks;
+  auto const count = std::min<std::size_t>(thread_count(), dirs.size());
+  for (std::size_t i = 0; i < count; ++i)
+    tasks.push_back(std::async(root.wr->launch_policy(), prepare));
+  for (auto & task : tasks)
+    task.get();
 }
 
-void dirtree_dev::write_inode(uint32_t)
+/* The inodes in the order they are put, each directory's just after its
+   listing, with where every run of run_length of them starts in each
+   table. */
+struct table_plan
 {
-  endian_buffer<28> buff;
-  dirtree_inode_common(this, buff);
-  buff.l32(nlink);
-  buff.l32(rdev);
+  static std::size_t constexpr run_length = 4096;
 
-  if (xattr != SQFS_XATTR_NONE)
-    buff.l32(xattr);
-  else
-    buff.l16(0, inode_type - 7);
+  struct inode
+  {
+    dirtree * node;
+    uint32_t parent_inode_number;
+  };
+
+  struct run
+  {
+    std::size_t begin;
+    uint64_t inode_position;
+    uint64_t dentry_position;
+  };
+
+  std::vector<inode> order;
+  std::vector<run> runs;
+  uint64_t inode_position;
+  uint64_t dentry_position;
+};
 
-  inode_address = wr->inode_writer.put(buff);
+/* Places the inode of dt, and numbers its ids, as putting it would. */
+static void dirtree_plan_inode(table_plan & plan, dirtree & dt,
+                               uint32_t const parent_inode_number,
+                               std::size_t const size)
+{
+  if (plan.order.size() % table_plan::run_length == 0)
+    plan.runs.push_back(
+        {plan.order.size(), plan.inode_position, plan.dentry_position});
+  plan.order.push_back({&dt, parent_inode_number});
+  dt.wr->id_lookup(dt.uid);
+  dt.wr->id_lookup(dt.gid);
+  dt.inode_address = meta_address(plan.inode_position / SQFS_META_BLOCK_SIZE,
+                                  plan.inode_position % SQFS_META_BLOCK_SIZE);
+  plan.inode_position += size;
 }
 
-void dirtree_ipc::write_inode(uint32_t)
+/* Lays out the listing of dir from position, splitting it as
+   dirtree_write_dirtable does, and returns where it ends. Also counts the
+   directory's links and the bytes of its inode's index. */
+template <typename C>
+static uint64_t dirtree_plan_dirtable(dirtree_dir & dir, C const & sorted,
+                                      uint64_t position,
+                                      std::size_t & index_size)
 {
-  endian_buffer<24> buff;
-  dirtree_inode_common(this, buff);
-  buff.l32(nlink);
+  auto const start = position;
+  dir.dtable_start_block = position / SQFS_META_BLOCK_SIZE;
+  dir.dtable_start_offset = position % SQFS_META_BLOCK_SIZE;
+  dir.nlink = 2;
+  index_size = 0;
 
-  if (xattr != SQFS_XATTR_NONE)
-    buff.l32(xattr);
-  else
-    buff.l16(0, inode_type - 7);
+  auto indexed = dir.dtable_start_block;
+  auto it = sorted.cbegin();
+  while (it != sorted.cend())
+    {
+      auto & first = (*it)->second;
+      struct dirtable_header header = {0, first->inode_address.block,
+                                       first->inode_number};
+      uint32_t const block = position / SQFS_META_BLOCK_SIZE;
+      header.count = header.segment_len(it, sorted.cend(),
+                                        position % SQFS_META_BLOCK_SIZE);
+      if (block != indexed)
+        {
+          index_size += 12 + (*it)->first.size();
+          indexed = block;
+        }
+
+      position += SQFS_DIR_HEADER_SIZE;
+      for (size_t i = 0; i < header.count; ++i, ++it)
+        {
+          auto const len_name = (*it)->first.size();
+          if (len_name > 0xff)
+            throw std::runtime_error("filename longer than 255 bytes"s);
+          position += SQFS_DIR_ENTRY_SIZE + len_name;
+          if ((*it)->second->inode_type == SQFS_INODE_TYPE_DIR)
+            dir.nlink++;
+        }
+    }
+
+  dir.filesize = 3 + (position - start);
+  return position;
+}
+
+/* Lays out dir as it is written: the inodes of its entries, each
+   subdirectory's after its own, then its listing and its own inode. */
+static void dirtree_plan_dir(table_plan & plan, dirtree_dir & dir,
+                             uint32_t const parent_inode_number)
+{
+  if (!dir.presorted)
+    dir.presorted = std::make_unique<
+        std::vector<dirtree_dir::entry_type const *>>(dir.sorted_entries());
+  for (auto const entry : *dir.presorted)
+    {
+      auto & child = *entry->second;
+      if (child.inode_written)
+        continue;
+      if (child.inode_type == SQFS_INODE_TYPE_DIR)
+        dirtree_plan_dir(plan, static_cast<dirtree_dir &>(child),
+                         dir.inode_number);
+      else
+        dirtree_plan_inode(plan, child, 0, dirtree_inode_size(child));
+      child.inode_written = true;
+    }
+
+  std::size_t index_size;
+  auto const end = dirtree_plan_dirtable(dir, *dir.presorted,
+                                         plan.dentry_position, index_size);
+  dirtree_plan_inode(plan, dir, parent_inode_number,
+                     dirtree_dir_extended(dir, index_size) ? 40 + index_size
+                                                           : 32);
+  plan.dentry_position = end;
+}
+
+struct table_runs
+{
+  table_run inodes;
+  table_run dentries;
+};
 
-  inode_address = wr->inode_writer.put(buff);
+static table_runs dirtree_write_run(table_plan const & plan,
+                                    std::size_t const r)
+{
+  auto const & run = plan.runs[r];
+  auto const end =
+      r + 1 < plan.runs.size() ? plan.runs[r + 1].begin : plan.order.size();
+  table_runs out;
+  out.inodes.position = run.inode_position;
+  out.dentries.position = run.dentry_position;
+  for (auto i = run.begin; i < end; ++i)
+    {
+      auto & dt = *plan.order[i].node;
+      if (dt.inode_type == SQFS_INODE_TYPE_DIR)
+        dirtree_write_dir(out.inodes, out.dentries,
+                          static_cast<dirtree_dir &>(dt),
+                          plan.order[i].parent_inode_number);
+      else
+        dirtree_write_inode(out.inodes, dt);
+    }
+  return out;
 }
 
+/* A serial pass lays out the inode and directory tables from the sizes of
+   their records alone: where each inode and listing starts, how listings
+   are split, and how ids are numbered. Runs of records are then encoded
+   on several threads at once, each into its own buffers, and put to the
+   metadata writers in order, which fill in where blocks start and
+   compress full blocks in the background. */
 void dirtree::write_tables()
 {
-  write_inode(wr->next_inode);
-  wr->super.root_inode = inode_address;
+  table_plan plan;
+  plan.inode_position = table_position(wr->inode_writer.get_address());
+  plan.dentry_position = table_position(wr->dentry_writer.get_address());
+  if (inode_type == SQFS_INODE_TYPE_DIR)
+    {
+      auto & root = static_cast<dirtree_dir &>(*this);
+      dirtree_prepare_tables(root);
+      dirtree_plan_dir(plan, root, wr->next_inode);
+    }
+  else
+    dirtree_plan_inode(plan, *this, wr->next_inode,
+                       dirtree_inode_size(*this));
+
+  std::deque<std::future<table_runs>> written;
+  std::size_t next = 0;
+  while (next < plan.runs.size() || !written.empty())
+    {
+      while (next < plan.runs.size() && written.size() < thread_count())
+        written.push_back(std::async(wr->launch_policy(), dirtree_write_run,
+                                     std::cref(plan), next++));
+      auto const runs = written.front().get();
+      written.pop_front();
+      wr->inode_writer.put(runs.inodes.data, runs.inodes.refs);
+      wr->dentry_writer.put(runs.dentries.data, runs.dentries.refs);
+    }
+
   wr->inode_writer.write_block();
   wr->dentry_writer.write_block();
+  wr->super.root_inode = meta_address(
+      wr->inode_writer.start(inode_address.block), inode_address.offset);
   wr->write_tables();
 }
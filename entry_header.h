@@ -0,0 +1,73 @@
+/*
+Copyright (C) 2018  Charles Cagle
+
+This file is part of archive2sqfs.
+
+archive2sqfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3.
+
+archive2sqfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with archive2sqfs.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef LSL_ENTRY_HEADER_H
+#define LSL_ENTRY_HEADER_H
+
+#include <cstdint>
+#include <string>
+
+#include <archive_entry.h>
+
+/* A copy of the header fields of one archive entry, with the same
+   accessors as archive_reader. */
+class entry_header
+{
+  std::string path;
+  std::string symlink;
+  std::string hardlink;
+  bool has_hardlink;
+  unsigned type;
+  uint16_t perm;
+  uint32_t user;
+  uint32_t group;
+  int64_t time;
+  int64_t size;
+  uint64_t device;
+
+public:
+  template <typename R>
+  entry_header(R const & r)
+      : path(r.pathname()), has_hardlink(r.hardlink_target() != nullptr),
+        type(r.filetype()), perm(r.mode()), user(r.uid()), group(r.gid()),
+        time(r.mtime()), size(has_hardlink ? 0 : r.filesize()),
+        device(r.rdev())
+  {
+    if (type == AE_IFLNK)
+      symlink = r.symlink_target();
+    if (has_hardlink)
+      hardlink = r.hardlink_target();
+  }
+
+  char const * pathname() const { return path.data(); }
+  auto filetype() const { return type; }
+  auto mode() const { return perm; }
+  auto uid() const { return user; }
+  auto gid() const { return group; }
+  auto mtime() const { return time; }
+  auto filesize() const { return size; }
+  auto rdev() const { return device; }
+  char const * symlink_target() const { return symlink.data(); }
+
+  char const * hardlink_target() const
+  {
+    return has_hardlink ? hardlink.data() : nullptr;
+  }
+};
+
+#endif
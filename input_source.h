@@ -0,0 +1,39 @@
+/*
+Copyright (C) 2018  Charles Cagle
+
+This file is part of archive2sqfs.
+
+archive2sqfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3.
+
+archive2sqfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with archive2sqfs.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef LSL_INPUT_SOURCE_H
+#define LSL_INPUT_SOURCE_H
+
+#include <cstddef>
+#include <cstdint>
+
+/* A byte stream handed to libarchive through its client callbacks. */
+struct input_source
+{
+  virtual ~input_source() = default;
+
+  /* Points buff at the next bytes of input and returns their count, or 0
+     at the end of input. The bytes stay valid until the next call. */
+  virtual std::size_t read(void const *& buff) = 0;
+
+  /* Skips up to len bytes and returns how many were skipped; 0 tells
+     libarchive to read through the data instead. */
+  virtual int64_t skip(int64_t) { return 0; }
+};
+
+#endif
@@ -0,0 +1,139 @@
+/*
+Copyright (C) 2018  Charles Cagle
+
+This file is part of archive2sqfs.
+
+archive2sqfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3.
+
+archive2sqfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with archive2sqfs.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <cstddef>
+#include <map>
+#include <string>
+#include <vector>
+
+using namespace std::literals;
+
+#include "layer_stack.h"
+
+static std::string const whiteout_prefix = ".wh."s;
+static std::string const opaque_marker = ".wh..wh..opq"s;
+
+/* Calls f on each proper ancestor of key, starting with the root "". */
+template <typename F>
+static void for_each_ancestor(std::string const & key, F f)
+{
+  if (key.empty())
+    return;
+  f(""s);
+  for (auto sep = key.find('/'); sep != key.npos;
+       sep = key.find('/', sep + 1))
+    f(key.substr(0, sep));
+}
+
+bool layer_stack::hidden(std::string const & key, bool const is_dir) const
+{
+  bool result = false;
+  for_each_ancestor(key, [&](std::string const & ancestor) {
+    auto const c = above.claims.find(ancestor);
+    result = result || above.whiteouts.count(ancestor) != 0 ||
+             above.opaque.count(ancestor) != 0 ||
+             (c != above.claims.end() && c->second == OTHER);
+  });
+  if (result || above.whiteouts.count(key) != 0)
+    return true;
+
+  auto const c = above.claims.find(key);
+  return c != above.claims.end() && !(is_dir && c->second == IMPLIED_DIR);
+}
+
+void layer_stack::claim(std::string const & key, claim_kind const kind)
+{
+  for_each_ancestor(key, [&](std::string const & ancestor) {
+    auto & c = current.claims.emplace(ancestor, IMPLIED_DIR).first->second;
+    if (c == OTHER)
+      c = IMPLIED_DIR;
+  });
+  if (kind != IMPLIED_DIR)
+    current.claims[key] = kind;
+  else
+    current.claims.emplace(key, kind);
+}
+
+bool layer_stack::admits(std::string const & key, bool const is_dir,
+                         std::string const * const hardlink_target)
+{
+  auto const position = index++;
+  auto const sep = key.rfind('/');
+  auto const parent = sep == key.npos ? ""s : key.substr(0, sep);
+  auto const name = sep == key.npos ? key : key.substr(sep + 1);
+
+  if (name.compare(0, whiteout_prefix.size(), whiteout_prefix) == 0)
+    {
+      if (name == opaque_marker)
+        current.opaque.insert(parent);
+      else
+        current.whiteouts.insert(
+            (parent.empty() ? ""s : parent + '/') +
+            name.substr(whiteout_prefix.size()));
+      claim(parent, IMPLIED_DIR);
+      return false;
+    }
+
+  if (hidden(key, is_dir))
+    {
+      if (!is_dir && hardlink_target == nullptr)
+        hidden_files[key] = position;
+      return false;
+    }
+
+  held_links.erase(key);
+  claim(key, is_dir ? DIR : OTHER);
+  if (hardlink_target != nullptr)
+    {
+      auto const target = hidden_files.find(*hardlink_target);
+      if (target != hidden_files.end())
+        {
+          held_links[key] = target->second;
+          return false;
+        }
+    }
+  return true;
+}
+
+std::map<std::size_t, std::vector<std::string>> layer_stack::links() const
+{
+  std::map<std::size_t, std::vector<std::string>> result;
+  for (auto const & link : held_links)
+    result[link.second].push_back(link.first);
+  for (auto & paths : result)
+    std::sort(paths.second.begin(), paths.second.end());
+  return result;
+}
+
+void layer_stack::end_layer()
+{
+  for (auto const & c : current.claims)
+    {
+      auto const placed = above.claims.insert(c);
+      if (!placed.second && placed.first->second == IMPLIED_DIR)
+        placed.first->second = c.second;
+    }
+  above.whiteouts.insert(current.whiteouts.begin(), current.whiteouts.end());
+  above.opaque.insert(current.opaque.begin(), current.opaque.end());
+
+  current = layer();
+  index = 0;
+  hidden_files.clear();
+  held_links.clear();
+}
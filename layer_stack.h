@@ -0,0 +1,80 @@
+/*
+Copyright (C) 2018  Charles Cagle
+
+This file is part of archive2sqfs.
+
+archive2sqfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3.
+
+archive2sqfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with archive2sqfs.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef LSL_LAYER_STACK_H
+#define LSL_LAYER_STACK_H
+
+#include <cstddef>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+/* Decides which entries of stacked image layers, as in OCI and Docker
+   images, are visible when the layers are read top layer first. An entry
+   is hidden if a higher layer has the same path, replaced one of its
+   ancestors with a non-directory, deleted it or an ancestor with a
+   whiteout (.wh.<name>) or made an ancestor opaque (.wh..wh..opq).
+   Whiteouts themselves are never visible. Paths are keys as dirtree sees
+   them, with empty components removed.
+
+   A visible hardlink may refer to a file of its own layer that is hidden.
+   Such links are held back, and links() tells which entries of the layer
+   need to be read again for them. */
+class layer_stack
+{
+  enum claim_kind
+  {
+    IMPLIED_DIR,
+    DIR,
+    OTHER
+  };
+
+  struct layer
+  {
+    std::unordered_map<std::string, claim_kind> claims;
+    std::unordered_set<std::string> whiteouts;
+    std::unordered_set<std::string> opaque;
+  };
+
+  layer above;
+  layer current;
+
+  std::size_t index = 0;
+  std::unordered_map<std::string, std::size_t> hidden_files;
+  std::unordered_map<std::string, std::size_t> held_links;
+
+  bool hidden(std::string const &, bool is_dir) const;
+  void claim(std::string const &, claim_kind);
+
+public:
+  /* Numbers the entries of the current layer in the order they are seen,
+     and returns whether the entry at key belongs in the image. */
+  bool admits(std::string const & key, bool is_dir,
+              std::string const * hardlink_target);
+
+  /* The held back links of the current layer, by the number of the entry
+     they refer to. */
+  std::map<std::size_t, std::vector<std::string>> links() const;
+
+  /* Hides what the current layer claimed from the layers below it. */
+  void end_layer();
+};
+
+#endif
@@ -0,0 +1,144 @@
+/*
+Copyright (C) 2018  Charles Cagle
+
+This file is part of archive2sqfs.
+
+archive2sqfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3.
+
+archive2sqfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with archive2sqfs.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace std::literals;
+
+#include "mapped_input.h"
+#include "posix_io.h"
+
+static std::size_t constexpr map_window = 8 << 20;
+
+/* The mapping begins skew bytes before the file's data, at a page
+   boundary. */
+mapped_file::mapped_file(void const * const addr, std::size_t const len,
+                         std::size_t const skew)
+    : base(static_cast<char const *>(addr) + skew), length(len - skew),
+      skew(skew)
+{
+}
+
+std::size_t mapped_file::read(void const *& buff)
+{
+  auto const len = std::min(map_window, length - offset);
+  buff = base + offset;
+  offset += len;
+  return len;
+}
+
+int64_t mapped_file::skip(int64_t const request)
+{
+  auto const len = std::min<uint64_t>(request, length - offset);
+  offset += len;
+  return len;
+}
+
+#if LSL_HAVE_MMAP
+
+static std::size_t constexpr stream_buffer = 1 << 20;
+
+class stream_reader : public input_source
+{
+  int fd;
+  std::vector<char> buffer;
+
+public:
+  stream_reader(int fd) : fd(fd), buffer(stream_buffer) {}
+
+  virtual std::size_t read(void const *& buff)
+  {
+    for (;;)
+      {
+        auto const len = ::read(fd, buffer.data(), buffer.size());
+        if (len >= 0)
+          {
+            buff = buffer.data();
+            return len;
+          }
+        if (errno != EINTR)
+          throw std::runtime_error("failed to read from input stream"s);
+      }
+  }
+};
+
+std::unique_ptr<mapped_file> mapped_file::map(int const fd)
+{
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0 ||
+      uint64_t(st.st_size) > SIZE_MAX)
+    return nullptr;
+
+  auto const pos = lseek(fd, 0, SEEK_CUR);
+  if (pos < 0 || pos >= st.st_size)
+    return nullptr;
+
+  auto const skew = std::size_t(pos % sysconf(_SC_PAGESIZE));
+  std::size_t const len = st.st_size - pos + skew;
+  auto const addr =
+      mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, pos - skew);
+  if (addr == MAP_FAILED)
+    return nullptr;
+  posix_madvise(addr, len, POSIX_MADV_SEQUENTIAL);
+  return std::unique_ptr<mapped_file>(new mapped_file(addr, len, skew));
+}
+
+mapped_file::~mapped_file()
+{
+  munmap(const_cast<char *>(base - skew), length + skew);
+}
+
+std::unique_ptr<mapped_file> mapped_file::open(char const * const path)
+{
+  auto const fd = ::open(path, O_RDONLY);
+  if (fd < 0)
+    return nullptr;
+  auto file = map(fd);
+  close(fd);
+  return file;
+}
+
+std::unique_ptr<input_source> open_standard_input()
+{
+  std::unique_ptr<input_source> file = mapped_file::map(STDIN_FILENO);
+  if (file)
+    return file;
+  return std::make_unique<stream_reader>(STDIN_FILENO);
+}
+
+#else
+
+mapped_file::~mapped_file() {}
+
+std::unique_ptr<mapped_file> mapped_file::open(char const *)
+{
+  return nullptr;
+}
+
+std::unique_ptr<mapped_file> mapped_file::map(int) { return nullptr; }
+
+std::unique_ptr<input_source> open_standard_input() { return nullptr; }
+
+#endif
@@ -0,0 +1,60 @@
+/*
+Copyright (C) 2018  Charles Cagle
+
+This file is part of archive2sqfs.
+
+archive2sqfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3.
+
+archive2sqfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with archive2sqfs.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef LSL_MAPPED_INPUT_H
+#define LSL_MAPPED_INPUT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include "input_source.h"
+
+/* A regular file mapped read-only, served to libarchive in multi-megabyte
+   windows so that skipped file data is never read. */
+class mapped_file : public input_source
+{
+  char const * base;
+  std::size_t length;
+  std::size_t skew;
+  std::size_t offset = 0;
+
+  mapped_file(void const *, std::size_t, std::size_t);
+
+public:
+  mapped_file(mapped_file const &) = delete;
+  ~mapped_file();
+
+  /* These return nullptr where the file or platform cannot be mapped. A
+     descriptor is mapped from its current offset to the end. */
+  static std::unique_ptr<mapped_file> open(char const *);
+  static std::unique_ptr<mapped_file> map(int);
+
+  char const * data() const { return base; }
+  std::size_t size() const { return length; }
+
+  virtual std::size_t read(void const *&);
+  virtual int64_t skip(int64_t);
+};
+
+/* Returns a source for standard input, which is mapped if it is a regular
+   file and otherwise read in large blocks. Returns nullptr where POSIX
+   I/O is unavailable. */
+std::unique_ptr<input_source> open_standard_input();
+
+#endif
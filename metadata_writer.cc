@@ -16,22 +16,126 @@ You should have received a copy of the GNU General Public License
 along with archive2sqfs.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <algorithm>
 #include <cstddef>
 #include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <future>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <utility>
 #include <vector>
 
+using namespace std::literals;
+
 #include "endian_buffer.h"
 #include "metadata_writer.h"
 #include "sqsh_defs.h"
 
-void metadata_writer::write_block_compressed(std::vector<char> const & block,
-                                             uint16_t const bsize)
+metadata_writer::metadata_writer(compressor & comp, std::string spill_path,
+                                 std::launch const policy,
+                                 std::size_t const window)
+    : comp(comp), policy(policy), window(window),
+      spill_path(std::move(spill_path)),
+      spill(this->spill_path, std::ios_base::binary | std::ios_base::in |
+                                  std::ios_base::out | std::ios_base::trunc)
+{
+  spill.exceptions(std::ios_base::failbit);
+}
+
+metadata_writer::~metadata_writer()
+{
+  spill.close();
+  std::remove(spill_path.data());
+}
+
+void metadata_writer::out(std::ostream & out)
+{
+  start(next_block);
+  std::vector<char> chunk(1 << 16);
+  spill.flush();
+  spill.seekg(0);
+  for (uint64_t left = table_size; left != 0;)
+    {
+      auto const len = left < chunk.size() ? left : chunk.size();
+      spill.read(chunk.data(), len);
+      out.write(chunk.data(), len);
+      left -= len;
+    }
+}
+
+/* Spills blocks until the start of block is known. */
+uint64_t metadata_writer::start(uint32_t const block)
+{
+  while (starts.size() <= block)
+    {
+      if (pending.empty())
+        throw std::runtime_error("metadata block not written yet"s);
+      spill_front();
+    }
+  return starts[block];
+}
+
+/* Starts compressing each pending block whose relocated fields can all be
+   filled in. */
+void metadata_writer::launch()
+{
+  for (auto & block : pending)
+    {
+      if (block.compressed.valid() ||
+          !std::all_of(block.relocations.begin(), block.relocations.end(),
+                       [](auto const & r) {
+                         return r.block < r.table->starts.size();
+                       }))
+        continue;
+
+      for (auto const & r : block.relocations)
+        {
+          auto const value = r.table->starts[r.block];
+          for (uint64_t i = 0; i < 4; ++i)
+            if (r.position + i >= block.position &&
+                r.position + i < block.position + block.data.size())
+              block.data[r.position + i - block.position] =
+                  (value >> (8 * i)) & 0xff;
+        }
+      block.compressed = comp.compress_async(std::move(block.data), policy);
+    }
+}
+
+/* Whether the blocks the fields of block point to have all been put, so
+   that it can be written out without waiting on records still to come. */
+static bool resolvable(metadata_writer::pending_block const & block)
 {
-  endian_buffer<2> buff;
-  buff.l16(bsize);
-  table.push_back(buff[0]);
-  table.push_back(buff[1]);
-  table.insert(table.end(), block.cbegin(), block.cend());
+  return std::all_of(block.relocations.begin(), block.relocations.end(),
+                     [](auto const & r) {
+                       return r.block <= r.table->next_block;
+                     });
+}
+
+/* Writes out the first pending block. The blocks its fields point to come
+   before it in the order the tables were put, so they can be written
+   first. */
+void metadata_writer::spill_front()
+{
+  auto & block = pending.front();
+  if (!block.compressed.valid())
+    {
+      for (auto const & r : block.relocations)
+        r.table->start(r.block);
+      launch();
+    }
+
+  auto const res = block.compressed.get();
+  auto const size = res.block.size();
+  endian_buffer<2> header;
+  header.l16(res.compressed ? size : (size | SQFS_META_BLOCK_COMPRESSED_BIT));
+  spill.write(header.data(), header.size());
+  spill.write(res.block.data(), res.block.size());
+  table_size += header.size() + res.block.size();
+  starts.push_back(table_size);
+  pending.pop_front();
 }
 
 void metadata_writer::write_block_no_pad(void)
@@ -39,12 +143,27 @@ void metadata_writer::write_block_no_pad(void)
   if (buff.empty())
     return;
 
-  auto comp_res = comp.compress(block_type{buff});
-  auto const size = comp_res.block.size();
-  write_block_compressed(
-      comp_res.block,
-      comp_res.compressed ? size : (size | SQFS_META_BLOCK_COMPRESSED_BIT));
+  pending.emplace_back();
+  auto & block = pending.back();
+  block.position = uint64_t(next_block) * SQFS_META_BLOCK_SIZE;
+  block.data = std::move(buff);
   buff.clear();
+  buff.reserve(SQFS_META_BLOCK_SIZE);
+  ++next_block;
+
+  /* A field that runs past the end of the block is kept for the next. */
+  auto const end = block.position + block.data.size();
+  while (!relocations.empty() && relocations.front().position < end)
+    {
+      block.relocations.push_back(relocations.front());
+      if (relocations.front().position + 4 > end)
+        break;
+      relocations.pop_front();
+    }
+
+  launch();
+  while (pending.size() > window && resolvable(pending.front()))
+    spill_front();
 }
 
 void metadata_writer::write_block(void)
@@ -54,23 +173,24 @@ void metadata_writer::write_block(void)
   write_block_no_pad();
 }
 
-meta_address metadata_writer::put(char const * b, std::size_t len)
+meta_address metadata_writer::put(char const * b, std::size_t len,
+                                  std::vector<block_ref> const & refs)
 {
   meta_address const addr = get_address();
+  auto const position =
+      uint64_t(addr.block) * SQFS_META_BLOCK_SIZE + addr.offset;
+  for (auto const & ref : refs)
+    relocations.push_back({position + ref.field, ref.table, ref.block});
 
   while (len != 0)
     {
       auto const remaining = SQFS_META_BLOCK_SIZE - buff.size();
       auto const added = len > remaining ? remaining : len;
-
-      for (std::size_t i = 0; i < added; ++i)
-        buff.push_back(b[i]);
+      buff.insert(buff.end(), b, b + added);
       if (buff.size() == SQFS_META_BLOCK_SIZE)
         write_block();
-
       len -= added;
       b += added;
     }
-
   return addr;
 }
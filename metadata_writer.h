@@ -19,36 +19,90 @@ along with archive2sqfs.  If not, see <http://www.gnu.org/licenses/>.
 #ifndef LSL_METADATA_WRITER_H
 #define LSL_METADATA_WRITER_H
 
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <future>
 #include <ostream>
+#include <string>
 #include <vector>
 
 #include "compressor.h"
 #include "sqsh_defs.h"
 
+/* Writes a metadata table in blocks of SQFS_META_BLOCK_SIZE, spilling them
+   to a file in order. Up to window full blocks are compressed at once,
+   with the given launch policy.
+
+   Where a block starts in the table is only known once the blocks before
+   it are compressed, so the addresses put returns hold the number of the
+   block, and start gives where it starts. A record field that holds the
+   start of a block, of this table or another, is passed to put as a
+   block_ref. It is filled in when that start is known, and its block is
+   compressed after that. Where a record lands in its block depends only
+   on the sizes of the records before it, so the table comes out the same
+   as if each block were compressed as soon as it is full. */
 struct metadata_writer
 {
+  /* A 32-bit field at the offset field of a record, which holds the start
+     of block in table. */
+  struct block_ref
+  {
+    std::size_t field;
+    metadata_writer * table;
+    uint32_t block;
+  };
+
+  struct relocation
+  {
+    uint64_t position;
+    metadata_writer * table;
+    uint32_t block;
+  };
+
+  struct pending_block
+  {
+    uint64_t position;
+    std::vector<char> data;
+    std::vector<relocation> relocations;
+    std::future<compression_result> compressed;
+  };
+
   compressor & comp;
-  std::vector<char> table;
+  std::launch const policy;
+  std::size_t const window;
+  std::string const spill_path;
+  std::fstream spill;
+  uint64_t table_size = 0;
   std::vector<char> buff;
+  uint32_t next_block = 0;
+  std::deque<relocation> relocations;
+  std::deque<pending_block> pending;
+  std::vector<uint64_t> starts{0};
 
-  void out(std::ostream & out) { out.write(table.data(), table.size()); }
+  void out(std::ostream &);
 
-  meta_address get_address()
-  {
-    return meta_address(table.size(), buff.size());
-  }
+  meta_address get_address() { return meta_address(next_block, buff.size()); }
+  uint64_t start(uint32_t);
 
-  void write_block_compressed(std::vector<char> const &, uint16_t);
+  void launch();
+  void spill_front();
   void write_block_no_pad(void);
   void write_block(void);
-  meta_address put(char const *, size_t);
+  meta_address put(char const *, std::size_t,
+                   std::vector<block_ref> const & = {});
 
-  template <typename C> meta_address put(C const & c)
+  template <typename C>
+  meta_address put(C const & c, std::vector<block_ref> const & refs = {})
   {
-    return put(c.data(), c.size());
+    return put(c.data(), c.size(), refs);
   }
 
-  metadata_writer(compressor & comp) : comp(comp) {}
+  metadata_writer(compressor & comp, std::string spill_path,
+                  std::launch policy = std::launch::deferred,
+                  std::size_t window = 1);
+  ~metadata_writer();
 };
 
 #endif
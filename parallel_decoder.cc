@@ -0,0 +1,412 @@
+/*
+Copyright (C) 2018  Charles Cagle
+
+This file is part of archive2sqfs.
+
+archive2sqfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3.
+
+archive2sqfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with archive2sqfs.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <future>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+using namespace std::literals;
+
+#include <zlib.h>
+#if LSL_ENABLE_COMP_zstd
+#include <zstd.h>
+#include <zstd_errors.h>
+#endif
+
+#include "parallel_decoder.h"
+
+static std::size_t constexpr read_chunk = 1 << 20;
+static std::size_t constexpr probe_limit = 64 << 20;
+static std::size_t constexpr need_more_input = ~std::size_t(0);
+
+static uint16_t le16(char const * const p)
+{
+  return uint8_t(p[0]) | uint16_t(uint8_t(p[1])) << 8;
+}
+
+static uint32_t le32(char const * const p)
+{
+  return le16(p) | uint32_t(le16(p + 2)) << 16;
+}
+
+/* Returns the size of the BGZF member at buff, which its header records
+   in a 'BC' extra subfield, or 0 if the member has no such field. */
+static std::size_t bgzf_member_size(char const * const buff,
+                                    std::size_t const len)
+{
+  if (len < 12)
+    return need_more_input;
+  if (uint8_t(buff[0]) != 0x1f || uint8_t(buff[1]) != 0x8b || buff[2] != 8 ||
+      (buff[3] & 4) == 0)
+    return 0;
+
+  std::size_t const extra_end = 12 + le16(buff + 10);
+  if (len < extra_end)
+    return need_more_input;
+  for (std::size_t i = 12; i + 4 <= extra_end; i += 4 + le16(buff + i + 2))
+    if (buff[i] == 'B' && buff[i + 1] == 'C' && le16(buff + i + 2) == 2 &&
+        i + 6 <= extra_end)
+      return le16(buff + i + 4) + std::size_t(1);
+  return 0;
+}
+
+/* Returns the size of the zstd frame at buff, or 0 if it is not one. */
+static std::size_t zstd_frame_size(char const * const buff,
+                                   std::size_t const len)
+{
+#if LSL_ENABLE_COMP_zstd
+  auto const size = ZSTD_findFrameCompressedSize(buff, len);
+  if (!ZSTD_isError(size))
+    return size;
+  return ZSTD_getErrorCode(size) == ZSTD_error_srcSize_wrong ? need_more_input
+                                                             : 0;
+#else
+  return 0;
+#endif
+}
+
+static std::size_t member_size(parallel_decoder::format const fmt,
+                               char const * const buff, std::size_t const len)
+{
+  return fmt == parallel_decoder::format::bgzf ? bgzf_member_size(buff, len)
+                                               : zstd_frame_size(buff, len);
+}
+
+static void inflate_member(char const * const member, std::size_t const len,
+                           std::vector<char> & out)
+{
+  z_stream zs = {};
+  if (inflateInit2(&zs, 15 + 16) != Z_OK)
+    throw std::runtime_error("failure in zlib::inflateInit2"s);
+
+  auto const old = out.size();
+  out.resize(old + std::max<std::size_t>(
+                       1, len < 4 ? 0 : le32(member + len - 4)));
+  zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(member));
+  zs.avail_in = len;
+  zs.next_out = reinterpret_cast<Bytef *>(out.data() + old);
+  zs.avail_out = out.size() - old;
+  auto const result = inflate(&zs, Z_FINISH);
+  out.resize(old + zs.total_out);
+  inflateEnd(&zs);
+
+  if (result != Z_STREAM_END)
+    throw std::runtime_error("failure in zlib::inflate"s);
+}
+
+#if LSL_ENABLE_COMP_zstd
+static void zstd_decode_frame(char const * const frame, std::size_t const len,
+                              std::vector<char> & out)
+{
+  std::unique_ptr<ZSTD_DStream, decltype(&ZSTD_freeDStream)> stream(
+      ZSTD_createDStream(), ZSTD_freeDStream);
+  if (!stream || ZSTD_isError(ZSTD_initDStream(stream.get())))
+    throw std::runtime_error("failure in ZSTD_initDStream"s);
+
+  auto const old = out.size();
+  auto const content = ZSTD_getFrameContentSize(frame, len);
+  out.resize(old + (content == ZSTD_CONTENTSIZE_UNKNOWN ||
+                            content == ZSTD_CONTENTSIZE_ERROR
+                        ? ZSTD_DStreamOutSize()
+                        : content));
+  ZSTD_inBuffer in = {frame, len, 0};
+  ZSTD_outBuffer ob = {out.data() + old, out.size() - old, 0};
+  for (;;)
+    {
+      auto const result = ZSTD_decompressStream(stream.get(), &ob, &in);
+      if (ZSTD_isError(result))
+        throw std::runtime_error("failure in ZSTD_decompressStream"s);
+      if (result == 0 || (in.pos == in.size && ob.pos < ob.size))
+        break;
+      if (ob.pos == ob.size)
+        {
+          out.resize(out.size() * 2 + 1);
+          ob.dst = out.data() + old;
+          ob.size = out.size() - old;
+        }
+    }
+  out.resize(old + ob.pos);
+}
+#endif
+
+static void decode_member(parallel_decoder::format const fmt,
+                          char const * const member, std::size_t const len,
+                          std::vector<char> & out)
+{
+#if LSL_ENABLE_COMP_zstd
+  if (fmt == parallel_decoder::format::zstd)
+    return zstd_decode_frame(member, len, out);
+#endif
+  inflate_member(member, len, out);
+}
+
+parallel_decoder::parallel_decoder(char const * const path,
+                                   format const fmt,
+                                   std::size_t const threads)
+    : fmt(fmt), window(2 * threads), in(path, std::ios_base::binary),
+      batches(window)
+{
+  if (!in)
+    throw std::runtime_error("failed to open compressed input"s);
+  for (std::size_t i = 0; i < threads; ++i)
+    workers.emplace_back(&parallel_decoder::work, this);
+}
+
+parallel_decoder::~parallel_decoder()
+{
+  batches.finish();
+  for (auto & worker : workers)
+    worker.join();
+  if (serial && fmt == format::bgzf)
+    inflateEnd(&zs);
+#if LSL_ENABLE_COMP_zstd
+  ZSTD_freeDStream(zds);
+#endif
+}
+
+void parallel_decoder::work()
+{
+  while (auto b = batches.pop())
+    try
+      {
+        std::vector<char> out;
+        std::size_t begin = 0;
+        for (auto const end : b->ends)
+          {
+            decode_member(fmt, b->input.data() + begin, end - begin, out);
+            begin = end;
+          }
+        b->output.set_value(std::move(out));
+      }
+    catch (...)
+      {
+        b->output.set_exception(std::current_exception());
+      }
+}
+
+bool parallel_decoder::fill(std::size_t const want)
+{
+  if (pending.size() - consumed >= want)
+    return true;
+
+  pending.erase(pending.begin(), pending.begin() + consumed);
+  consumed = 0;
+  while (pending.size() < want && in)
+    {
+      auto const old = pending.size();
+      pending.resize(old + std::max(read_chunk, want - old));
+      in.read(pending.data() + old, pending.size() - old);
+      pending.resize(old + in.gcount());
+    }
+  return pending.size() >= want;
+}
+
+void parallel_decoder::start_serial()
+{
+  serial = true;
+#if LSL_ENABLE_COMP_zstd
+  if (fmt == format::zstd)
+    {
+      zds = ZSTD_createDStream();
+      if (zds == nullptr || ZSTD_isError(ZSTD_initDStream(zds)))
+        throw std::runtime_error("failure in ZSTD_initDStream"s);
+      return;
+    }
+#endif
+  if (inflateInit2(&zs, 15 + 16) != Z_OK)
+    throw std::runtime_error("failure in zlib::inflateInit2"s);
+}
+
+/* Collects whole members up to read_chunk bytes, stopping early where
+   serial decoding takes over: at a gzip member that is not a BGZF block,
+   or at a zstd frame that is corrupt or whose size is not found within
+   probe_limit bytes, which open() would also have left to libarchive. */
+optional<parallel_decoder::batch> parallel_decoder::next_batch()
+{
+  batch b;
+  while (b.input.size() < read_chunk && fill(1))
+    {
+      auto const available = pending.size() - consumed;
+      auto size = member_size(fmt, pending.data() + consumed, available);
+      if (size == need_more_input && available >= probe_limit)
+        size = 0;
+      if (size == 0)
+        {
+          start_serial();
+          break;
+        }
+
+      if (size == need_more_input)
+        {
+          if (!fill(available + 1))
+            throw std::runtime_error("truncated compressed input"s);
+          continue;
+        }
+
+      if (!fill(size))
+        throw std::runtime_error("truncated compressed input"s);
+      auto const begin = pending.cbegin() + consumed;
+      b.input.insert(b.input.end(), begin, begin + size);
+      b.ends.push_back(b.input.size());
+      consumed += size;
+    }
+
+  if (b.ends.empty())
+    return {};
+  return b;
+}
+
+/* Inflates the input after the last BGZF block as a gzip stream of any
+   number of members. Anything after the last member that does not begin
+   another one is ignored, as gzip does. */
+std::size_t parallel_decoder::inflate_rest(void const *& buff)
+{
+  current.resize(read_chunk);
+  std::size_t produced = 0;
+  while (!serial_done && produced < current.size() && fill(1))
+    {
+      if (!inflating)
+        {
+          if (!fill(2) || uint8_t(pending[consumed]) != 0x1f ||
+              uint8_t(pending[consumed + 1]) != 0x8b)
+            {
+              serial_done = true;
+              break;
+            }
+          inflateReset(&zs);
+          inflating = true;
+        }
+
+      zs.next_in = reinterpret_cast<Bytef *>(pending.data() + consumed);
+      zs.avail_in = pending.size() - consumed;
+      zs.next_out = reinterpret_cast<Bytef *>(current.data() + produced);
+      zs.avail_out = current.size() - produced;
+      auto const result = inflate(&zs, Z_NO_FLUSH);
+      consumed = pending.size() - zs.avail_in;
+      produced = current.size() - zs.avail_out;
+      if (result == Z_STREAM_END)
+        inflating = false;
+      else if (result != Z_OK && result != Z_BUF_ERROR)
+        throw std::runtime_error("failure in zlib::inflate"s);
+    }
+
+  if (inflating && produced < current.size() && !fill(1))
+    throw std::runtime_error("truncated compressed input"s);
+  current.resize(produced);
+  buff = current.data();
+  return produced;
+}
+
+#if LSL_ENABLE_COMP_zstd
+/* Decodes the input after the last frame handed to the workers as a
+   stream of any number of frames. */
+std::size_t parallel_decoder::zstd_rest(void const *& buff)
+{
+  current.resize(read_chunk);
+  ZSTD_outBuffer out = {current.data(), current.size(), 0};
+  while (out.pos < out.size)
+    {
+      bool const more = fill(1);
+      if (!more && !inflating)
+        break;
+
+      ZSTD_inBuffer in = {pending.data() + consumed,
+                          pending.size() - consumed, 0};
+      auto const produced = out.pos;
+      auto const result = ZSTD_decompressStream(zds, &out, &in);
+      if (ZSTD_isError(result))
+        throw std::runtime_error("failure in ZSTD_decompressStream"s);
+      consumed += in.pos;
+      inflating = result != 0;
+      if (!more && out.pos == produced)
+        throw std::runtime_error("truncated compressed input"s);
+    }
+
+  current.resize(out.pos);
+  buff = current.data();
+  return out.pos;
+}
+#endif
+
+std::size_t parallel_decoder::read(void const *& buff)
+{
+  for (;;)
+    {
+      while (!serial && decoded.size() < window)
+        {
+          auto b = next_batch();
+          if (!b)
+            break;
+          decoded.push_back(b->output.get_future());
+          batches.push(std::move(*b));
+        }
+
+      if (decoded.empty())
+        {
+          if (!serial)
+            return 0;
+#if LSL_ENABLE_COMP_zstd
+          if (fmt == format::zstd)
+            return zstd_rest(buff);
+#endif
+          return inflate_rest(buff);
+        }
+
+      current = decoded.front().get();
+      decoded.pop_front();
+      if (!current.empty())
+        {
+          buff = current.data();
+          return current.size();
+        }
+    }
+}
+
+std::unique_ptr<input_source>
+parallel_decoder::open(char const * const path, std::size_t const window)
+{
+  std::ifstream probe(path, std::ios_base::binary);
+  std::vector<char> head;
+  std::size_t size = need_more_input;
+  format fmt = format::bgzf;
+
+  while (probe && head.size() < probe_limit && size == need_more_input)
+    {
+      auto const old = head.size();
+      head.resize(old + std::max(read_chunk, old));
+      probe.read(head.data() + old, head.size() - old);
+      head.resize(old + probe.gcount());
+
+      if (head.size() >= 4 && le32(head.data()) == 0xfd2fb528u)
+        fmt = format::zstd;
+      size = member_size(fmt, head.data(), head.size());
+    }
+
+  bool const single_member = !probe && size == head.size();
+  if (size == 0 || size == need_more_input || single_member)
+    return nullptr;
+  return std::make_unique<parallel_decoder>(path, fmt, window);
+}
@@ -0,0 +1,104 @@
+/*
+Copyright (C) 2018  Charles Cagle
+
+This file is part of archive2sqfs.
+
+archive2sqfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3.
+
+archive2sqfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with archive2sqfs.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef LSL_PARALLEL_DECODER_H
+#define LSL_PARALLEL_DECODER_H
+
+#include <cstddef>
+#include <deque>
+#include <fstream>
+#include <future>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <zlib.h>
+#if LSL_ENABLE_COMP_zstd
+#include <zstd.h>
+#endif
+
+#include "bounded_work_queue.h"
+#include "input_source.h"
+#include "optional.h"
+
+/* Decompresses BGZF (blocked gzip) and multi-frame zstd input on a pool
+   of worker threads, handing them batches of whole gzip members or zstd
+   frames, keeping up to window batches in flight and returning their
+   output in input order. Member and frame boundaries are found from their
+   headers without decompressing. A gzip member without a BGZF header ends
+   the parallel part: it and the rest of the input are inflated serially,
+   as libarchive would. So does a zstd frame that is corrupt, or too large
+   to find its end within the bytes that open() probes, after which the
+   rest is decoded serially as one stream. */
+class parallel_decoder : public input_source
+{
+public:
+  enum class format
+  {
+    bgzf,
+    zstd
+  };
+
+private:
+  struct batch
+  {
+    std::vector<char> input;
+    std::vector<std::size_t> ends;
+    std::promise<std::vector<char>> output;
+  };
+
+  format const fmt;
+  std::size_t const window;
+  std::ifstream in;
+  std::vector<char> pending;
+  std::size_t consumed = 0;
+  bounded_work_queue<batch> batches;
+  std::vector<std::thread> workers;
+  std::deque<std::future<std::vector<char>>> decoded;
+  std::vector<char> current;
+
+  bool serial = false;
+  bool serial_done = false;
+  bool inflating = false;
+  z_stream zs = {};
+#if LSL_ENABLE_COMP_zstd
+  ZSTD_DStream * zds = nullptr;
+#endif
+
+  bool fill(std::size_t);
+  void start_serial();
+  optional<batch> next_batch();
+  std::size_t inflate_rest(void const *&);
+#if LSL_ENABLE_COMP_zstd
+  std::size_t zstd_rest(void const *&);
+#endif
+  void work();
+
+public:
+  parallel_decoder(char const *, format, std::size_t threads);
+  ~parallel_decoder();
+
+  /* Returns a decoder for the named file, or nullptr when its contents
+     are not split into independently decodable members or frames, in
+     which case libarchive's serial filters should be used. */
+  static std::unique_ptr<input_source> open(char const *, std::size_t);
+
+  virtual std::size_t read(void const *&);
+};
+
+#endif
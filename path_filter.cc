@@ -0,0 +1,275 @@
+/*
+Copyright (C) 2018  Charles Cagle
+
+This file is part of archive2sqfs.
+
+archive2sqfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3.
+
+archive2sqfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with archive2sqfs.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "path_filter.h"
+#include "string_view.h"
+
+static std::vector<string_view> path_components(string_view const path)
+{
+  std::vector<string_view> components;
+  std::size_t begin = 0;
+  while (begin <= path.size())
+    {
+      auto end = path.find('/', begin);
+      if (end == path.npos)
+        end = path.size();
+      auto const component = path.substr(begin, end - begin);
+      if (!component.empty() && component != ".")
+        components.push_back(component);
+      begin = end + 1;
+    }
+  return components;
+}
+
+static bool has_wildcard(string_view const component)
+{
+  return component.find('*') != component.npos ||
+         component.find('?') != component.npos;
+}
+
+/* Whether the '*' at pi begins a '**' that starts a component and is
+   followed by '/', which also matches no directories at all. */
+static bool skips_dirs(string_view const pattern, std::size_t const pi)
+{
+  return (pi == 0 || pattern[pi - 1] == '/') && pi + 2 < pattern.size() &&
+         pattern[pi + 1] == '*' && pattern[pi + 2] == '/';
+}
+
+/* Matches text against pattern, where '?' and '*' match within a path
+   component and '**' matches across components. A component '**' before
+   a '/' matches any number of leading directories, including none. On a
+   mismatch, the last '*' takes one more character if that stays within
+   its component, and otherwise the last '**' takes one more character,
+   or one more directory. Either kind of '**' could take whatever an
+   earlier '*' or '**' would give up, and each '/' must meet its literal
+   in the pattern, so this finds a match whenever there is one. */
+static bool glob_match(string_view const pattern, string_view const text)
+{
+  auto const none = string_view::npos;
+  std::size_t pi = 0;
+  std::size_t ti = 0;
+  std::size_t star_p = none;
+  std::size_t star_t = 0;
+  std::size_t deep_p = none;
+  std::size_t deep_t = 0;
+  bool deep_dirs = false;
+
+  while (ti < text.size())
+    {
+      if (pi < pattern.size() && pattern[pi] == '*')
+        {
+          if (pi + 1 < pattern.size() && pattern[pi + 1] == '*')
+            {
+              deep_dirs = skips_dirs(pattern, pi);
+              pi += deep_dirs ? 3 : 2;
+              deep_p = pi;
+              deep_t = ti;
+              star_p = none;
+            }
+          else
+            {
+              star_p = ++pi;
+              star_t = ti;
+            }
+          continue;
+        }
+
+      if (pi < pattern.size() &&
+          (pattern[pi] == '?' ? text[ti] != '/' : pattern[pi] == text[ti]))
+        {
+          ++pi;
+          ++ti;
+        }
+      else if (star_p != none && text[star_t] != '/')
+        {
+          pi = star_p;
+          ti = ++star_t;
+        }
+      else if (deep_p != none)
+        {
+          if (deep_dirs)
+            {
+              auto const slash = text.find('/', deep_t);
+              if (slash == none)
+                return false;
+              deep_t = slash + 1;
+            }
+          else
+            ++deep_t;
+          pi = deep_p;
+          ti = deep_t;
+          star_p = none;
+        }
+      else
+        return false;
+    }
+
+  while (pi < pattern.size() && pattern[pi] == '*')
+    pi += skips_dirs(pattern, pi) ? 3 : 1;
+  return pi == pattern.size();
+}
+
+/* Matches glob against each ancestor-or-self of path. */
+static bool glob_match_ancestor(std::string const & glob,
+                                string_view const path)
+{
+  for (auto end = path.find('/');; end = path.find('/', end + 1))
+    {
+      if (glob_match(glob, path.substr(0, end)))
+        return true;
+      if (end == path.npos)
+        return false;
+    }
+}
+
+/* Whether glob could match a path below dir, matching their components
+   in turn. A component with '**' in it could take any number of them. */
+static bool glob_leads(std::string const & glob, string_view const dir)
+{
+  auto const patterns = path_components(glob);
+  auto const names = path_components(dir);
+  for (std::size_t i = 0; i < names.size(); ++i)
+    {
+      if (i == patterns.size())
+        return false;
+      for (std::size_t j = 1; j < patterns[i].size(); ++j)
+        if (patterns[i][j - 1] == '*' && patterns[i][j] == '*')
+          return true;
+      if (!glob_match(patterns[i], names[i]))
+        return false;
+    }
+  return names.size() < patterns.size();
+}
+
+/* Returns path without empty and "." components, which are only copied
+   into buff if there are any to drop. */
+static string_view normalized_path(string_view const path,
+                                   std::string & buff)
+{
+  bool normal = true;
+  for (std::size_t begin = 0; normal && begin <= path.size();)
+    {
+      auto end = path.find('/', begin);
+      if (end == path.npos)
+        end = path.size();
+      auto const component = path.substr(begin, end - begin);
+      normal = !component.empty() && component != ".";
+      begin = end + 1;
+    }
+  if (normal || path.empty())
+    return path;
+
+  for (auto const component : path_components(path))
+    {
+      if (!buff.empty())
+        buff += '/';
+      buff.append(component.data(), component.size());
+    }
+  return buff;
+}
+
+path_filter::node * path_filter::node::child(string_view const name) const
+{
+  for (auto const & entry : children)
+    if (string_view(entry.first) == name)
+      return entry.second.get();
+  return nullptr;
+}
+
+void path_filter::add(std::string const & pattern, rule_kind const kind)
+{
+  auto const components = path_components(pattern);
+  auto n = &root;
+  std::size_t i = 0;
+  for (; i < components.size() && !has_wildcard(components[i]); ++i)
+    {
+      n->include_below = n->include_below || kind == INCLUDE;
+      auto child = n->child(components[i]);
+      if (child == nullptr)
+        {
+          n->children.emplace_back(std::string(components[i]),
+                                   std::make_unique<node>());
+          child = n->children.back().second.get();
+        }
+      n = child;
+    }
+  n->include_below = n->include_below || kind == INCLUDE;
+
+  if (i == components.size())
+    n->prefix[kind] = true;
+  else
+    {
+      std::string glob;
+      for (; i < components.size(); ++i)
+        {
+          if (!glob.empty())
+            glob += '/';
+          glob.append(components[i].data(), components[i].size());
+        }
+      n->globs[kind].push_back(glob);
+    }
+
+  ++rule_count;
+  has_includes = has_includes || kind == INCLUDE;
+}
+
+bool path_filter::matches(string_view const path, rule_kind const kind,
+                          bool const directory) const
+{
+  std::string buff;
+  auto const normal = normalized_path(path, buff);
+  auto n = &root;
+  for (std::size_t begin = 0;;)
+    {
+      if (n->prefix[kind])
+        return true;
+      auto const rest =
+          begin < normal.size() ? normal.substr(begin) : string_view();
+      for (auto const & glob : n->globs[kind])
+        if (!rest.empty() && (glob_match_ancestor(glob, rest) ||
+                              (directory && glob_leads(glob, rest))))
+          return true;
+      if (rest.empty())
+        break;
+
+      auto end = rest.find('/');
+      if (end == rest.npos)
+        end = rest.size();
+      n = n->child(rest.substr(0, end));
+      if (n == nullptr)
+        return false;
+      begin += end + 1;
+    }
+  return kind == INCLUDE && n->include_below;
+}
+
+bool path_filter::selects(string_view const path,
+                          bool const directory) const
+{
+  if (empty())
+    return true;
+  if (matches(path, EXCLUDE, false))
+    return false;
+  return !has_includes || matches(path, INCLUDE, directory);
+}
@@ -0,0 +1,71 @@
+/*
+Copyright (C) 2018  Charles Cagle
+
+This file is part of archive2sqfs.
+
+archive2sqfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3.
+
+archive2sqfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with archive2sqfs.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef LSL_PATH_FILTER_H
+#define LSL_PATH_FILTER_H
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "string_view.h"
+
+/* Include and exclude rules compiled into a trie over path components.
+   A rule's leading literal components select its trie node, so a path
+   only ever tests the rules found along its own components. A rule
+   without wildcards matches its path and everything below it. A rule
+   with wildcards ('?', '*' within a component, '**' across components)
+   matches any path with an ancestor-or-self that it matches. A path is
+   selected when it matches no exclude rule and, if there are include
+   rules, either matches one or is an ancestor of one. A directory is also
+   selected where an include rule with wildcards could match below it, so
+   that it keeps its own metadata. */
+class path_filter
+{
+  enum rule_kind
+  {
+    INCLUDE,
+    EXCLUDE
+  };
+
+  struct node
+  {
+    std::vector<std::pair<std::string, std::unique_ptr<node>>> children;
+    bool prefix[2] = {false, false};
+    bool include_below = false;
+    std::vector<std::string> globs[2];
+
+    node * child(string_view) const;
+  };
+
+  node root;
+  std::size_t rule_count = 0;
+  bool has_includes = false;
+
+  void add(std::string const &, rule_kind);
+  bool matches(string_view, rule_kind, bool directory) const;
+
+public:
+  void include(std::string const & pattern) { add(pattern, INCLUDE); }
+  void exclude(std::string const & pattern) { add(pattern, EXCLUDE); }
+  bool empty() const { return rule_count == 0; }
+  bool selects(string_view, bool directory = false) const;
+};
+
+#endif
@@ -49,14 +49,17 @@ void pending_block::report(uint64_t start, std::vector<char> & block,
 void pending_dedup::handle_write()
 {
   auto & writer = pending_write::writer;
-  auto const sum = writer.blocked_checksums[inode_number].sum;
   auto & reports = writer.reports;
-  for (auto i : writer.blocked_duplicates[sum])
-    if (reports[inode_number].same_content(reports[i], writer))
-      {
-        writer.drop_bytes(reports[inode_number].range_len());
-        reports[inode_number] = reports[i];
-        return;
-      }
-  writer.blocked_duplicates[sum].push_back(inode_number);
+  auto & report = reports[inode_number];
+  auto const dup = writer.blocked_duplicates.find(key, [&](uint32_t const i) {
+    return report.same_content(reports[i], writer);
+  });
+
+  if (dup)
+    {
+      writer.drop_bytes(report.range_len());
+      report = reports[*dup];
+    }
+  else
+    writer.blocked_duplicates.insert(key, inode_number);
 }
@@ -21,6 +21,7 @@ along with archive2sqfs.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <cstdint>
 #include <future>
+#include <utility>
 
 #include "compressor.h"
 
@@ -71,9 +72,10 @@ struct pending_block : public pending_write
 struct pending_dedup : public pending_write
 {
   uint32_t const inode_number;
+  uint64_t const key;
 
-  pending_dedup(sqsh_writer & writer, uint32_t inode_number)
-      : pending_write(writer, {}), inode_number(inode_number)
+  pending_dedup(sqsh_writer & writer, uint32_t inode_number, uint64_t key)
+      : pending_write(writer, {}), inode_number(inode_number), key(key)
   {
   }
 
@@ -81,4 +83,18 @@ struct pending_dedup : public pending_write
   virtual void handle_write();
 };
 
+/* Marks the point in the queue up to which all writes are done. */
+struct pending_sync : public pending_write
+{
+  std::promise<void> done;
+
+  pending_sync(sqsh_writer & writer, std::promise<void> && done)
+      : pending_write(writer, {}), done(std::move(done))
+  {
+  }
+
+  virtual void report(uint64_t, std::vector<char> &, bool) {}
+  virtual void handle_write() { done.set_value(); }
+};
+
 #endif
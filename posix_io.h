@@ -0,0 +1,44 @@
+/*
+Copyright (C) 2018  Charles Cagle
+
+This file is part of archive2sqfs.
+
+archive2sqfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3.
+
+archive2sqfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with archive2sqfs.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef LSL_POSIX_IO_H
+#define LSL_POSIX_IO_H
+
+/* The system calls used to map input, walk directories, lock the block
+   cache, and sync and preallocate the image, which the build enables with
+   USE_POSIX. Without them, input is read through streams, directories and
+   the block cache's lock are not supported, and nothing is synced. */
+#if LSL_USE_POSIX
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define LSL_HAVE_DIRENT 1
+#define LSL_HAVE_FLOCK 1
+#define LSL_HAVE_FSYNC 1
+#define LSL_HAVE_MMAP 1
+#if defined(FALLOC_FL_KEEP_SIZE)
+#define LSL_HAVE_FALLOCATE 1
+#endif
+#endif
+
+#endif
@@ -0,0 +1,220 @@
+/*
+Copyright (C) 2018  Charles Cagle
+
+This file is part of archive2sqfs.
+
+archive2sqfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3.
+
+archive2sqfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with archive2sqfs.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef LSL_READER_THREAD_H
+#define LSL_READER_THREAD_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+using namespace std::literals;
+
+#include <archive_entry.h>
+
+#include "bounded_work_queue.h"
+#include "entry_header.h"
+#include "string_view.h"
+
+/* Runs reader R on its own thread, which decodes the input and splits
+   file data into chunks while the client thread builds the tree. Entries
+   rejected by the selection predicate are skipped on the reader thread,
+   and hard link entries never have their data read. Chunks are passed in
+   R's own buffer type, so a reader that hands out spans of a mapped
+   input passes those spans without copying; the reader, and with it the
+   mapping, lives until this object is destroyed. */
+template <typename R> class reader_thread
+{
+public:
+  using buffer_type = typename R::buffer_type;
+
+private:
+  struct item
+  {
+    std::unique_ptr<entry_header> header;
+    buffer_type data;
+  };
+
+  std::unique_ptr<R> reader;
+  bounded_work_queue<item> queue;
+  std::exception_ptr error;
+  std::thread thread;
+
+  std::unique_ptr<entry_header> current;
+  buffer_type chunk;
+  std::size_t chunk_offset = 0;
+  std::vector<char> joined;
+
+  template <typename P> void produce(P selected, std::size_t chunk_size)
+  {
+    try
+      {
+        while (reader->next())
+          {
+            if (!selected(*reader))
+              {
+                reader->skip();
+                continue;
+              }
+
+            auto header = std::make_unique<entry_header>(*reader);
+            auto const filetype = header->filetype();
+            auto size = header->filesize();
+            queue.push({std::move(header), {}});
+
+            if (filetype != AE_IFREG || size == 0)
+              {
+                reader->skip();
+                continue;
+              }
+
+            while (size > 0)
+              {
+                buffer_type data;
+                auto const len = std::min<int64_t>(size, chunk_size);
+                reader->read(data, len);
+                queue.push({nullptr, std::move(data)});
+                size -= len;
+              }
+          }
+      }
+    catch (...)
+      {
+        error = std::current_exception();
+      }
+    queue.finish();
+  }
+
+  void next_chunk()
+  {
+    auto option = queue.pop();
+    if (!option || option->header)
+      throw std::runtime_error("file data missing from reader"s);
+    chunk = std::move(option->data);
+    chunk_offset = 0;
+  }
+
+  void copy_chunks(std::vector<char> & con, std::size_t const len)
+  {
+    con.resize(len);
+    read(con.data(), len);
+  }
+
+  /* Only a read that straddles chunks gets here, and the span then points
+     into a buffer that the next such read reuses. */
+  void copy_chunks(string_view & span, std::size_t const len)
+  {
+    joined.resize(len);
+    read(joined.data(), len);
+    span = string_view(joined.data(), len);
+  }
+
+public:
+
+  template <typename P>
+  reader_thread(std::unique_ptr<R> && r, P selected,
+                std::size_t const chunk_size, std::size_t const bound = 64)
+      : reader(std::move(r)), queue(bound)
+  {
+    thread = std::thread([=]() { produce(selected, chunk_size); });
+  }
+
+  ~reader_thread()
+  {
+    while (queue.pop())
+      ;
+    if (thread.joinable())
+      thread.join();
+  }
+
+  bool next()
+  {
+    for (auto option = queue.pop(); option; option = queue.pop())
+      if (option->header)
+        {
+          current = std::move(option->header);
+          chunk = buffer_type();
+          chunk_offset = 0;
+          return true;
+        }
+
+    if (thread.joinable())
+      thread.join();
+    if (error)
+      std::rethrow_exception(error);
+    return false;
+  }
+
+  void skip() {}
+
+  void read(void * buff, std::size_t len)
+  {
+    auto out = static_cast<char *>(buff);
+    while (len != 0)
+      {
+        if (chunk_offset == chunk.size())
+          next_chunk();
+
+        auto const available = chunk.size() - chunk_offset;
+        auto const copied = len < available ? len : available;
+        std::memcpy(out, chunk.data() + chunk_offset, copied);
+        chunk_offset += copied;
+        out += copied;
+        len -= copied;
+      }
+  }
+
+  void read(buffer_type & con, std::size_t const len)
+  {
+    if (chunk_offset == chunk.size())
+      next_chunk();
+
+    if (chunk_offset == 0 && chunk.size() == len)
+      {
+        con = std::move(chunk);
+        chunk = buffer_type();
+        return;
+      }
+
+    copy_chunks(con, len);
+  }
+
+  auto pathname() const { return current->pathname(); }
+  auto filetype() const { return current->filetype(); }
+  auto mode() const { return current->mode(); }
+  auto uid() const { return current->uid(); }
+  auto gid() const { return current->gid(); }
+  auto mtime() const { return current->mtime(); }
+  auto filesize() const { return current->filesize(); }
+  auto rdev() const { return current->rdev(); }
+  auto symlink_target() const { return current->symlink_target(); }
+  auto hardlink_target() const { return current->hardlink_target(); }
+
+  auto reader_stall_time() { return queue.push_stall_time(); }
+  auto builder_stall_time() { return queue.pop_stall_time(); }
+};
+
+#endif
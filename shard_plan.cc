@@ -0,0 +1,218 @@
+/*
+Copyright (C) 2018  Charles Cagle
+
+This file is part of archive2sqfs.
+
+archive2sqfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3.
+
+archive2sqfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with archive2sqfs.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace std::literals;
+
+#include "shard_plan.h"
+
+/* The superblock, the padding at the end of an image and the lookup
+   tables of its metadata tables. */
+static uint64_t constexpr shard_overhead = 16384;
+
+/* An extended inode, a directory entry with a header of its own, two ids,
+   a fragment table entry and their share of metadata block headers. */
+static uint64_t constexpr entry_overhead = 128;
+
+static uint64_t entry_cost(std::string const & key)
+{
+  auto const sep = key.rfind('/');
+  return entry_overhead + key.size() - (sep == key.npos ? 0 : sep + 1);
+}
+
+shard_plan::shard_plan(uint64_t const budget, uint64_t const block_size)
+    : budget(budget), block_size(block_size)
+{
+  auto & root = nodes[""s];
+  root.dir = true;
+  root.own = entry_overhead;
+}
+
+shard_plan::node & shard_plan::put(std::string const & key, bool const dir)
+{
+  auto const found = nodes.find(key);
+  if (found != nodes.end())
+    {
+      found->second.dir = found->second.dir || dir;
+      return found->second;
+    }
+
+  auto const sep = key.rfind('/');
+  put(sep == key.npos ? ""s : key.substr(0, sep), true)
+      .children.push_back(key);
+  auto & n = nodes[key];
+  n.dir = dir;
+  n.own = entry_cost(key);
+  return n;
+}
+
+void shard_plan::add_dir(std::string const & key)
+{
+  put(key, true).last = ++added;
+}
+
+void shard_plan::add_file(std::string const & key, uint64_t const size)
+{
+  auto const blocks = (size + block_size - 1) / block_size;
+  auto & n = put(key, false);
+  n.own += size + 4 * blocks;
+  n.last = ++added;
+}
+
+void shard_plan::add_other(std::string const & key,
+                           std::size_t const inline_size)
+{
+  auto & n = put(key, false);
+  n.own += inline_size;
+  n.last = ++added;
+}
+
+void shard_plan::add_hardlink(std::string const & key,
+                              std::string const & target,
+                              uint64_t const size)
+{
+  auto const link = links.find(target);
+  auto const & resolved = link == links.end() ? target : link->second;
+  auto const t = nodes.find(resolved);
+  if (t == nodes.end() || t->second.dir || resolved == key)
+    {
+      add_file(key, size);
+      return;
+    }
+
+  t->second.own += entry_cost(key);
+  t->second.last = ++added;
+  links[key] = resolved;
+  auto const sep = key.rfind('/');
+  if (sep != key.npos)
+    put(key.substr(0, sep), true);
+}
+
+uint64_t shard_plan::sum(std::string const & key)
+{
+  auto & n = nodes.at(key);
+  std::sort(n.children.begin(), n.children.end());
+  n.total = n.own;
+  for (auto const & child : n.children)
+    n.total += sum(child);
+  return n.total;
+}
+
+/* Starts a new shard, which also holds the directories being split. */
+void shard_plan::open_shard()
+{
+  ++count;
+  used = shard_overhead;
+  for (auto const & key : splitting)
+    {
+      auto & n = nodes.at(key);
+      n.shards.push_back(count - 1);
+      used += n.own;
+    }
+}
+
+void shard_plan::assign(std::string const & key)
+{
+  auto & n = nodes.at(key);
+  n.shards.push_back(count - 1);
+  for (auto const & child : n.children)
+    assign(child);
+}
+
+void shard_plan::place(std::string const & key)
+{
+  auto & n = nodes.at(key);
+  if (count == 0 || used + n.total > budget)
+    {
+      uint64_t fresh = shard_overhead;
+      for (auto const & ancestor : splitting)
+        fresh += nodes.at(ancestor).own;
+      if (fresh + n.total <= budget)
+        open_shard();
+    }
+  if (count != 0 && used + n.total <= budget)
+    {
+      assign(key);
+      used += n.total;
+      return;
+    }
+
+  if (!n.dir)
+    throw std::runtime_error("entry does not fit in a shard: "s + key);
+  if (count == 0 || used + n.own > budget)
+    open_shard();
+  if (used + n.own > budget)
+    throw std::runtime_error("shard size is too small"s);
+  n.shards.push_back(count - 1);
+  used += n.own;
+  splitting.push_back(key);
+  for (auto const & child : n.children)
+    place(child);
+  splitting.pop_back();
+}
+
+std::size_t shard_plan::partition()
+{
+  sum(""s);
+  place(""s);
+
+  /* The directories leading to a link are also in its target's shard. */
+  for (auto const & link : links)
+    {
+      auto const shard = shard_of(link.second);
+      for (auto sep = link.first.rfind('/'); sep != link.first.npos;
+           sep = link.first.rfind('/', sep - 1))
+        {
+          auto & shards = nodes.at(link.first.substr(0, sep)).shards;
+          if (std::find(shards.begin(), shards.end(), shard) == shards.end())
+            shards.push_back(shard);
+        }
+    }
+  return count;
+}
+
+std::size_t shard_plan::shard_of(std::string const & key) const
+{
+  auto const link = links.find(key);
+  return shards_of_dir(link == links.end() ? key : link->second).front();
+}
+
+std::vector<std::size_t> const &
+shard_plan::shards_of_dir(std::string const & key) const
+{
+  auto const n = nodes.find(key);
+  if (n == nodes.end())
+    throw std::runtime_error("entry missing from the shard plan: "s + key);
+  return n->second.shards;
+}
+
+std::vector<std::size_t> shard_plan::last_entries() const
+{
+  std::vector<std::size_t> last(count);
+  for (auto const & n : nodes)
+    for (auto const shard : n.second.shards)
+      last[shard] = std::max(last[shard], n.second.last);
+  return last;
+}
@@ -0,0 +1,98 @@
+/*
+Copyright (C) 2018  Charles Cagle
+
+This file is part of archive2sqfs.
+
+archive2sqfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3.
+
+archive2sqfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with archive2sqfs.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef LSL_SHARD_PLAN_H
+#define LSL_SHARD_PLAN_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/* Partitions the tree of an input among shards, images that each stay
+   within a size budget. A directory is kept whole in one shard where it
+   fits, and its entries are spread over consecutive shards in sorted
+   order where it does not. A hardlink goes to the shard of the file it
+   refers to. Each entry's size is estimated from above, with its data
+   stored uncompressed and its metadata at its largest, so a shard never
+   outgrows the budget. Paths are keys as dirtree sees them, with the root
+   as "".
+
+   Entries are numbered from 1 in the order they are added, and each
+   shard knows the number of the last entry that puts anything in it, so
+   that a build adding entries in the same order can finish the shard
+   there. */
+class shard_plan
+{
+  struct node
+  {
+    bool dir = false;
+    uint64_t own = 0;
+    uint64_t total = 0;
+    std::size_t last = 0;
+    std::vector<std::string> children;
+    std::vector<std::size_t> shards;
+  };
+
+  uint64_t const budget;
+  uint64_t const block_size;
+  std::unordered_map<std::string, node> nodes;
+  std::unordered_map<std::string, std::string> links;
+
+  std::size_t count = 0;
+  std::size_t added = 0;
+  uint64_t used = 0;
+  std::vector<std::string> splitting;
+
+  node & put(std::string const &, bool dir);
+  uint64_t sum(std::string const &);
+  void open_shard();
+  void assign(std::string const &);
+  void place(std::string const &);
+
+public:
+  shard_plan(uint64_t budget, uint64_t block_size);
+
+  void add_dir(std::string const & key);
+  void add_file(std::string const & key, uint64_t size);
+
+  /* Symlinks, devices and the like, with the bytes kept in their inode. */
+  void add_other(std::string const & key, std::size_t inline_size);
+
+  /* A link whose target is not a file already added is taken as a file of
+     size bytes. */
+  void add_hardlink(std::string const & key, std::string const & target,
+                    uint64_t size);
+
+  /* Assigns every entry added to a shard, and returns how many shards
+     there are. Throws if a single entry does not fit in one. */
+  std::size_t partition();
+
+  std::size_t shard_of(std::string const & key) const;
+
+  /* The number of the last entry in each shard. */
+  std::vector<std::size_t> last_entries() const;
+
+  /* The shards in which the directory at key has entries. */
+  std::vector<std::size_t> const &
+  shards_of_dir(std::string const & key) const;
+};
+
+#endif
@@ -0,0 +1,181 @@
+/*
+Copyright (C) 2018  Charles Cagle
+
+This file is part of archive2sqfs.
+
+archive2sqfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3.
+
+archive2sqfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with archive2sqfs.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+using namespace std::literals;
+
+#include "block_cache.h"
+#include "compressor.h"
+#include "dirtree.h"
+#include "sqsh_builder.h"
+#include "sqsh_defs.h"
+#include "sqsh_writer.h"
+
+struct sqsh_builder::state
+{
+  std::unique_ptr<block_cache> cache;
+  sqsh_writer writer;
+  dirtree_dir root;
+  dirtree_reg * file = nullptr;
+  bool finished = false;
+
+  state(std::string const & path, sqsh_options const & opts)
+      : writer(path, opts.block_log ? opts.block_log : SQFS_BLOCK_LOG_DEFAULT,
+               opts.compressor.empty() ? COMPRESSOR_DEFAULT : opts.compressor,
+               opts.single_thread, opts.dedup),
+        root(&writer)
+  {
+    if (!opts.block_cache.empty())
+      {
+        cache = std::make_unique<block_cache>(
+            opts.block_cache, opts.block_cache_size
+                                  ? opts.block_cache_size
+                                  : BLOCK_CACHE_SIZE_DEFAULT);
+        writer.cache = cache.get();
+      }
+  }
+
+  void check_closed(char const * const what) const
+  {
+    if (finished)
+      throw std::runtime_error(what + ": image is already finished"s);
+    if (file != nullptr)
+      throw std::runtime_error(what + ": a file is still open"s);
+  }
+
+  dirtree_reg & open_file(char const * const what) const
+  {
+    if (file == nullptr)
+      throw std::runtime_error(what + ": no file is open"s);
+    return *file;
+  }
+};
+
+sqsh_builder::sqsh_builder(std::string const & path,
+                           sqsh_options const & opts)
+    : s(std::make_unique<state>(path, opts))
+{
+}
+
+sqsh_builder::~sqsh_builder() = default;
+
+std::size_t sqsh_builder::block_size() const
+{
+  return s->writer.block_size();
+}
+
+void sqsh_builder::add_directory(std::string const & path,
+                                 sqsh_metadata const & md)
+{
+  s->check_closed("add_directory");
+  s->root.subdir_for_path(path).update_metadata(md);
+}
+
+void sqsh_builder::add_symlink(std::string const & path,
+                               std::string const & target,
+                               sqsh_metadata const & md)
+{
+  s->check_closed("add_symlink");
+  s->root.put_file_with_metadata<dirtree_sym>(path, md, target);
+}
+
+void sqsh_builder::add_block_device(std::string const & path,
+                                    uint32_t const rdev,
+                                    sqsh_metadata const & md)
+{
+  s->check_closed("add_block_device");
+  s->root.put_file_with_metadata<dirtree_dev>(path, md, SQFS_INODE_TYPE_BLK,
+                                              rdev);
+}
+
+void sqsh_builder::add_char_device(std::string const & path,
+                                   uint32_t const rdev,
+                                   sqsh_metadata const & md)
+{
+  s->check_closed("add_char_device");
+  s->root.put_file_with_metadata<dirtree_dev>(path, md, SQFS_INODE_TYPE_CHR,
+                                              rdev);
+}
+
+void sqsh_builder::add_fifo(std::string const & path,
+                            sqsh_metadata const & md)
+{
+  s->check_closed("add_fifo");
+  s->root.put_file_with_metadata<dirtree_ipc>(path, md, SQFS_INODE_TYPE_PIPE);
+}
+
+void sqsh_builder::add_socket(std::string const & path,
+                              sqsh_metadata const & md)
+{
+  s->check_closed("add_socket");
+  s->root.put_file_with_metadata<dirtree_ipc>(path, md, SQFS_INODE_TYPE_SOCK);
+}
+
+bool sqsh_builder::add_hardlink(std::string const & path,
+                                std::string const & target)
+{
+  s->check_closed("add_hardlink");
+  return s->root.put_hardlink(path, target);
+}
+
+void sqsh_builder::begin_file(std::string const & path,
+                              sqsh_metadata const & md)
+{
+  s->check_closed("begin_file");
+  s->file = &s->root.put_file_with_metadata<dirtree_reg>(path, md);
+}
+
+void sqsh_builder::append(char const * const data, std::size_t const len)
+{
+  s->open_file("append").append(data, len);
+}
+
+void sqsh_builder::append(std::vector<char> && block)
+{
+  auto & file = s->open_file("append");
+  auto const size = block_size();
+  if (block.size() > size)
+    file.append(block.data(), block.size());
+  else
+    file.append(std::move(block));
+}
+
+void sqsh_builder::end_file()
+{
+  s->open_file("end_file").finalize();
+  s->file = nullptr;
+}
+
+bool sqsh_builder::finish()
+{
+  s->check_closed("finish");
+  bool const failed = s->writer.finish_data();
+  if (s->cache)
+    s->cache->close();
+  s->root.write_tables();
+  s->writer.write_header();
+  s->finished = true;
+  return failed;
+}
@@ -0,0 +1,108 @@
+/*
+Copyright (C) 2018  Charles Cagle
+
+This file is part of archive2sqfs.
+
+archive2sqfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3.
+
+archive2sqfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with archive2sqfs.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef LSL_SQSH_BUILDER_H
+#define LSL_SQSH_BUILDER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+/* Ownership and times of one image entry. */
+struct sqsh_metadata
+{
+  uint16_t perm = 0644;
+  uint32_t user = 0;
+  uint32_t group = 0;
+  int64_t time = 0;
+
+  uint16_t mode() const { return perm; }
+  uint32_t uid() const { return user; }
+  uint32_t gid() const { return group; }
+  int64_t mtime() const { return time; }
+};
+
+/* How an image is written. Zero or empty selects the default. A
+   block_cache path names a cache of compressed blocks kept across
+   builds, which is limited to block_cache_size bytes. */
+struct sqsh_options
+{
+  int block_log = 0;
+  std::string compressor;
+  bool single_thread = false;
+  bool dedup = false;
+  std::string block_cache;
+  uint64_t block_cache_size = 0;
+};
+
+/* Builds a squashfs image from entries that the caller produces in
+   process, without an archive in between. Paths are relative to the
+   image root, and missing parent directories are created. A later entry
+   replaces an earlier one at the same path.
+
+   File data is streamed between begin_file and end_file, and only one
+   file is open at a time. Spans given to append are copied before it
+   returns; whole blocks given as vectors are taken over without a copy
+   when the file is at a block boundary. Nothing is complete until
+   finish, which returns true if any data could not be written. */
+class sqsh_builder
+{
+  struct state;
+  std::unique_ptr<state> s;
+
+public:
+  explicit sqsh_builder(std::string const & path,
+                        sqsh_options const & opts = sqsh_options());
+  sqsh_builder(sqsh_builder const &) = delete;
+  ~sqsh_builder();
+
+  std::size_t block_size() const;
+
+  void add_directory(std::string const & path, sqsh_metadata const &);
+  void add_symlink(std::string const & path, std::string const & target,
+                   sqsh_metadata const &);
+  /* rdev is stored as squashfs stores it, in 32 bits. */
+  void add_block_device(std::string const & path, uint32_t rdev,
+                        sqsh_metadata const &);
+  void add_char_device(std::string const & path, uint32_t rdev,
+                       sqsh_metadata const &);
+  void add_fifo(std::string const & path, sqsh_metadata const &);
+  void add_socket(std::string const & path, sqsh_metadata const &);
+
+  /* Returns false if there is no file at target to link to. */
+  bool add_hardlink(std::string const & path, std::string const & target);
+
+  void begin_file(std::string const & path, sqsh_metadata const &);
+  void append(char const * data, std::size_t len);
+  void append(std::vector<char> && block);
+  void end_file();
+
+  void add_file(std::string const & path, sqsh_metadata const & md,
+                char const * data, std::size_t len)
+  {
+    begin_file(path, md);
+    append(data, len);
+    end_file();
+  }
+
+  bool finish();
+};
+
+#endif
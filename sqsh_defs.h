@@ -41,6 +41,9 @@ along with archive2sqfs.  If not, see <http://www.gnu.org/licenses/>.
 #define SQFS_META_BLOCK_COMPRESSED_BIT 0x8000u
 #define SQFS_BLOCK_COMPRESSED_BIT UINT32_C(0x1000000)
 #define SQFS_BLOCK_INVALID 0xffffffff
+#define SQFS_DIR_COUNT 256
+#define SQFS_DIR_HEADER_SIZE 12
+#define SQFS_DIR_ENTRY_SIZE 8
 
 #define SQFS_XATTR_NONE 0xffffffffu
 #define SQFS_FRAGMENT_NONE 0xffffffffu
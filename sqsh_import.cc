@@ -0,0 +1,253 @@
+/*
+Copyright (C) 2018  Charles Cagle
+
+This file is part of archive2sqfs.
+
+archive2sqfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3.
+
+archive2sqfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with archive2sqfs.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <future>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+using namespace std::literals;
+
+#include "content_hash.h"
+#include "dedup_index.h"
+#include "dirtree.h"
+#include "optional.h"
+#include "sqsh_defs.h"
+#include "sqsh_import.h"
+#include "sqsh_reader.h"
+#include "sqsh_writer.h"
+
+template <typename T, typename... A>
+static std::shared_ptr<T> make_node(sqsh_writer * const wr,
+                                    sqsh_inode const & node, A... a)
+{
+  return std::make_shared<T>(wr, a..., node.mode(), node.uid(), node.gid(),
+                             node.mtime());
+}
+
+/* Where the data of an image lands in the output: its blocks are moved
+   by offset bytes, and its fragments are renumbered from first_fragment.
+   The fragment table must be moved to match. */
+struct relocation
+{
+  uint64_t offset;
+  uint32_t first_fragment;
+};
+
+static std::shared_ptr<dirtree> import_file(sqsh_writer * const wr,
+                                            sqsh_inode const & node,
+                                            relocation const & moved)
+{
+  switch (node.type)
+    {
+      case SQFS_INODE_TYPE_REG:
+        {
+          auto reg = make_node<dirtree_reg>(wr, node);
+          reg->file_size = node.file_size;
+          reg->sparse = node.sparse;
+          reg->block_count = node.blocks.size();
+          wr->reports[reg->inode_number] = {node.start_block + moved.offset,
+                                            node.blocks};
+          if (node.fragment != SQFS_FRAGMENT_NONE)
+            wr->fragment_indices[reg->inode_number] = {
+                node.fragment + moved.first_fragment, node.fragment_offset};
+          return reg;
+        }
+
+      case SQFS_INODE_TYPE_SYM:
+        return make_node<dirtree_sym>(wr, node, node.target);
+
+      case SQFS_INODE_TYPE_BLK:
+      case SQFS_INODE_TYPE_CHR:
+        return make_node<dirtree_dev>(wr, node, node.type, node.rdev);
+
+      default:
+        return make_node<dirtree_ipc>(wr, node, node.type);
+    }
+}
+
+struct seeded_file
+{
+  uint32_t inode_number;
+  sqsh_inode node;
+};
+
+/* Hashes the old files whose contents the writer could deduplicate
+   against: those stored only as blocks, and those stored only in a
+   fragment. Files with both, or with sparse blocks, are left out. */
+static void seed_dedup(sqsh_reader & image, sqsh_writer & wr,
+                       std::vector<seeded_file> const & files)
+{
+  std::deque<std::future<void>> tasks;
+  auto const run = [&](auto task) {
+    if (tasks.size() >= thread_count())
+      {
+        tasks.front().get();
+        tasks.pop_front();
+      }
+    tasks.push_back(std::async(wr.launch_policy(), task));
+  };
+
+  std::vector<optional<uint64_t>> keys(files.size());
+  std::map<uint32_t, std::vector<std::size_t>> by_fragment;
+  for (std::size_t i = 0; i < files.size(); ++i)
+    {
+      auto const & node = files[i].node;
+      bool const sparse = std::count(node.blocks.begin(), node.blocks.end(),
+                                     uint32_t(0)) != 0;
+      if (node.blocks.empty() && node.fragment != SQFS_FRAGMENT_NONE)
+        by_fragment[node.fragment].push_back(i);
+      else if (!node.blocks.empty() && node.fragment == SQFS_FRAGMENT_NONE &&
+               !sparse)
+        run([&, i]() {
+          auto const & node = files[i].node;
+          content_hash hash;
+          auto pos = node.start_block;
+          for (auto const size : node.blocks)
+            {
+              hash.update(image.read_block(pos, size));
+              pos += size & ~SQFS_BLOCK_COMPRESSED_BIT;
+            }
+          keys[i] = dedup_index::key_for(node.file_size, hash.value());
+        });
+    }
+
+  for (auto const & group : by_fragment)
+    run([&]() {
+      auto const & entry = image.fragments.at(group.first);
+      auto const block = image.read_block(entry.start_block, entry.size);
+      for (auto const i : group.second)
+        {
+          auto const & node = files[i].node;
+          if (node.fragment_offset > block.size() ||
+              node.file_size > block.size() - node.fragment_offset)
+            throw std::runtime_error("fragment out of range in image"s);
+          content_hash hash;
+          hash.update(block.data() + node.fragment_offset, node.file_size);
+          keys[i] = dedup_index::key_for(node.file_size, hash.value());
+        }
+    });
+
+  while (!tasks.empty())
+    {
+      tasks.front().get();
+      tasks.pop_front();
+    }
+
+  for (std::size_t i = 0; i < files.size(); ++i)
+    {
+      if (!keys[i])
+        continue;
+      auto & index = files[i].node.blocks.empty() ? wr.fragmented_duplicates
+                                                  : wr.blocked_duplicates;
+      index.insert(*keys[i], files[i].inode_number);
+    }
+}
+
+static void check_settings(sqsh_reader const & image, sqsh_writer const & wr)
+{
+  if (image.super.compression != wr.comp->type ||
+      image.super.block_log != wr.super.block_log)
+    throw std::runtime_error("image and writer settings differ"s);
+}
+
+/* Adds the tree of an image to root, and returns the regular files that
+   dedup could be seeded with. */
+static std::vector<seeded_file> import_tree(sqsh_reader & image,
+                                            dirtree_dir & root,
+                                            relocation const & moved)
+{
+  auto & wr = *root.wr;
+  std::unordered_map<uint32_t, std::shared_ptr<dirtree>> linked;
+  std::vector<seeded_file> files;
+  image.walk([&](std::string const & path, sqsh_inode const & node) {
+    if (node.type == SQFS_INODE_TYPE_DIR)
+      {
+        root.subdir_for_path(path).update_metadata(node);
+        return;
+      }
+
+    auto const link = node.nlink > 1 ? linked.find(node.inode_number)
+                                     : linked.end();
+    if (link != linked.end())
+      {
+        ++root.put_file(path, std::shared_ptr<dirtree>(link->second)).nlink;
+        return;
+      }
+
+    auto file = import_file(&wr, node, moved);
+    if (node.type == SQFS_INODE_TYPE_REG && wr.dedup_enabled)
+      files.push_back({file->inode_number, node});
+    if (node.nlink > 1)
+      linked.emplace(node.inode_number, file);
+    root.put_file(path, std::move(file));
+  });
+  return files;
+}
+
+void import_image(sqsh_reader & image, dirtree_dir & root)
+{
+  auto & wr = *root.wr;
+  check_settings(image, wr);
+
+  wr.fragments = image.fragments;
+  wr.fragment_count = image.fragments.size();
+  /* New data goes after the old tables rather than over them, so that the
+     old superblock stays valid until the new one is written. The old
+     tables are left in the image as unused bytes. */
+  wr.outfile.seekp(image.super.bytes_used);
+
+  auto const files = import_tree(image, root, {0, 0});
+  if (wr.dedup_enabled)
+    seed_dedup(image, wr, files);
+}
+
+void merge_image(sqsh_reader & image, dirtree_dir & root)
+{
+  static uint64_t constexpr chunk_bytes = 4 << 20;
+
+  auto & wr = *root.wr;
+  check_settings(image, wr);
+
+  /* The data region is copied while the writer thread is idle. */
+  wr.flush_fragment();
+  wr.sync();
+  relocation moved{0, wr.fragment_count};
+  for (uint64_t pos = SQFS_SUPER_SIZE; pos < image.data_end();)
+    {
+      auto const len = std::min(chunk_bytes, image.data_end() - pos);
+      auto const at = wr.write_bytes(image.read_bytes(pos, len));
+      if (pos == SQFS_SUPER_SIZE)
+        moved.offset = uint64_t(at) - SQFS_SUPER_SIZE;
+      pos += len;
+    }
+
+  for (auto const & entry : image.fragments)
+    wr.push_fragment_entry({entry.start_block + moved.offset, entry.size});
+  wr.fragment_count += image.fragments.size();
+
+  import_tree(image, root, moved);
+}
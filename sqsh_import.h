@@ -0,0 +1,40 @@
+/*
+Copyright (C) 2018  Charles Cagle
+
+This file is part of archive2sqfs.
+
+archive2sqfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3.
+
+archive2sqfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with archive2sqfs.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef LSL_SQSH_IMPORT_H
+#define LSL_SQSH_IMPORT_H
+
+#include "dirtree.h"
+#include "sqsh_reader.h"
+
+/* Loads the tree of an existing image into root, whose writer was opened
+   on that same image to append to it. Files keep their data blocks and
+   fragments where they are, and new data is written after the end of the
+   old image, leaving its tables in place until the header is written
+   again. With dedup enabled, the old files are hashed to seed the
+   dedup index, so new copies of them are not stored again. */
+void import_image(sqsh_reader &, dirtree_dir & root);
+
+/* Adds an image built separately to the one being written. Its data
+   blocks and fragments are copied over as they are, after the data
+   written so far, and its tree is merged into root with their offsets
+   moved to match. Entries of the image replace those already at the same
+   path. */
+void merge_image(sqsh_reader &, dirtree_dir & root);
+
+#endif
@@ -0,0 +1,224 @@
+/*
+Copyright (C) 2018  Charles Cagle
+
+This file is part of archive2sqfs.
+
+archive2sqfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3.
+
+archive2sqfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with archive2sqfs.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+using namespace std::literals;
+
+#include <archive_entry.h>
+
+#include "dirtree.h"
+#include "sqsh_defs.h"
+#include "sqsh_ingest.h"
+#include "sqsh_reader.h"
+
+unsigned sqsh_entry::filetype() const
+{
+  switch (node.type)
+    {
+      case SQFS_INODE_TYPE_DIR:
+        return AE_IFDIR;
+      case SQFS_INODE_TYPE_REG:
+        return AE_IFREG;
+      case SQFS_INODE_TYPE_SYM:
+        return AE_IFLNK;
+      case SQFS_INODE_TYPE_BLK:
+        return AE_IFBLK;
+      case SQFS_INODE_TYPE_CHR:
+        return AE_IFCHR;
+      case SQFS_INODE_TYPE_PIPE:
+        return AE_IFIFO;
+      default:
+        return AE_IFSOCK;
+    }
+}
+
+bool sqsh_source::recognizes(char const * const path)
+{
+  if (path == nullptr)
+    return false;
+  std::ifstream file(path, std::ios_base::binary);
+  char magic[4];
+  return file.read(magic, sizeof magic) &&
+         std::string(magic, sizeof magic) == "hsqs"s;
+}
+
+fragment_entry const & sqsh_source::fragment(uint32_t const i) const
+{
+  if (i >= image->fragments.size())
+    throw std::runtime_error("fragment out of range in image"s);
+  return image->fragments[i];
+}
+
+/* Hands out the blocks of a file as stored, followed by its fragment
+   block if this file is the one to read it. The hash covers the stored
+   bytes of the blocks, which is enough for the writer to find files
+   whose blocks were stored the same way. */
+void sqsh_source::copy_file(std::size_t const i,
+                            std::vector<ingest_block> & blocks) const
+{
+  auto const & node = nodes[i];
+  auto pos = node.start_block;
+  for (auto const size : node.blocks)
+    {
+      ingest_block b;
+      b.data = image->read_block(pos, size, true);
+      pos += b.data.size();
+      if (hash)
+        b.compute_hash();
+      blocks.push_back(std::move(b));
+    }
+
+  if (node.fragment != SQFS_FRAGMENT_NONE)
+    {
+      ingest_block b;
+      if (reads_fragment[i])
+        {
+          auto const & entry = fragment(node.fragment);
+          b.data = image->read_block(entry.start_block, entry.size, true);
+        }
+      blocks.push_back(std::move(b));
+    }
+}
+
+/* Decompresses a file and cuts it into blocks of the size being
+   written. Sparse blocks are read as zeros. */
+void sqsh_source::read_file(std::size_t const i,
+                            std::vector<ingest_block> & blocks) const
+{
+  auto const & node = nodes[i];
+  ingest_block b;
+  auto const put = [&](char const * data, std::size_t len) {
+    while (len != 0)
+      {
+        auto const added = std::min(len, block_size - b.data.size());
+        b.data.insert(b.data.end(), data, data + added);
+        data += added;
+        len -= added;
+        if (b.data.size() == block_size)
+          {
+            if (hash)
+              b.compute_hash();
+            blocks.push_back(std::move(b));
+            b = {};
+          }
+      }
+  };
+
+  auto pos = node.start_block;
+  auto remaining = node.file_size;
+  for (auto const size : node.blocks)
+    {
+      auto const len = std::min<uint64_t>(remaining, image->block_size());
+      if (size == 0)
+        put(std::vector<char>(len).data(), len);
+      else
+        {
+          auto const data = image->read_block(pos, size);
+          if (data.size() != len)
+            throw std::runtime_error("data block of wrong size in image"s);
+          put(data.data(), len);
+          pos += size & ~SQFS_BLOCK_COMPRESSED_BIT;
+        }
+      remaining -= len;
+    }
+
+  if (remaining != 0)
+    {
+      auto const & entry = fragment(node.fragment);
+      auto const data = image->read_block(entry.start_block, entry.size);
+      if (node.fragment_offset > data.size() ||
+          remaining > data.size() - node.fragment_offset)
+        throw std::runtime_error("fragment out of range in image"s);
+      put(data.data() + node.fragment_offset, remaining);
+    }
+
+  if (!b.data.empty())
+    {
+      if (hash)
+        b.compute_hash();
+      blocks.push_back(std::move(b));
+    }
+}
+
+std::vector<ingest_block> sqsh_source::prepare(std::size_t const first,
+                                               std::size_t const last) const
+{
+  std::vector<ingest_block> blocks;
+  std::size_t i =
+      std::lower_bound(first_block.begin(), first_block.end(), first) -
+      first_block.begin();
+  for (; i < nodes.size() && first_block[i] < last; ++i)
+    if (first_block[i + 1] != first_block[i])
+      {
+        if (raw)
+          copy_file(i, blocks);
+        else
+          read_file(i, blocks);
+      }
+  return blocks;
+}
+
+void sqsh_ingest::append_to(dirtree_reg & reg)
+{
+  auto const & source = scanned();
+  if (!source.raw)
+    {
+      for (auto block = next_block(); block; block = next_block())
+        reg.append(std::move(block->data), block->hash);
+      return;
+    }
+
+  auto const & node = source.node(index());
+  auto const block_size = reg.wr->block_size();
+  auto remaining = node.file_size;
+  std::size_t b = 0;
+  for (auto block = next_block(); block; block = next_block(), ++b)
+    {
+      if (b < node.blocks.size())
+        {
+          auto const len = std::min<uint64_t>(remaining, block_size);
+          reg.append_raw(std::move(block->data), node.blocks[b], len,
+                         block->hash);
+          remaining -= len;
+          continue;
+        }
+
+      /* The fragment block is copied after the blocks are through
+         dedup, which could otherwise drop it with them. */
+      reg.end_blocks();
+      auto copied = copied_fragments.find(node.fragment);
+      if (copied == copied_fragments.end())
+        {
+          if (block->data.empty())
+            throw std::runtime_error("fragment block was not read"s);
+          auto const number = reg.wr->enqueue_raw_fragment(
+              std::move(block->data), source.fragment(node.fragment).size);
+          copied = copied_fragments.emplace(node.fragment, number).first;
+        }
+      reg.append_raw_fragment({copied->second, node.fragment_offset},
+                              remaining);
+    }
+}
@@ -0,0 +1,194 @@
+/*
+Copyright (C) 2018  Charles Cagle
+
+This file is part of archive2sqfs.
+
+archive2sqfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3.
+
+archive2sqfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with archive2sqfs.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef LSL_SQSH_INGEST_H
+#define LSL_SQSH_INGEST_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include <archive_entry.h>
+
+#include "block_ingest.h"
+#include "dirtree.h"
+#include "entry_header.h"
+#include "sqsh_defs.h"
+#include "sqsh_reader.h"
+
+/* One inode of an existing image under one of its paths, with the same
+   accessors as archive_reader. The root is the entry with the empty
+   path. */
+struct sqsh_entry
+{
+  std::string path;
+  std::string hardlink;
+  bool has_hardlink = false;
+  sqsh_inode node;
+
+  char const * pathname() const { return path.data(); }
+  unsigned filetype() const;
+  uint16_t mode() const { return node.perm; }
+  int64_t uid() const { return node.user; }
+  int64_t gid() const { return node.group; }
+  int64_t mtime() const { return node.time; }
+  uint64_t rdev() const { return node.rdev; }
+  char const * symlink_target() const { return node.target.data(); }
+
+  int64_t filesize() const
+  {
+    return node.type == SQFS_INODE_TYPE_REG ? node.file_size : 0;
+  }
+
+  char const * hardlink_target() const
+  {
+    return has_hardlink ? hardlink.data() : nullptr;
+  }
+};
+
+/* Lists an existing image in sorted depth-first order, with the files
+   that share an inode as hard links to the first of them, and reads its
+   file data in ranges of whole files on block_ingest's tasks. The entries
+   are handed out in the order that order returns for them.
+
+   If the image has the compressor and block size being written, its
+   blocks are handed out raw, as stored, and each fragment block is read
+   once along with the first selected file that ends in it. Otherwise
+   they are decompressed and cut into blocks of the new size. */
+class sqsh_source
+{
+  std::unique_ptr<sqsh_reader> const image;
+  std::size_t const block_size;
+  bool const hash;
+  std::vector<sqsh_inode> nodes;
+  std::vector<bool> reads_fragment;
+
+  void read_file(std::size_t, std::vector<ingest_block> &) const;
+  void copy_file(std::size_t, std::vector<ingest_block> &) const;
+
+public:
+  bool const raw;
+  std::vector<entry_header> entries;
+  std::vector<std::size_t> first_block;
+  std::vector<std::size_t> range_ends;
+
+  template <typename P, typename O>
+  sqsh_source(std::string const & path, P selected, uint16_t compression,
+              std::size_t block_size, bool hash, O order);
+
+  /* Returns whether path names a squashfs image. */
+  static bool recognizes(char const * path);
+
+  sqsh_inode const & node(std::size_t i) const { return nodes[i]; }
+  fragment_entry const & fragment(uint32_t) const;
+
+  std::vector<ingest_block> prepare(std::size_t, std::size_t) const;
+};
+
+/* Reads an existing image as an input. Raw blocks are written as they
+   are, and the fragments they end in are renumbered as they are copied;
+   decompressed blocks go through the writer like those of any input. */
+class sqsh_ingest : public block_ingest<sqsh_source>
+{
+  std::unordered_map<uint32_t, uint32_t> copied_fragments;
+
+public:
+  using block_ingest<sqsh_source>::block_ingest;
+
+  void append_to(dirtree_reg &);
+};
+
+template <typename P, typename O>
+sqsh_source::sqsh_source(std::string const & path, P selected,
+                         uint16_t const compression,
+                         std::size_t const block_size, bool const hash,
+                         O order)
+    : image(std::make_unique<sqsh_reader>(path)), block_size(block_size),
+      hash(hash), raw(image->super.compression == compression &&
+                      image->block_size() == block_size)
+{
+  static uint64_t constexpr range_bytes = 4 << 20;
+  static std::size_t constexpr range_blocks = 1024;
+
+  std::vector<entry_header> scanned;
+  std::vector<sqsh_inode> scanned_nodes;
+  std::unordered_map<uint32_t, std::string> first_paths;
+  image->walk([&](std::string const & path, sqsh_inode const & node) {
+    sqsh_entry e;
+    e.path = path;
+    e.node = node;
+    if (!selected(e))
+      return;
+
+    if (node.type != SQFS_INODE_TYPE_DIR && node.nlink > 1)
+      {
+        auto const placed = first_paths.emplace(node.inode_number, path);
+        if (!placed.second)
+          {
+            e.has_hardlink = true;
+            e.hardlink = placed.first->second;
+          }
+      }
+
+    scanned.emplace_back(e);
+    scanned_nodes.push_back(std::move(e.node));
+  });
+
+  /* A fragment block is read along with the first file handed out that
+     ends in it. */
+  std::unordered_set<uint32_t> fragments_read;
+  std::size_t blocks = 0;
+  uint64_t bytes = 0;
+  for (auto const i : order(scanned))
+    {
+      entries.push_back(std::move(scanned[i]));
+      nodes.push_back(std::move(scanned_nodes[i]));
+      first_block.push_back(blocks);
+      auto const & node = nodes.back();
+      bool const data = !entries.back().hardlink_target() &&
+                        node.type == SQFS_INODE_TYPE_REG;
+      bool const tail = data && node.fragment != SQFS_FRAGMENT_NONE;
+      reads_fragment.push_back(tail &&
+                               fragments_read.insert(node.fragment).second);
+      if (!data)
+        continue;
+
+      if (raw)
+        blocks += node.blocks.size() + tail;
+      else
+        blocks += (node.file_size + block_size - 1) / block_size;
+      bytes += node.file_size;
+
+      auto const first = range_ends.empty() ? 0 : range_ends.back();
+      if (bytes >= range_bytes || blocks - first >= range_blocks)
+        {
+          range_ends.push_back(blocks);
+          bytes = 0;
+        }
+    }
+  first_block.push_back(blocks);
+  if (range_ends.empty() || range_ends.back() != blocks)
+    range_ends.push_back(blocks);
+}
+
+#endif
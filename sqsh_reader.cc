@@ -0,0 +1,370 @@
+/*
+Copyright (C) 2018  Charles Cagle
+
+This file is part of archive2sqfs.
+
+archive2sqfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3.
+
+archive2sqfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with archive2sqfs.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+using namespace std::literals;
+
+#include "compressor.h"
+#include "fragment_entry.h"
+#include "sqsh_defs.h"
+#include "sqsh_reader.h"
+
+static uint64_t le(char const * const p, std::size_t const len)
+{
+  uint64_t value = 0;
+  for (std::size_t i = len; i-- > 0;)
+    value = value << 8 | static_cast<unsigned char>(p[i]);
+  return value;
+}
+
+static std::runtime_error invalid_image(char const * const what)
+{
+  return std::runtime_error("invalid squashfs image: "s + what);
+}
+
+/* Reads little-endian fields from a loaded table in order. */
+struct table_cursor
+{
+  std::vector<char> const & data;
+  std::size_t position;
+
+  uint64_t take(std::size_t const len)
+  {
+    if (data.size() - position < len || position > data.size())
+      throw invalid_image("table entry runs past its table");
+    auto const value = le(data.data() + position, len);
+    position += len;
+    return value;
+  }
+
+  uint16_t u16() { return take(2); }
+  uint32_t u32() { return take(4); }
+  uint64_t u64() { return take(8); }
+
+  std::string string(std::size_t const len)
+  {
+    if (data.size() - position < len)
+      throw invalid_image("name runs past its table");
+    std::string s(data.data() + position, len);
+    position += len;
+    return s;
+  }
+};
+
+static sqsh_super read_super(std::ifstream & file)
+{
+  char buff[SQFS_SUPER_SIZE];
+  if (!file.read(buff, sizeof buff) || le(buff, 4) != SQFS_MAGIC)
+    throw invalid_image("bad superblock");
+  if (le(buff + 28, 2) != SQFS_MAJOR)
+    throw invalid_image("unsupported version");
+
+  sqsh_super s;
+  s.inode_count = le(buff + 4, 4);
+  s.block_size = le(buff + 12, 4);
+  s.fragment_count = le(buff + 16, 4);
+  s.compression = le(buff + 20, 2);
+  s.block_log = le(buff + 22, 2);
+  s.flags = le(buff + 24, 2);
+  s.id_count = le(buff + 26, 2);
+  auto const root = le(buff + 32, 8);
+  s.root_inode = meta_address(root >> 16, root & 0xffff);
+  s.bytes_used = le(buff + 40, 8);
+  s.id_table_start = le(buff + 48, 8);
+  s.xattr_table_start = le(buff + 56, 8);
+  s.inode_table_start = le(buff + 64, 8);
+  s.directory_table_start = le(buff + 72, 8);
+  s.fragment_table_start = le(buff + 80, 8);
+  s.lookup_table_start = le(buff + 88, 8);
+
+  if (s.block_size != uint32_t(1) << s.block_log)
+    throw invalid_image("inconsistent block size");
+  return s;
+}
+
+std::vector<char> sqsh_reader::read_bytes(uint64_t const pos,
+                                          std::size_t const len)
+{
+  std::lock_guard<decltype(file_mutex)> lock(file_mutex);
+  std::vector<char> v(len);
+  file.clear();
+  file.seekg(pos);
+  if (!file.read(v.data(), v.size()))
+    throw invalid_image("read past the end of the image");
+  return v;
+}
+
+std::vector<char> sqsh_reader::read_block(uint64_t const pos,
+                                          uint32_t const size,
+                                          bool const raw)
+{
+  auto bytes = read_bytes(pos, size & ~SQFS_BLOCK_COMPRESSED_BIT);
+  return raw || (size & SQFS_BLOCK_COMPRESSED_BIT)
+             ? bytes
+             : comp->decompress(std::move(bytes), block_size());
+}
+
+/* Reads the metadata block at pos, which is advanced past it. */
+std::vector<char> sqsh_reader::read_metadata_block(uint64_t & pos,
+                                                   uint64_t const end)
+{
+  if (end - pos < 2 || pos > end)
+    throw invalid_image("metadata block past its table");
+  auto const header = read_bytes(pos, 2);
+  uint16_t const h = le(header.data(), 2);
+  std::size_t const len = h & ~SQFS_META_BLOCK_COMPRESSED_BIT;
+  if (end - pos - 2 < len)
+    throw invalid_image("metadata block past its table");
+
+  auto block = read_bytes(pos + 2, len);
+  pos += 2 + len;
+  return h & SQFS_META_BLOCK_COMPRESSED_BIT
+             ? block
+             : comp->decompress(std::move(block), SQFS_META_BLOCK_SIZE);
+}
+
+sqsh_reader::metadata_table sqsh_reader::read_table(uint64_t const start,
+                                                    uint64_t const end)
+{
+  metadata_table table;
+  for (uint64_t pos = start; pos < end;)
+    {
+      table.blocks.emplace(pos - start, table.data.size());
+      auto const block = read_metadata_block(pos, end);
+      table.data.insert(table.data.end(), block.begin(), block.end());
+    }
+  return table;
+}
+
+std::size_t
+sqsh_reader::metadata_table::position(meta_address const addr) const
+{
+  auto const block = blocks.find(addr.block);
+  if (block == blocks.end())
+    throw invalid_image("reference to a missing metadata block");
+  return block->second + addr.offset;
+}
+
+/* Reads count entries of entry_size bytes from the table whose index of
+   metadata block locations starts at start. */
+template <typename F>
+void sqsh_reader::read_indexed_table(uint64_t const start,
+                                     std::size_t const count,
+                                     std::size_t const entry_size, F f)
+{
+  auto const per_block = SQFS_META_BLOCK_SIZE / entry_size;
+  auto const index_len = (count + per_block - 1) / per_block;
+  auto const index = read_bytes(start, index_len * 8);
+  std::size_t i = 0;
+  for (std::size_t b = 0; b < index_len; ++b)
+    {
+      uint64_t pos = le(index.data() + b * 8, 8);
+      auto const block = read_metadata_block(pos, start);
+      for (std::size_t off = 0; i < count && off < block.size();
+           off += entry_size)
+        {
+          if (block.size() - off < entry_size)
+            throw invalid_image("truncated table entry");
+          f(block.data() + off);
+          ++i;
+        }
+    }
+  if (i != count)
+    throw invalid_image("table shorter than its count");
+}
+
+sqsh_reader::sqsh_reader(std::string const & path)
+    : file(path, std::ios_base::binary), super(read_super(file)),
+      comp(get_compressor_for(compressor_name(super.compression)))
+{
+  read_indexed_table(super.fragment_table_start, super.fragment_count, 16,
+                     [&](char const * const p) {
+                       uint32_t const size = le(p + 8, 4);
+                       fragments.push_back({le(p, 8), size});
+                     });
+  read_indexed_table(super.id_table_start, super.id_count, 4,
+                     [&](char const * const p) { ids.push_back(le(p, 4)); });
+
+  /* The directory table ends where the next table's first metadata block
+     begins. */
+  auto directory_end = super.id_table_start;
+  auto const first_block = [&](uint64_t const table) {
+    return le(read_bytes(table, 8).data(), 8);
+  };
+  directory_end = std::min(directory_end, first_block(super.id_table_start));
+  if (super.fragment_count != 0)
+    directory_end =
+        std::min(directory_end, first_block(super.fragment_table_start));
+  else
+    directory_end = std::min(directory_end, super.fragment_table_start);
+  if (super.lookup_table_start != SQFS_TABLE_NOT_PRESENT)
+    directory_end =
+        std::min(directory_end, first_block(super.lookup_table_start));
+  if (super.xattr_table_start != SQFS_TABLE_NOT_PRESENT)
+    directory_end = std::min(directory_end, super.xattr_table_start);
+
+  if (super.inode_table_start > super.directory_table_start ||
+      super.directory_table_start > directory_end)
+    throw invalid_image("tables out of order");
+  inodes = read_table(super.inode_table_start, super.directory_table_start);
+  directories = read_table(super.directory_table_start, directory_end);
+}
+
+sqsh_inode sqsh_reader::inode(meta_address const addr) const
+{
+  table_cursor in{inodes.data, inodes.position(addr)};
+  sqsh_inode node;
+  node.type = in.u16();
+  node.perm = in.u16();
+  auto const uid = in.u16();
+  auto const gid = in.u16();
+  if (uid >= ids.size() || gid >= ids.size())
+    throw invalid_image("id index out of range");
+  node.user = ids[uid];
+  node.group = ids[gid];
+  node.time = in.u32();
+  node.inode_number = in.u32();
+
+  bool const extended = node.type >= SQFS_INODE_TYPE_DIR;
+  if (!extended)
+    node.type += 7;
+
+  auto const read_blocks = [&]() {
+    auto count = node.file_size / block_size();
+    if (node.fragment == SQFS_FRAGMENT_NONE && node.file_size % block_size())
+      ++count;
+    for (uint64_t i = 0; i < count; ++i)
+      node.blocks.push_back(in.u32());
+  };
+
+  switch (node.type)
+    {
+      case SQFS_INODE_TYPE_DIR:
+        if (extended)
+          {
+            node.nlink = in.u32();
+            node.listing_size = in.u32();
+            node.listing.block = in.u32();
+            in.u32();
+            auto const index_count = in.u16();
+            node.listing.offset = in.u16();
+            node.xattr = in.u32();
+            for (uint32_t i = 0; i < index_count; ++i)
+              {
+                auto const index = in.u32();
+                auto const start_block = in.u32();
+                auto const len = in.u32() + 1;
+                node.index.push_back({index, start_block, in.string(len)});
+              }
+          }
+        else
+          {
+            node.listing.block = in.u32();
+            node.nlink = in.u32();
+            node.listing_size = in.u16();
+            node.listing.offset = in.u16();
+          }
+        break;
+
+      case SQFS_INODE_TYPE_REG:
+        if (extended)
+          {
+            node.start_block = in.u64();
+            node.file_size = in.u64();
+            node.sparse = in.u64();
+            node.nlink = in.u32();
+            node.fragment = in.u32();
+            node.fragment_offset = in.u32();
+            node.xattr = in.u32();
+          }
+        else
+          {
+            node.start_block = in.u32();
+            node.fragment = in.u32();
+            node.fragment_offset = in.u32();
+            node.file_size = in.u32();
+          }
+        read_blocks();
+        break;
+
+      case SQFS_INODE_TYPE_SYM:
+        {
+          node.nlink = in.u32();
+          auto const len = in.u32();
+          node.target = in.string(len);
+          if (extended)
+            node.xattr = in.u32();
+        }
+        break;
+
+      case SQFS_INODE_TYPE_BLK:
+      case SQFS_INODE_TYPE_CHR:
+        node.nlink = in.u32();
+        node.rdev = in.u32();
+        if (extended)
+          node.xattr = in.u32();
+        break;
+
+      case SQFS_INODE_TYPE_PIPE:
+      case SQFS_INODE_TYPE_SOCK:
+        node.nlink = in.u32();
+        if (extended)
+          node.xattr = in.u32();
+        break;
+
+      default:
+        throw invalid_image("unknown inode type");
+    }
+  return node;
+}
+
+std::vector<sqsh_dirent>
+sqsh_reader::directory(sqsh_inode const & dir) const
+{
+  std::vector<sqsh_dirent> listing;
+  if (dir.listing_size <= 3)
+    return listing;
+
+  table_cursor in{directories.data, directories.position(dir.listing)};
+  auto const end = in.position + dir.listing_size - 3;
+  while (in.position < end)
+    {
+      auto const count = in.u32() + 1;
+      auto const start_block = in.u32();
+      in.u32();
+      for (uint32_t i = 0; i < count; ++i)
+        {
+          auto const offset = in.u16();
+          in.u16();
+          in.u16();
+          auto const len = in.u16() + 1;
+          listing.push_back({in.string(len), meta_address(start_block,
+                                                          offset)});
+        }
+    }
+  return listing;
+}
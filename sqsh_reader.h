@@ -0,0 +1,168 @@
+/*
+Copyright (C) 2018  Charles Cagle
+
+This file is part of archive2sqfs.
+
+archive2sqfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3.
+
+archive2sqfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with archive2sqfs.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef LSL_SQSH_READER_H
+#define LSL_SQSH_READER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "compressor.h"
+#include "fragment_entry.h"
+#include "sqsh_defs.h"
+
+struct sqsh_super
+{
+  uint32_t inode_count;
+  uint32_t block_size;
+  uint32_t fragment_count;
+  uint16_t compression;
+  uint16_t block_log;
+  uint16_t flags;
+  uint16_t id_count;
+  meta_address root_inode;
+  uint64_t bytes_used;
+  uint64_t id_table_start;
+  uint64_t xattr_table_start;
+  uint64_t inode_table_start;
+  uint64_t directory_table_start;
+  uint64_t fragment_table_start;
+  uint64_t lookup_table_start;
+};
+
+/* An entry of a directory's index: the position in its listing and the
+   directory table block of a header, and the first name after it. */
+struct sqsh_dir_index
+{
+  uint32_t index;
+  uint32_t start_block;
+  std::string name;
+};
+
+/* One inode of an existing image. Basic inode types are reported as
+   their extended types, so type is always one of SQFS_INODE_TYPE_*. */
+struct sqsh_inode
+{
+  uint16_t type;
+  uint16_t perm;
+  uint32_t user;
+  uint32_t group;
+  uint32_t time;
+  uint32_t inode_number;
+  uint32_t nlink = 1;
+  uint32_t xattr = SQFS_XATTR_NONE;
+
+  uint64_t start_block = 0;
+  uint64_t file_size = 0;
+  uint64_t sparse = 0;
+  uint32_t fragment = SQFS_FRAGMENT_NONE;
+  uint32_t fragment_offset = 0;
+  std::vector<uint32_t> blocks;
+
+  meta_address listing;
+  uint32_t listing_size = 0;
+  std::vector<sqsh_dir_index> index;
+
+  std::string target;
+  uint32_t rdev = 0;
+
+  uint16_t mode() const { return perm; }
+  uint32_t uid() const { return user; }
+  uint32_t gid() const { return group; }
+  uint32_t mtime() const { return time; }
+};
+
+struct sqsh_dirent
+{
+  std::string name;
+  meta_address inode;
+};
+
+/* Reads an existing image. The inode and directory tables are loaded
+   into memory when it is opened, along with the fragment and id tables;
+   file data is read on request, and may be read from several threads. */
+class sqsh_reader
+{
+  struct metadata_table
+  {
+    std::vector<char> data;
+    std::unordered_map<uint64_t, std::size_t> blocks;
+
+    std::size_t position(meta_address) const;
+  };
+
+  std::ifstream file;
+  std::mutex file_mutex;
+  metadata_table inodes;
+  metadata_table directories;
+
+  std::vector<char> read_metadata_block(uint64_t &, uint64_t);
+  metadata_table read_table(uint64_t, uint64_t);
+  template <typename F> void read_indexed_table(uint64_t, std::size_t,
+                                                std::size_t, F);
+
+public:
+  sqsh_super super;
+  std::unique_ptr<compressor> const comp;
+  std::vector<fragment_entry> fragments;
+  std::vector<uint32_t> ids;
+
+  explicit sqsh_reader(std::string const & path);
+
+  std::size_t block_size() const { return super.block_size; }
+
+  /* The end of the data blocks and fragments, where the tables begin. */
+  uint64_t data_end() const { return super.inode_table_start; }
+
+  sqsh_inode inode(meta_address) const;
+  std::vector<sqsh_dirent> directory(sqsh_inode const &) const;
+
+  std::vector<char> read_bytes(uint64_t, std::size_t);
+
+  /* Reads a data block or fragment of the given on-disk size field,
+     decompressed unless raw is set. */
+  std::vector<char> read_block(uint64_t, uint32_t, bool raw = false);
+
+  /* Calls f(path, inode) for every inode below the root, parents before
+     their children and siblings sorted by name, starting with the root
+     itself at the empty path. */
+  template <typename F> void walk(F f) const
+  {
+    walk(f, std::string(), inode(super.root_inode));
+  }
+
+private:
+  template <typename F>
+  void walk(F & f, std::string const & path, sqsh_inode const & node) const
+  {
+    f(path, node);
+    if (node.type != SQFS_INODE_TYPE_DIR)
+      return;
+    for (auto const & entry : directory(node))
+      walk(f, path.empty() ? entry.name : path + '/' + entry.name,
+           inode(entry.inode));
+  }
+};
+
+#endif
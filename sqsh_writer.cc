@@ -18,6 +18,7 @@ along with archive2sqfs.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <algorithm>
 #include <cstdint>
+#include <future>
 #include <memory>
 #include <ostream>
 #include <utility>
@@ -28,8 +29,44 @@ along with archive2sqfs.  If not, see <http://www.gnu.org/licenses/>.
 #include "filesystem.h"
 #include "metadata_writer.h"
 #include "pending_write.h"
+#include "posix_io.h"
 #include "sqsh_writer.h"
 
+/* Reserves room for a known number of files and bytes of file data. Where
+   the system can allocate space past the end of a file without changing
+   its size, room for the data is allocated after where writing starts,
+   so that data blocks land in as few extents as possible; write_header
+   releases what is left over. Elsewhere, and where the file system cannot
+   allocate, nothing is allocated, rather than writing zeros in place of
+   the data as posix_fallocate would. This is only a hint, so failures are
+   ignored. */
+void sqsh_writer::reserve(std::size_t const files, uint64_t const data_size)
+{
+  fragment_indices.reserve(files);
+  reports.reserve(files);
+  if (dedup_enabled)
+    {
+      fragmented_duplicates.reserve(files);
+      blocked_duplicates.reserve(files);
+    }
+
+#if LSL_HAVE_FALLOCATE
+  off_t start;
+  {
+    std::lock_guard<decltype(outfile_mutex)> lock(outfile_mutex);
+    start = outfile.tellp();
+  }
+  int const fd = open(outfilepath.data(), O_WRONLY);
+  if (fd >= 0)
+    {
+      fallocate(fd, FALLOC_FL_KEEP_SIZE, start, data_size);
+      close(fd);
+    }
+#else
+  (void)data_size;
+#endif
+}
+
 void sqsh_writer::flush_fragment()
 {
   if (!current_fragment.empty())
@@ -57,25 +94,23 @@ get_block(T & reader, std::fstream::pos_type const pos,
 optional<fragment_index>
 sqsh_writer::dedup_fragment_index(uint32_t inode_number)
 {
-  auto & cksum = fragmented_checksums[inode_number];
-  cksum.update(current_block);
-  auto & duplicates = fragmented_duplicates[cksum.sum];
-  for (auto dup = duplicates.crbegin(); dup != duplicates.crend(); ++dup)
-    {
-      auto const & index = fragment_indices[*dup];
-      auto const & entry_opt = get_fragment_entry(index.fragment);
-      if (entry_opt)
-        {
-          auto frag = get_block(*this, entry_opt->start_block,
-                                entry_opt->size, block_size());
-          if (compare_range(current_block, frag, index.offset))
-            return fragment_index{index};
-        }
-      else if (compare_range(current_block, current_fragment, index.offset))
-        return fragment_index{index};
-    }
-
-  duplicates.push_back(inode_number);
+  auto const key =
+      dedup_index::key_for(current_block.size(), file_hash.value());
+  auto const dup = fragmented_duplicates.find(key, [&](uint32_t const i) {
+    auto const & index = fragment_indices[i];
+    auto const & entry_opt = get_fragment_entry(index.fragment);
+    if (!entry_opt)
+      return compare_range(current_block, current_fragment, index.offset);
+
+    auto frag = get_block(*this, entry_opt->start_block, entry_opt->size,
+                          block_size());
+    return compare_range(current_block, frag, index.offset);
+  });
+
+  if (dup)
+    return fragment_index{fragment_indices[*dup]};
+
+  fragmented_duplicates.insert(key, inode_number);
   return {};
 }
 
@@ -151,8 +186,13 @@ void sqsh_writer::write_header()
   header.l64(super.fragment_table_start);
   header.l64(super.lookup_table_start);
 
-  auto end = outfile.tellp();
-  end += SQFS_PAD_SIZE - (end % SQFS_PAD_SIZE);
+  /* The padding is written rather than left for resize_file to add, so
+     that resizing does not grow the file, which would keep any blocks
+     that reserve allocated past its end. */
+  std::vector<char> const padding(SQFS_PAD_SIZE -
+                                  outfile.tellp() % SQFS_PAD_SIZE);
+  outfile.write(padding.data(), padding.size());
+  auto const end = outfile.tellp();
 
   outfile.seekp(0);
   outfile.write(header.data(), header.size());
@@ -187,8 +227,9 @@ static void sqsh_writer_write_indexed_table(sqsh_writer & wr,
                                             std::size_t const count,
                                             uint64_t & table_start, G entry)
 {
-  endian_buffer<0> indices;
-  metadata_writer mdw(*wr.comp);
+  std::vector<uint32_t> blocks;
+  metadata_writer mdw(*wr.comp, wr.outfilepath + ".table~",
+                      wr.launch_policy(), thread_count());
 
   for (std::size_t i = 0; i < count; ++i)
     {
@@ -197,12 +238,15 @@ static void sqsh_writer_write_indexed_table(sqsh_writer & wr,
       meta_address const maddr = mdw.put(buff);
 
       if ((i & ITD_MASK(ENTRY_LB)) == 0)
-        indices.l64(table_start + maddr.block);
+        blocks.push_back(maddr.block);
     }
 
   if (count & ITD_MASK(ENTRY_LB))
     mdw.write_block_no_pad();
 
+  endian_buffer<0> indices;
+  for (auto const block : blocks)
+    indices.l64(table_start + mdw.start(block));
   mdw.out(wr.outfile);
   table_start = wr.outfile.tellp();
 
@@ -292,12 +336,26 @@ void sqsh_writer::drop_bytes(decltype(outfile)::off_type count)
   outfile.seekp(-count, std::ios_base::cur);
 }
 
+/* Compresses a data block or fragment, through the cache if there is
+   one. */
+std::future<compression_result>
+sqsh_writer::compress_async(block_type && block)
+{
+  if (!cache)
+    return comp->compress_async(std::move(block), launch_policy());
+  return std::async(launch_policy(),
+                    [this](block_type in) {
+                      return cache->compress(*comp, std::move(in),
+                                             super.block_log);
+                    },
+                    std::move(block));
+}
+
 void sqsh_writer::enqueue_fragment()
 {
   if (!writer_failed)
     enqueue(std::unique_ptr<pending_write>(new pending_fragment(
-        *this,
-        comp->compress_async(std::move(current_fragment), launch_policy()))));
+        *this, compress_async(std::move(current_fragment)))));
   ++fragment_count;
   current_fragment.clear();
 }
@@ -306,17 +364,46 @@ void sqsh_writer::enqueue_block(uint32_t inode_number)
 {
   if (!writer_failed)
     enqueue(std::unique_ptr<pending_write>(new pending_block(
-        *this,
-        comp->compress_async(std::move(current_block), launch_policy()),
-        inode_number)));
+        *this, compress_async(std::move(current_block)), inode_number)));
   current_block.clear();
 }
 
-void sqsh_writer::enqueue_dedup(uint32_t inode_number)
+static std::future<compression_result> stored(block_type && block,
+                                              uint32_t const size)
+{
+  std::promise<compression_result> p;
+  p.set_value({std::move(block), !(size & SQFS_BLOCK_COMPRESSED_BIT)});
+  return p.get_future();
+}
+
+/* Writes a data block as it was stored in another image, with its size
+   field, without compressing it again. */
+void sqsh_writer::enqueue_raw_block(uint32_t const inode_number,
+                                    block_type && block, uint32_t const size)
 {
+  if (!writer_failed)
+    enqueue(std::unique_ptr<pending_write>(new pending_block(
+        *this, stored(std::move(block), size), inode_number)));
+}
+
+/* Writes a fragment block as it was stored in another image, and returns
+   its number. A fragment still being filled is written out first. */
+uint32_t sqsh_writer::enqueue_raw_fragment(block_type && block,
+                                           uint32_t const size)
+{
+  flush_fragment();
+  if (!writer_failed)
+    enqueue(std::unique_ptr<pending_write>(
+        new pending_fragment(*this, stored(std::move(block), size))));
+  return fragment_count++;
+}
+
+void sqsh_writer::enqueue_dedup(uint32_t inode_number, uint64_t file_size)
+{
+  auto const key = dedup_index::key_for(file_size, file_hash.value());
   if (dedup_enabled && !writer_failed)
     enqueue(std::unique_ptr<pending_write>(
-        new pending_dedup(*this, inode_number)));
+        new pending_dedup(*this, inode_number, key)));
 }
 
 void sqsh_writer::enqueue(std::unique_ptr<pending_write> && write)
@@ -348,3 +435,25 @@ bool sqsh_writer::finish_data()
     thread.join();
   return writer_failed;
 }
+
+/* Waits until everything enqueued so far is in the output file, and
+   flushes it to disk. The fragment being filled is not written. */
+void sqsh_writer::sync()
+{
+  std::promise<void> done;
+  auto synced = done.get_future();
+  enqueue(std::unique_ptr<pending_write>(
+      new pending_sync(*this, std::move(done))));
+  synced.get();
+
+  std::lock_guard<decltype(outfile_mutex)> lock(outfile_mutex);
+  outfile.flush();
+#if LSL_HAVE_FSYNC
+  int const fd = open(outfilepath.data(), O_WRONLY);
+  if (fd >= 0)
+    {
+      fsync(fd);
+      close(fd);
+    }
+#endif
+}
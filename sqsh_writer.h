@@ -29,17 +29,22 @@ along with archive2sqfs.  If not, see <http://www.gnu.org/licenses/>.
 #include <unordered_map>
 #include <vector>
 
-#include "adler_wrapper.h"
+#include "block_cache.h"
 #include "block_report.h"
 #include "bounded_work_queue.h"
 #include "compressor.h"
+#include "content_hash.h"
+#include "dedup_index.h"
 #include "fragment_entry.h"
 #include "fstream_util.h"
 #include "metadata_writer.h"
+#include "optional.h"
 #include "pending_write.h"
 #include "sqsh_defs.h"
 
 #define SQFS_BLOCK_LOG_DEFAULT 17
+#define SQFS_BLOCK_LOG_MIN 12
+#define SQFS_BLOCK_LOG_MAX 20
 
 struct fragment_index
 {
@@ -74,6 +79,10 @@ struct sqsh_writer
   uint32_t next_inode = 1;
   struct sqfs_super super;
 
+  /* Bumped whenever a directory of a tree built on this writer is
+     replaced, so that path caches drop the directories they hold. */
+  uint64_t tree_generation = 0;
+
   bool const single_threaded;
   bool const dedup_enabled;
   std::thread thread;
@@ -91,18 +100,15 @@ struct sqsh_writer
   std::unordered_map<uint16_t, uint32_t> rids;
 
   std::unordered_map<uint32_t, fragment_index> fragment_indices;
-  std::unordered_map<uint32_t, adler_wrapper> fragmented_checksums;
-  std::unordered_map<decltype(fragmented_checksums[0].sum),
-                     std::vector<uint32_t>>
-      fragmented_duplicates;
+  dedup_index fragmented_duplicates;
+  /* The hash of the data of the file being written, kept with dedup
+     enabled, and whether its blocks were handed to dedup. */
+  content_hash file_hash;
+  bool file_blocks_ended = false;
 
   // owned by writer thread.
   std::unordered_map<uint32_t, block_report> reports;
-
-  std::unordered_map<uint32_t, adler_wrapper> blocked_checksums;
-  std::unordered_map<decltype(blocked_checksums[0].sum),
-                     std::vector<uint32_t>>
-      blocked_duplicates;
+  dedup_index blocked_duplicates;
 
   // shared by client and writer threads.
   std::fstream outfile;
@@ -111,6 +117,8 @@ struct sqsh_writer
   bounded_work_queue<std::unique_ptr<pending_write>> writer_queue;
   std::atomic<bool> writer_failed{false};
 
+  block_cache * cache = nullptr;
+
   std::vector<fragment_entry> fragments;
   std::mutex fragments_mutex;
   std::condition_variable fragments_cv;
@@ -118,6 +126,7 @@ struct sqsh_writer
   uint32_t next_inode_number() { return next_inode++; }
   std::size_t block_size() const { return std::size_t(1) << super.block_log; }
 
+  void reserve(std::size_t files, uint64_t data_size);
   void write_header();
   uint16_t id_lookup(uint32_t);
   optional<fragment_index> dedup_fragment_index(uint32_t);
@@ -125,12 +134,16 @@ struct sqsh_writer
   void put_fragment(uint32_t);
   void flush_fragment();
   void write_tables();
+  std::future<compression_result> compress_async(block_type &&);
   void enqueue_block(uint32_t);
-  void enqueue_dedup(uint32_t);
+  void enqueue_dedup(uint32_t, uint64_t);
   void enqueue_fragment();
+  void enqueue_raw_block(uint32_t, block_type &&, uint32_t);
+  uint32_t enqueue_raw_fragment(block_type &&, uint32_t);
   void enqueue(std::unique_ptr<pending_write> &&);
   void writer_thread();
   bool finish_data();
+  void sync();
   void push_fragment_entry(fragment_entry);
   optional<fragment_entry> get_fragment_entry(uint32_t);
   std::vector<char> read_bytes(decltype(outfile)::pos_type, std::streamsize);
@@ -149,13 +162,21 @@ struct sqsh_writer
     return tell;
   }
 
+  /* With append set, path must be an existing image, which is opened
+     without truncating it. */
   sqsh_writer(std::string path, int blog, std::string comptype,
-              bool disable_threads = false, bool enable_dedup = false)
+              bool disable_threads = false, bool enable_dedup = false,
+              bool append = false)
       : single_threaded(disable_threads), dedup_enabled(enable_dedup),
         outfilepath(path), comp(get_compressor_for(comptype)),
-        dentry_writer(*comp), inode_writer(*comp),
+        dentry_writer(*comp, path + ".dentry~", launch_policy(),
+                      thread_count()),
+        inode_writer(*comp, path + ".inode~", launch_policy(),
+                     thread_count()),
         outfile(path, std::ios_base::binary | std::ios_base::in |
-                          std::ios_base::out | std::ios_base::trunc),
+                          std::ios_base::out |
+                          (append ? std::ios_base::openmode()
+                                  : std::ios_base::trunc)),
         writer_queue(thread_count())
   {
     super.block_log = blog;
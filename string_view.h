@@ -0,0 +1,88 @@
+/*
+Copyright (C) 2018  Charles Cagle
+
+This file is part of archive2sqfs.
+
+archive2sqfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3.
+
+archive2sqfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with archive2sqfs.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef LSL_STRING_VIEW_H
+#define LSL_STRING_VIEW_H
+
+#if __cplusplus >= 201703L && __has_include(<string_view>)
+#include <string_view>
+using std::string_view;
+#else
+
+#include <cstddef>
+#include <cstring>
+#include <string>
+
+class string_view
+{
+  char const * ptr;
+  std::size_t len;
+
+public:
+  static constexpr std::size_t npos = std::size_t(-1);
+
+  constexpr string_view() : ptr(nullptr), len(0) {}
+  constexpr string_view(char const * p, std::size_t n) : ptr(p), len(n) {}
+  string_view(char const * p) : ptr(p), len(std::strlen(p)) {}
+  string_view(std::string const & s) : ptr(s.data()), len(s.size()) {}
+
+  constexpr char const * data() const { return ptr; }
+  constexpr std::size_t size() const { return len; }
+  constexpr bool empty() const { return len == 0; }
+  constexpr char operator[](std::size_t i) const { return ptr[i]; }
+  constexpr char const * begin() const { return ptr; }
+  constexpr char const * end() const { return ptr + len; }
+
+  string_view substr(std::size_t pos, std::size_t n = npos) const
+  {
+    return {ptr + pos, n < len - pos ? n : len - pos};
+  }
+
+  std::size_t find(char c, std::size_t pos = 0) const
+  {
+    for (; pos < len; ++pos)
+      if (ptr[pos] == c)
+        return pos;
+    return npos;
+  }
+
+  std::size_t rfind(char c) const
+  {
+    for (auto i = len; i-- > 0;)
+      if (ptr[i] == c)
+        return i;
+    return npos;
+  }
+
+  explicit operator std::string() const { return {ptr, len}; }
+};
+
+inline bool operator==(string_view const a, string_view const b)
+{
+  return a.size() == b.size() &&
+         std::memcmp(a.data(), b.data(), a.size()) == 0;
+}
+
+inline bool operator!=(string_view const a, string_view const b)
+{
+  return !(a == b);
+}
+
+#endif
+
+#endif
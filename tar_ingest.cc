@@ -0,0 +1,39 @@
+/*
+Copyright (C) 2018  Charles Cagle
+
+This file is part of archive2sqfs.
+
+archive2sqfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3.
+
+archive2sqfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with archive2sqfs.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cstddef>
+#include <vector>
+
+#include "block_ingest.h"
+#include "tar_ingest.h"
+
+std::vector<ingest_block> tar_source::prepare(std::size_t const first,
+                                              std::size_t const last) const
+{
+  auto const base = reader.mapping().data();
+  std::vector<ingest_block> blocks(last - first);
+  for (std::size_t i = first; i < last; ++i)
+    {
+      auto const & s = spans[i];
+      auto & b = blocks[i - first];
+      b.data.assign(base + s.offset, base + s.offset + s.size);
+      if (hash)
+        b.compute_hash();
+    }
+  return blocks;
+}
@@ -0,0 +1,118 @@
+/*
+Copyright (C) 2018  Charles Cagle
+
+This file is part of archive2sqfs.
+
+archive2sqfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3.
+
+archive2sqfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with archive2sqfs.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef LSL_TAR_INGEST_H
+#define LSL_TAR_INGEST_H
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "block_ingest.h"
+#include "entry_header.h"
+#include "mapped_input.h"
+#include "tar_reader.h"
+
+/* Scans all headers of a mapped tar file, then cuts its file data into
+   ranges of whole blocks that are copied out of the mapping and hashed
+   by block_ingest's tasks. The entries are handed out in archive order,
+   or in the order that order returns for them. */
+class tar_source
+{
+  struct span
+  {
+    std::size_t offset;
+    std::size_t size;
+  };
+
+  tar_reader reader;
+  bool const hash;
+  std::vector<span> spans;
+
+public:
+  std::vector<entry_header> entries;
+  std::vector<std::size_t> first_block;
+  std::vector<std::size_t> range_ends;
+
+  template <typename P, typename O>
+  tar_source(std::unique_ptr<mapped_file> &&, P selected,
+             std::size_t block_size, bool hash, O order);
+
+  template <typename P>
+  tar_source(std::unique_ptr<mapped_file> && file, P selected,
+             std::size_t const block_size, bool const hash)
+      : tar_source(std::move(file), selected, block_size, hash,
+                   [](std::vector<entry_header> const & entries) {
+                     std::vector<std::size_t> order(entries.size());
+                     for (std::size_t i = 0; i < order.size(); ++i)
+                       order[i] = i;
+                     return order;
+                   })
+  {
+  }
+
+  std::vector<ingest_block> prepare(std::size_t, std::size_t) const;
+};
+
+using tar_ingest = block_ingest<tar_source>;
+
+template <typename P, typename O>
+tar_source::tar_source(std::unique_ptr<mapped_file> && file, P selected,
+                       std::size_t const block_size, bool const hash,
+                       O order)
+    : reader(std::move(file)), hash(hash)
+{
+  static std::size_t constexpr range_bytes = 4 << 20;
+  static std::size_t constexpr range_blocks = 1024;
+
+  std::vector<entry_header> scanned;
+  std::vector<std::size_t> positions;
+  while (reader.next())
+    if (selected(reader))
+      {
+        scanned.emplace_back(reader);
+        positions.push_back(reader.data_position());
+      }
+
+  std::size_t bytes = 0;
+  for (auto const i : order(scanned))
+    {
+      entries.push_back(std::move(scanned[i]));
+      first_block.push_back(spans.size());
+      std::size_t const size = entries.back().filesize();
+      for (std::size_t off = 0; off < size; off += block_size)
+        {
+          spans.push_back(
+              {positions[i] + off, std::min(block_size, size - off)});
+          bytes += spans.back().size;
+          auto const first = range_ends.empty() ? 0 : range_ends.back();
+          if (bytes >= range_bytes || spans.size() - first >= range_blocks)
+            {
+              range_ends.push_back(spans.size());
+              bytes = 0;
+            }
+        }
+    }
+  first_block.push_back(spans.size());
+  if (range_ends.empty() || range_ends.back() != spans.size())
+    range_ends.push_back(spans.size());
+}
+
+#endif
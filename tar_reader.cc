@@ -0,0 +1,299 @@
+/*
+Copyright (C) 2018  Charles Cagle
+
+This file is part of archive2sqfs.
+
+archive2sqfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3.
+
+archive2sqfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with archive2sqfs.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+using namespace std::literals;
+
+#include <archive_entry.h>
+
+#include "mapped_input.h"
+#include "optional.h"
+#include "string_view.h"
+#include "tar_reader.h"
+
+static std::size_t constexpr tar_block = 512;
+
+static std::string field(char const * const p, std::size_t const len)
+{
+  return {p, std::find(p, p + len, '\0')};
+}
+
+/* Parses an octal header field, or a base-256 one if its high bit is set
+   as GNU tar writes them for values that do not fit in octal. */
+static int64_t number(char const * const p, std::size_t const len)
+{
+  if (uint8_t(p[0]) & 0x80)
+    {
+      uint64_t value = uint8_t(p[0]) & 0x7f;
+      if (value & 0x40)
+        value |= ~uint64_t(0x7f);
+      for (std::size_t i = 1; i < len; ++i)
+        value = value << 8 | uint8_t(p[i]);
+      return value;
+    }
+
+  std::size_t i = 0;
+  while (i < len && p[i] == ' ')
+    ++i;
+  int64_t value = 0;
+  for (; i < len && p[i] >= '0' && p[i] <= '7'; ++i)
+    value = value * 8 + (p[i] - '0');
+  return value;
+}
+
+static int64_t decimal(string_view const s)
+{
+  std::size_t i = s.size() != 0 && s[0] == '-';
+  int64_t value = 0;
+  for (; i < s.size() && s[i] >= '0' && s[i] <= '9'; ++i)
+    value = value * 10 + (s[i] - '0');
+  return s.size() != 0 && s[0] == '-' ? -value : value;
+}
+
+static bool valid_checksum(char const * const header)
+{
+  int64_t unsigned_sum = 0;
+  int64_t signed_sum = 0;
+  for (std::size_t i = 0; i < tar_block; ++i)
+    {
+      auto const c = i >= 148 && i < 156 ? ' ' : header[i];
+      unsigned_sum += uint8_t(c);
+      signed_sum += int8_t(c);
+    }
+
+  auto const expected = number(header + 148, 8);
+  return expected == unsigned_sum || expected == signed_sum;
+}
+
+static std::size_t padded(std::size_t const len)
+{
+  return (len + tar_block - 1) & ~(tar_block - 1);
+}
+
+static void parse_pax(string_view data,
+                      std::map<std::string, std::string> & records)
+{
+  while (!data.empty() && data[0] != '\0')
+    {
+      auto const space = data.find(' ');
+      auto const len = decimal(data.substr(0, space));
+      if (space == string_view::npos || len < 0 ||
+          std::size_t(len) <= space + 1 || std::size_t(len) > data.size() ||
+          data[len - 1] != '\n')
+        throw std::runtime_error("invalid pax extended header"s);
+
+      auto const record = data.substr(space + 1, len - space - 2);
+      auto const equals = record.find('=');
+      if (equals == string_view::npos)
+        throw std::runtime_error("invalid pax extended header"s);
+      records[std::string(record.substr(0, equals))] =
+          std::string(record.substr(equals + 1));
+      data = data.substr(len);
+    }
+}
+
+tar_reader::tar_reader(std::unique_ptr<mapped_file> && f) : file(std::move(f))
+{
+}
+
+void tar_reader::apply(pax_records const & records)
+{
+  for (auto const & record : records)
+    {
+      auto const & key = record.first;
+      auto const & value = record.second;
+      if (value.empty())
+        continue;
+
+      if (key == "path")
+        path = value;
+      else if (key == "linkpath")
+        link = value;
+      else if (key == "size")
+        size = decimal(value);
+      else if (key == "uid")
+        user = decimal(value);
+      else if (key == "gid")
+        group = decimal(value);
+      else if (key == "mtime")
+        time = decimal(value);
+      else if (key == "SCHILY.devmajor")
+        dev_major = decimal(value);
+      else if (key == "SCHILY.devminor")
+        dev_minor = decimal(value);
+      else if (key.compare(0, 11, "GNU.sparse.") == 0)
+        throw std::runtime_error("sparse tar entries are not supported"s);
+    }
+}
+
+bool tar_reader::next()
+{
+  auto const base = file->data();
+  auto const length = file->size();
+  pax_records local;
+  optional<std::string> long_path;
+  optional<std::string> long_link;
+
+  for (;;)
+    {
+      if (length - offset < tar_block)
+        {
+          if (offset != length)
+            throw std::runtime_error("truncated tar archive"s);
+          return false;
+        }
+
+      auto const header = base + offset;
+      if (std::all_of(header, header + tar_block,
+                      [](char const c) { return c == '\0'; }))
+        return false;
+      if (!valid_checksum(header))
+        throw std::runtime_error("invalid tar header checksum"s);
+
+      auto const flag = header[156];
+      size = number(header + 124, 12);
+      if (size < 0 || uint64_t(size) > length - offset - tar_block)
+        throw std::runtime_error("truncated tar archive"s);
+      data_offset = offset + tar_block;
+      string_view const data(base + data_offset, size);
+
+      switch (flag)
+        {
+          case 'x':
+          case 'g':
+          case 'L':
+          case 'K':
+          case 'V':
+            offset = std::min(length, data_offset + padded(size));
+            if (flag == 'x')
+              parse_pax(data, local);
+            else if (flag == 'g')
+              parse_pax(data, global);
+            else if (flag == 'L')
+              long_path = field(data.data(), data.size());
+            else if (flag == 'K')
+              long_link = field(data.data(), data.size());
+            continue;
+
+          case 'M':
+          case 'N':
+          case 'S':
+            throw std::runtime_error("unsupported GNU tar entry type"s);
+        }
+
+      path = long_path ? *long_path : field(header, 100);
+      if (!long_path && std::memcmp(header + 257, "ustar\0", 6) == 0 &&
+          header[345] != '\0')
+        path = field(header + 345, 155) + "/"s + path;
+      link = long_link ? *long_link : field(header + 157, 100);
+      is_hardlink = flag == '1';
+      perm = number(header + 100, 8) & 07777;
+      user = number(header + 108, 8);
+      group = number(header + 116, 8);
+      time = number(header + 136, 12);
+      dev_major = number(header + 329, 8);
+      dev_minor = number(header + 337, 8);
+      apply(global);
+      apply(local);
+
+      switch (flag)
+        {
+          case '1':
+            type = AE_IFREG;
+            break;
+          case '2':
+            type = AE_IFLNK;
+            break;
+          case '3':
+            type = AE_IFCHR;
+            break;
+          case '4':
+            type = AE_IFBLK;
+            break;
+          case '5':
+          case 'D':
+            type = AE_IFDIR;
+            break;
+          case '6':
+            type = AE_IFIFO;
+            break;
+          default:
+            type = path.empty() || path.back() != '/' ? AE_IFREG : AE_IFDIR;
+            break;
+        }
+
+      bool const has_data = type == AE_IFREG || flag == '1' || flag == 'D';
+      if (size < 0 || (has_data && uint64_t(size) > length - data_offset))
+        throw std::runtime_error("truncated tar archive"s);
+      if (!has_data)
+        size = 0;
+      data_end = data_offset + size;
+      offset = std::min(length, padded(data_end));
+      if (type != AE_IFREG)
+        size = 0;
+      return true;
+    }
+}
+
+uint64_t tar_reader::rdev() const
+{
+  return (dev_major & 0xfff) << 8 | (dev_major & ~uint64_t(0xfff)) << 32 |
+         (dev_minor & 0xff) | (dev_minor & ~uint64_t(0xff)) << 12;
+}
+
+string_view tar_reader::take_data(std::size_t const len)
+{
+  if (len > data_end - data_offset)
+    throw std::runtime_error("failed to read data from archive"s);
+  string_view const span(file->data() + data_offset, len);
+  data_offset += len;
+  return span;
+}
+
+void tar_reader::read(void * const buff, std::size_t const len)
+{
+  auto const span = take_data(len);
+  std::memcpy(buff, span.data(), len);
+}
+
+void tar_reader::read(string_view & span, std::size_t const len)
+{
+  span = take_data(len);
+}
+
+void tar_reader::read(std::vector<char> & con, std::size_t const len)
+{
+  auto const span = take_data(len);
+  con.assign(span.begin(), span.end());
+}
+
+bool tar_reader::recognizes(mapped_file const & f)
+{
+  return f.size() >= tar_block &&
+         std::memcmp(f.data() + 257, "ustar", 5) == 0;
+}
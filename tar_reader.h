@@ -0,0 +1,95 @@
+/*
+Copyright (C) 2018  Charles Cagle
+
+This file is part of archive2sqfs.
+
+archive2sqfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3.
+
+archive2sqfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with archive2sqfs.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef LSL_TAR_READER_H
+#define LSL_TAR_READER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "mapped_input.h"
+#include "string_view.h"
+
+/* Reads an uncompressed ustar, pax or GNU tar file in place from a mapping
+   of it, with the same interface as archive_reader. File data is handed
+   out as views into the mapping rather than copied. */
+class tar_reader
+{
+public:
+  using buffer_type = string_view;
+
+  tar_reader(std::unique_ptr<mapped_file> &&);
+  tar_reader(tar_reader const &) = delete;
+
+  /* Whether the file starts with a ustar or GNU tar header. */
+  static bool recognizes(mapped_file const &);
+
+  bool next();
+  void skip() {}
+  void read(void *, std::size_t);
+  void read(string_view &, std::size_t);
+  void read(std::vector<char> &, std::size_t);
+
+  char const * pathname() const { return path.data(); }
+  unsigned filetype() const { return type; }
+  uint16_t mode() const { return perm; }
+  int64_t uid() const { return user; }
+  int64_t gid() const { return group; }
+  int64_t mtime() const { return time; }
+  int64_t filesize() const { return size; }
+  uint64_t rdev() const;
+  char const * symlink_target() const { return link.data(); }
+
+  char const * hardlink_target() const
+  {
+    return is_hardlink ? link.data() : nullptr;
+  }
+
+  mapped_file const & mapping() const { return *file; }
+  std::size_t data_position() const { return data_offset; }
+
+private:
+  using pax_records = std::map<std::string, std::string>;
+
+  std::unique_ptr<mapped_file> file;
+  std::size_t offset = 0;
+  std::size_t data_offset = 0;
+  std::size_t data_end = 0;
+  pax_records global;
+
+  std::string path;
+  std::string link;
+  bool is_hardlink;
+  unsigned type;
+  uint16_t perm;
+  int64_t user;
+  int64_t group;
+  int64_t time;
+  int64_t size;
+  uint64_t dev_major;
+  uint64_t dev_minor;
+
+  string_view take_data(std::size_t);
+  void apply(pax_records const &);
+};
+
+#endif
@@ -0,0 +1,103 @@
+/*
+Copyright (C) 2018  Charles Cagle
+
+This file is part of archive2sqfs.
+
+archive2sqfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3.
+
+archive2sqfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with archive2sqfs.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace std::literals;
+
+#include <archive.h>
+#include <archive_entry.h>
+
+#include "archive_reader.h"
+#include "mapped_input.h"
+#include "tar_spool.h"
+
+static std::size_t constexpr spool_chunk = 1 << 20;
+
+static void write_spool(archive_reader & archive, std::string const & path)
+{
+  std::unique_ptr<struct archive, decltype(&archive_write_free)> writer(
+      archive_write_new(), archive_write_free);
+  if (!writer || archive_write_set_format_pax_restricted(writer.get()) !=
+                     ARCHIVE_OK ||
+      archive_write_open_filename(writer.get(), path.data()) != ARCHIVE_OK)
+    throw std::runtime_error("failed to open spool file"s);
+
+  std::unique_ptr<struct archive_entry, decltype(&archive_entry_free)> entry(
+      archive_entry_new(), archive_entry_free);
+  std::vector<char> buff;
+  while (archive.next())
+    {
+      auto const hardlink = archive.hardlink_target();
+      int64_t const size = hardlink ? 0 : archive.filesize();
+      archive_entry_clear(entry.get());
+      archive_entry_set_pathname(entry.get(), archive.pathname());
+      archive_entry_set_filetype(entry.get(), archive.filetype());
+      archive_entry_set_perm(entry.get(), archive.mode());
+      archive_entry_set_uid(entry.get(), archive.uid());
+      archive_entry_set_gid(entry.get(), archive.gid());
+      archive_entry_set_mtime(entry.get(), archive.mtime(), 0);
+      archive_entry_set_size(entry.get(), size);
+      archive_entry_set_rdev(entry.get(), archive.rdev());
+      if (archive.filetype() == AE_IFLNK)
+        archive_entry_set_symlink(entry.get(), archive.symlink_target());
+      if (hardlink)
+        archive_entry_set_hardlink(entry.get(), hardlink);
+      if (archive_write_header(writer.get(), entry.get()) != ARCHIVE_OK)
+        throw std::runtime_error("failed to write spool entry"s);
+
+      for (int64_t left = size; left > 0;)
+        {
+          auto const len = std::min<int64_t>(left, spool_chunk);
+          archive.read(buff, len);
+          if (archive_write_data(writer.get(), buff.data(), len) != len)
+            throw std::runtime_error("failed to write spool data"s);
+          left -= len;
+        }
+      archive.skip();
+    }
+  if (archive_write_close(writer.get()) != ARCHIVE_OK)
+    throw std::runtime_error("failed to close spool file"s);
+}
+
+std::unique_ptr<mapped_file> spool_archive(archive_reader & archive,
+                                           std::string const & path)
+{
+  try
+    {
+      write_spool(archive, path);
+    }
+  catch (...)
+    {
+      std::remove(path.data());
+      throw;
+    }
+
+  auto file = mapped_file::open(path.data());
+  std::remove(path.data());
+  if (!file)
+    throw std::runtime_error("failed to map spool file"s);
+  return file;
+}
@@ -16,21 +16,22 @@ You should have received a copy of the GNU General Public License
 along with archive2sqfs.  If not, see <http://www.gnu.org/licenses/>.
 */
 
-#ifndef LSL_ADLER_WRAPPER_H
-#define LSL_ADLER_WRAPPER_H
 
-#include <zlib.h>
+#ifndef LSL_TAR_SPOOL_H
+#define LSL_TAR_SPOOL_H
 
-struct adler_wrapper
-{
-  uLong sum;
+#include <memory>
+#include <string>
 
-  adler_wrapper() : sum(adler32_z(0, Z_NULL, 0)) {}
+#include "archive_reader.h"
+#include "mapped_input.h"
 
-  template <typename C> void update(C & c)
-  {
-    sum = adler32_z(sum, reinterpret_cast<Bytef *>(c.data()), c.size());
-  }
-};
+/* Copies every entry of archive, in any format libarchive reads, into an
+   uncompressed pax tar file at path, and returns a mapping of it so that
+   the built-in tar reader can read its entries in any order. The file is
+   removed once it is mapped, or if it
+   cannot be written. */
+std::unique_ptr<mapped_file> spool_archive(archive_reader & archive,
+                                           std::string const & path);
 
 #endif
@@ -0,0 +1,96 @@
+/*
+Copyright (C) 2018  Charles Cagle
+
+This file is part of archive2sqfs.
+
+archive2sqfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3.
+
+archive2sqfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with archive2sqfs.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/* Writes an image whose files end in a fragment after their data blocks,
+   as mksquashfs -always-use-fragments does, which archive2sqfs does not
+   write itself. Some files are copies of others.
+
+   usage: fragment_tails image */
+
+#include <cstdint>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace std::literals;
+
+#include "compressor.h"
+#include "dirtree.h"
+#include "sqsh_defs.h"
+#include "sqsh_writer.h"
+
+static std::vector<char> pattern(std::size_t const len, unsigned const seed)
+{
+  std::vector<char> data(len);
+  for (std::size_t i = 0; i < len; ++i)
+    data[i] = char((i * i * 7 + i * seed) % 251);
+  return data;
+}
+
+/* Adds a file of blocks whole blocks followed by a tail of tail bytes,
+   which goes into a fragment block of its own. */
+static void add_file(dirtree_dir & root, std::string const & name,
+                     std::size_t const blocks, std::size_t const tail,
+                     unsigned const seed)
+{
+  auto & wr = *root.wr;
+  auto & reg = root.put_file<dirtree_reg>(name);
+  auto const data = pattern(blocks * wr.block_size() + tail, seed);
+  auto const end = data.begin() + blocks * wr.block_size();
+  for (auto pos = data.begin(); pos != end; pos += wr.block_size())
+    reg.append(std::vector<char>(pos, pos + wr.block_size()));
+  wr.current_block.assign(end, data.end());
+  reg.file_size += tail;
+  wr.put_fragment(reg.inode_number);
+  wr.flush_fragment();
+  reg.finalize();
+}
+
+int main(int argc, char * argv[])
+{
+  if (argc != 2)
+    {
+      std::cerr << "usage: "s << argv[0] << " image\n"s;
+      return 1;
+    }
+
+  try
+    {
+      sqsh_writer writer(argv[1], SQFS_BLOCK_LOG_DEFAULT, COMPRESSOR_DEFAULT,
+                         true);
+      dirtree_dir root(&writer);
+      add_file(root, "a", 2, 1000, 1);
+      add_file(root, "b", 1, 5000, 2);
+      add_file(root, "copy_of_a", 2, 1000, 1);
+      add_file(root, "c", 3, 100, 3);
+      add_file(root, "copy_of_b", 1, 5000, 2);
+      add_file(root, "small", 0, 300, 4);
+      if (writer.finish_data())
+        throw std::runtime_error("cannot write "s + argv[1]);
+      root.write_tables();
+      writer.write_header();
+    }
+  catch (std::exception const & e)
+    {
+      std::cerr << argv[0] << ": "s << e.what() << std::endl;
+      return 1;
+    }
+  return 0;
+}
@@ -0,0 +1,103 @@
+/*
+Copyright (C) 2018  Charles Cagle
+
+This file is part of archive2sqfs.
+
+archive2sqfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3.
+
+archive2sqfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with archive2sqfs.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/* Prints the tree of an image, one line per entry with its metadata and,
+   for regular files, the size and a hash of the contents read back from
+   the data blocks and fragment. Images holding the same tree print the
+   same, however their data is laid out.
+
+   usage: image_dump image */
+
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace std::literals;
+
+#include "content_hash.h"
+#include "sqsh_defs.h"
+#include "sqsh_reader.h"
+
+static content_hash file_hash(sqsh_reader & image, sqsh_inode const & node)
+{
+  content_hash hash;
+  auto pos = node.start_block;
+  for (auto const size : node.blocks)
+    {
+      if (size == 0)
+        {
+          auto const left = node.file_size - hash.size;
+          hash.update(std::vector<char>(
+              std::min(uint64_t(image.block_size()), left)));
+          continue;
+        }
+      hash.update(image.read_block(pos, size));
+      pos += size & ~SQFS_BLOCK_COMPRESSED_BIT;
+    }
+  if (node.fragment != SQFS_FRAGMENT_NONE)
+    {
+      auto const & entry = image.fragments.at(node.fragment);
+      auto const block = image.read_block(entry.start_block, entry.size);
+      auto const left = node.file_size - hash.size;
+      if (node.fragment_offset > block.size() ||
+          left > block.size() - node.fragment_offset)
+        throw std::runtime_error("fragment out of range in image"s);
+      hash.update(block.data() + node.fragment_offset, left);
+    }
+  if (hash.size != node.file_size)
+    throw std::runtime_error("file data does not match its size"s);
+  return hash;
+}
+
+int main(int argc, char * argv[])
+{
+  if (argc != 2)
+    {
+      std::cerr << "usage: "s << argv[0] << " image\n"s;
+      return 1;
+    }
+
+  try
+    {
+      sqsh_reader image(argv[1]);
+      image.walk([&](std::string const & path, sqsh_inode const & node) {
+        std::cout << '/' << path << ' ' << node.type << ' ' << std::oct
+                  << node.perm << std::dec << ' ' << node.user << ' '
+                  << node.group << ' ' << node.time << ' ' << node.nlink;
+        if (node.type == SQFS_INODE_TYPE_REG)
+          std::cout << ' ' << node.file_size << ' ' << std::hex
+                    << file_hash(image, node).value() << std::dec;
+        else if (node.type == SQFS_INODE_TYPE_SYM)
+          std::cout << ' ' << node.target;
+        else if (node.type == SQFS_INODE_TYPE_BLK ||
+                 node.type == SQFS_INODE_TYPE_CHR)
+          std::cout << ' ' << node.rdev;
+        std::cout << '\n';
+      });
+    }
+  catch (std::exception const & e)
+    {
+      std::cerr << argv[0] << ": "s << e.what() << std::endl;
+      return 1;
+    }
+  return 0;
+}
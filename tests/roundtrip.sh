@@ -0,0 +1,145 @@
+#!/bin/sh
+# Copyright (C) 2018  Charles Cagle
+#
+# This file is part of archive2sqfs.
+#
+# archive2sqfs is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, version 3.
+#
+# archive2sqfs is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with archive2sqfs.  If not, see <http://www.gnu.org/licenses/>.
+
+# Builds the same tree with --append, --merge, --resume and from an image
+# read back as input, and checks that image_dump prints each the same as
+# an image built in one go. Also checks that an append that fails leaves
+# the image as it was, copies an image from fragment_tails whose files
+# have both blocks and a fragment, layers a directory and an image under
+# a whiteout, and keeps the metadata of directories above files selected
+# by a wildcard include.
+#
+# usage: roundtrip.sh archive2sqfs image_dump fragment_tails scratch-dir
+
+a2s=$1
+dump=$2
+tails=$3
+scratch=$4
+
+fail()
+{
+  echo "roundtrip: $*" >&2
+  exit 1
+}
+
+# Dumps two images and compares them.
+same()
+{
+  "$dump" "$1" > "$1.txt" || fail "cannot read $1"
+  "$dump" "$2" > "$2.txt" || fail "cannot read $2"
+  cmp "$1.txt" "$2.txt" > /dev/null || fail "$3: $1 and $2 differ"
+}
+
+rm -rf "$scratch"
+mkdir -p "$scratch" && cd "$scratch" || fail "cannot make $scratch"
+
+# Files of many blocks, a few with a tail in a fragment, and small ones.
+mkdir -p one/d two/e/f
+dd if=/dev/urandom of=one/big bs=1024 count=300 2> /dev/null
+dd if=/dev/urandom of=one/d/tail bs=1000 count=133 2> /dev/null
+echo hello > one/d/small
+ln -s d/small one/link
+cp one/big two/copy
+dd if=/dev/urandom of=two/e/f/other bs=1000 count=70 2> /dev/null
+echo world > two/e/small
+
+"$a2s" full.img one two:sub || fail "building full.img"
+
+# An image read back as input.
+"$a2s" pass.img full.img || fail "reading full.img"
+same full.img pass.img "squashfs input"
+
+# Files with both blocks and a fragment are copied as stored, and the
+# copies among them are found by dedup.
+"$tails" tails.img || fail "building tails.img"
+for dedup in "" --enable-dedup; do
+  "$a2s" $dedup tails-copy.img tails.img || fail "reading tails.img"
+  same tails.img tails-copy.img "fragment tails $dedup"
+done
+
+# Appending to an image, with and without dedup. A single infile is not
+# split at ':', so two:sub is appended along with one again.
+for dedup in "" --enable-dedup; do
+  "$a2s" $dedup app.img one || fail "building app.img"
+  "$a2s" $dedup --append app.img two:sub one || fail "appending to app.img"
+  same full.img app.img "append $dedup"
+done
+
+# Merging separately built images.
+"$a2s" part1.img one || fail "building part1.img"
+"$a2s" part2.img two || fail "building part2.img"
+"$a2s" --merge merged.img part1.img part2.img:sub || fail "merging"
+same full.img merged.img "merge"
+
+# A lower layer, as a directory and as an image, in which b is a hard
+# link to a/f, under a layer that whites out a/f. b keeps the data.
+mkdir -p low/a up/a
+echo linked > low/a/f
+ln low/a/f low/b
+: > up/a/.wh.f
+tar -cf up.tar -C up a || fail "making up.tar"
+"$a2s" low.img low || fail "building low.img"
+for low in low low.img; do
+  "$a2s" --layers layered.img "$low" up.tar || fail "layering $low"
+  "$dump" layered.img > layered.txt || fail "cannot read layered.img"
+  grep -q '^/a/f ' layered.txt && fail "whiteout over $low ignored"
+  grep -q '^/b 9 .* 1 7 ' layered.txt || fail "link in $low lost its data"
+done
+
+# A file selected by a wildcard include keeps the mode of the directory
+# above it.
+mkdir -p glob/lib/deep
+echo so > glob/lib/deep/a.so
+chmod 700 glob/lib
+tar -cf glob.tar -C glob lib || fail "making glob.tar"
+"$a2s" --include='**/*.so' glob.img glob.tar || fail "building glob.img"
+"$dump" glob.img > glob.txt || fail "cannot read glob.img"
+grep -q '^/lib 8 700 ' glob.txt || fail "wildcard include lost /lib's mode"
+
+# A tar file of 300 KiB, 4 KiB, 8 KiB and 16 KiB files, and the same cut
+# off halfway through the last one's data, in 512 byte tar blocks.
+mkdir tar
+for f in 300:a 4:b 8:c 16:d; do
+  dd if=/dev/urandom of="tar/${f#*:}" bs=1024 count="${f%:*}" 2> /dev/null
+done
+tar --format=ustar -cf input.tar -C tar a b c d || fail "making input.tar"
+dd if=input.tar of=cut.tar bs=512 count=644 2> /dev/null
+"$a2s" whole.img input.tar || fail "building whole.img"
+
+# An append that fails part way leaves the image as it was.
+"$a2s" kept.img one || fail "building kept.img"
+"$dump" kept.img > before.txt || fail "cannot read kept.img"
+"$a2s" --append kept.img cut.tar 2> /dev/null &&
+  fail "appending a cut off tar file succeeded"
+"$dump" kept.img > after.txt || fail "failed append broke kept.img"
+cmp before.txt after.txt > /dev/null || fail "failed append changed kept.img"
+
+# A build that fails is resumed from its checkpoint. The input is piped
+# with a pause after the first two files, so that a checkpoint is taken
+# once the third is added.
+{
+  dd if=cut.tar bs=512 count=610 2> /dev/null
+  sleep 2
+  dd if=cut.tar bs=512 skip=610 2> /dev/null
+} | "$a2s" --checkpoint=1 resumed.img 2> /dev/null &&
+  fail "building from a cut off tar file succeeded"
+test -f resumed.img.ckpt || fail "no checkpoint was saved"
+"$a2s" --checkpoint=1 --resume resumed.img input.tar || fail "resuming"
+test -f resumed.img.ckpt && fail "checkpoint left after resuming"
+same whole.img resumed.img "resume"
+
+exit 0
@@ -0,0 +1,205 @@
+/*
+Copyright (C) 2018  Charles Cagle
+
+This file is part of archive2sqfs.
+
+archive2sqfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3.
+
+archive2sqfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with archive2sqfs.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/* Builds images through sqsh_builder, with and without threads and
+   deduplication, and reads each one back with sqsh_reader, checking every
+   kind of entry.
+
+   usage: test_sqsh_builder [scratch-image] */
+
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace std::literals;
+
+#include "sqsh_builder.h"
+#include "sqsh_defs.h"
+#include "sqsh_reader.h"
+
+static void check(bool const ok, std::string const & what)
+{
+  if (!ok)
+    throw std::runtime_error("check failed: "s + what);
+}
+
+static std::vector<char> file_data(sqsh_reader & image,
+                                   sqsh_inode const & node)
+{
+  std::vector<char> data;
+  auto pos = node.start_block;
+  for (auto const size : node.blocks)
+    {
+      auto const block = image.read_block(pos, size);
+      data.insert(data.end(), block.begin(), block.end());
+      pos += size & ~SQFS_BLOCK_COMPRESSED_BIT;
+    }
+  if (node.fragment != SQFS_FRAGMENT_NONE)
+    {
+      auto const & entry = image.fragments[node.fragment];
+      auto const block = image.read_block(entry.start_block, entry.size);
+      auto const begin = block.begin() + node.fragment_offset;
+      data.insert(data.end(), begin,
+                  begin + (node.file_size - data.size()));
+    }
+  return data;
+}
+
+static std::vector<char> pattern(std::size_t const len, unsigned const seed)
+{
+  std::vector<char> data(len);
+  for (std::size_t i = 0; i < len; ++i)
+    data[i] = char((i * 7 + seed) % 251);
+  return data;
+}
+
+static void build(std::string const & path, sqsh_options const & opts)
+{
+  sqsh_builder builder(path, opts);
+  auto const block_size = builder.block_size();
+
+  sqsh_metadata dir;
+  dir.perm = 0750;
+  dir.user = 1000;
+  dir.group = 100;
+  dir.time = 1000;
+  builder.add_directory("d", dir);
+
+  sqsh_metadata file;
+  file.time = 2000;
+  auto const big = pattern(2 * block_size + 1000, 1);
+  builder.begin_file("d/big", file);
+  builder.append(std::vector<char>(big.begin(), big.begin() + block_size));
+  builder.append(big.data() + block_size, 1000);
+  builder.append(big.data() + block_size + 1000, block_size);
+  builder.end_file();
+
+  builder.add_file("d/copy", file, big.data(), big.size());
+  builder.add_file("d/small", file, "hello", 5);
+  builder.add_file("replaced", file, "old", 3);
+  builder.add_file("replaced", file, "new data", 8);
+  builder.add_file("a/b/c/deep", file, "deep", 4);
+
+  sqsh_metadata link;
+  link.perm = 0777;
+  builder.add_symlink("s", "d/big", link);
+  builder.add_fifo("p", file);
+  builder.add_socket("sock", file);
+  builder.add_char_device("c", 0x0501, file);
+  builder.add_block_device("b", 0x0803, file);
+
+  check(builder.add_hardlink("h", "d/small"), "hardlink to a file");
+  check(!builder.add_hardlink("h2", "missing"),
+        "hardlink to a missing file");
+
+  builder.add_file("kept", file, "kept", 4);
+  check(builder.add_hardlink("relinked", "kept"), "hardlink to kept");
+  builder.add_file("relinked/inner", file, "inner", 5);
+  check(!builder.finish(), "finish");
+}
+
+static void verify(std::string const & path, sqsh_options const & opts)
+{
+  sqsh_reader image(path);
+  std::map<std::string, sqsh_inode> nodes;
+  image.walk([&](std::string const & p, sqsh_inode const & node) {
+    nodes[p] = node;
+  });
+
+  auto const node = [&](std::string const & p) -> sqsh_inode & {
+    auto const found = nodes.find(p);
+    check(found != nodes.end(), "entry " + p);
+    return found->second;
+  };
+  auto const contents = [&](std::string const & p) {
+    auto const & n = node(p);
+    check(n.type == SQFS_INODE_TYPE_REG, "regular file " + p);
+    auto const data = file_data(image, n);
+    return std::string(data.begin(), data.end());
+  };
+
+  check(nodes.size() == 19, "entry count");
+
+  auto const & d = node("d");
+  check(d.type == SQFS_INODE_TYPE_DIR && d.perm == 0750 && d.user == 1000 &&
+            d.group == 100 && d.time == 1000,
+        "directory metadata");
+
+  auto const big = pattern(2 * image.block_size() + 1000, 1);
+  check(contents("d/big") == std::string(big.begin(), big.end()),
+        "data of d/big");
+  check(node("d/big").time == 2000, "file time");
+  check(contents("d/copy") == contents("d/big"), "data of d/copy");
+  if (opts.dedup)
+    check(node("d/copy").start_block == node("d/big").start_block,
+          "deduplicated blocks");
+  check(contents("d/small") == "hello", "data of d/small");
+  check(contents("replaced") == "new data", "replaced file");
+  check(contents("a/b/c/deep") == "deep", "file in created directories");
+  check(node("a/b").type == SQFS_INODE_TYPE_DIR, "created directory");
+
+  check(node("s").type == SQFS_INODE_TYPE_SYM && node("s").target == "d/big",
+        "symlink");
+  check(node("p").type == SQFS_INODE_TYPE_PIPE, "fifo");
+  check(node("sock").type == SQFS_INODE_TYPE_SOCK, "socket");
+  check(node("c").type == SQFS_INODE_TYPE_CHR && node("c").rdev == 0x0501,
+        "character device");
+  check(node("b").type == SQFS_INODE_TYPE_BLK && node("b").rdev == 0x0803,
+        "block device");
+
+  check(node("h").inode_number == node("d/small").inode_number &&
+            node("h").nlink == 2,
+        "hardlink");
+  check(nodes.count("h2") == 0, "no entry for a failed hardlink");
+  check(node("relinked").type == SQFS_INODE_TYPE_DIR &&
+            contents("kept") == "kept" && node("kept").nlink == 1,
+        "hardlink replaced by a directory");
+}
+
+int main(int argc, char * argv[])
+{
+  std::string const path = argc > 1 ? argv[1] : "test_sqsh_builder.img";
+
+  std::vector<sqsh_options> variants(3);
+  variants[1].single_thread = true;
+  variants[2].dedup = true;
+  variants[2].block_log = 12;
+
+  try
+    {
+      for (auto const & opts : variants)
+        {
+          build(path, opts);
+          verify(path, opts);
+        }
+    }
+  catch (std::exception const & e)
+    {
+      std::cerr << argv[0] << ": "s << e.what() << std::endl;
+      std::remove(path.data());
+      return 1;
+    }
+
+  std::remove(path.data());
+  return 0;
+}
@@ -0,0 +1,377 @@
+/*
+Copyright (C) 2018  Charles Cagle
+
+This file is part of archive2sqfs.
+
+archive2sqfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3.
+
+archive2sqfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with archive2sqfs.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace std::literals;
+
+#include <archive_entry.h>
+#include <zlib.h>
+
+#include "block_ingest.h"
+#include "mapped_input.h"
+#include "zip_ingest.h"
+
+static uint32_t constexpr zip_local_magic = 0x04034b50;
+static uint32_t constexpr zip_central_magic = 0x02014b50;
+static uint32_t constexpr zip_end_magic = 0x06054b50;
+static uint32_t constexpr zip64_locator_magic = 0x07064b50;
+static uint32_t constexpr zip64_end_magic = 0x06064b50;
+static uint16_t constexpr zip_host_unix = 3;
+
+static uint64_t le(unsigned char const * const p, std::size_t const len)
+{
+  uint64_t value = 0;
+  for (std::size_t i = len; i-- > 0;)
+    value = value << 8 | p[i];
+  return value;
+}
+
+static uint16_t le16(unsigned char const * const p) { return le(p, 2); }
+static uint32_t le32(unsigned char const * const p) { return le(p, 4); }
+static uint64_t le64(unsigned char const * const p) { return le(p, 8); }
+
+static std::runtime_error invalid_zip()
+{
+  return std::runtime_error("invalid zip central directory"s);
+}
+
+static int64_t dos_time(uint16_t const date, uint16_t const time)
+{
+  std::tm tm = {};
+  tm.tm_year = (date >> 9) + 80;
+  tm.tm_mon = ((date >> 5) & 15) - 1;
+  tm.tm_mday = date & 31;
+  tm.tm_hour = time >> 11;
+  tm.tm_min = (time >> 5) & 63;
+  tm.tm_sec = (time & 31) * 2;
+  tm.tm_isdst = -1;
+  return std::mktime(&tm);
+}
+
+/* Applies the ZIP64, extended timestamp and Info-ZIP unix extra fields. */
+static void read_extra(zip_entry & e, unsigned char const * p,
+                       unsigned char const * const end, uint64_t & offset)
+{
+  while (end - p >= 4)
+    {
+      auto const id = le16(p);
+      std::size_t const len = le16(p + 2);
+      auto const data = p + 4;
+      if (std::size_t(end - data) < len)
+        throw invalid_zip();
+
+      if (id == 0x0001)
+        {
+          auto q = data;
+          auto const take = [&](uint64_t & field) {
+            if (field == 0xffffffffu && data + len - q >= 8)
+              {
+                field = le64(q);
+                q += 8;
+              }
+          };
+          take(e.size);
+          take(e.compressed_size);
+          take(offset);
+        }
+      else if (id == 0x5455 && len >= 5 && (data[0] & 1))
+        e.time = int32_t(le32(data + 1));
+      else if (id == 0x7875 && len >= 3 && data[0] == 1)
+        {
+          std::size_t const uid_len = data[1];
+          if (uid_len <= 8 && 3 + uid_len <= len)
+            {
+              std::size_t const gid_len = data[2 + uid_len];
+              if (gid_len <= 8 && 3 + uid_len + gid_len <= len)
+                {
+                  e.user = le(data + 2, uid_len);
+                  e.group = le(data + 3 + uid_len, gid_len);
+                }
+            }
+        }
+
+      p = data + len;
+    }
+}
+
+zip_source::member_stream::member_stream(zip_entry const & e,
+                                         char const * const base)
+    : e(e),
+      in(reinterpret_cast<unsigned char const *>(base) + e.data_offset),
+      in_left(e.compressed_size)
+{
+  if (e.method == 0 && e.compressed_size != e.size)
+    throw std::runtime_error("stored zip member has the wrong size"s);
+  if (e.method == 8 && inflateInit2(&zs, -15) != Z_OK)
+    throw std::runtime_error("failure in zlib::inflateInit2"s);
+}
+
+zip_source::member_stream::~member_stream()
+{
+  if (e.method == 8)
+    inflateEnd(&zs);
+}
+
+void zip_source::member_stream::read_block(ingest_block & b,
+                                           std::size_t const block_size)
+{
+  auto const off = uint64_t(next_block++) * block_size;
+  b.data.resize(std::min<uint64_t>(block_size, e.size - off));
+  if (e.method == 0)
+    std::memcpy(b.data.data(), in + off, b.data.size());
+  else
+    {
+      zs.next_out = reinterpret_cast<Bytef *>(b.data.data());
+      zs.avail_out = b.data.size();
+      while (zs.avail_out != 0)
+        {
+          if (zs.avail_in == 0)
+            {
+              auto const len = std::min<uint64_t>(in_left, INT_MAX);
+              zs.next_in = const_cast<Bytef *>(in);
+              zs.avail_in = len;
+              in += len;
+              in_left -= len;
+            }
+          auto const result = inflate(&zs, Z_NO_FLUSH);
+          if (result != Z_OK &&
+              (result != Z_STREAM_END || zs.avail_out != 0))
+            throw std::runtime_error("failure in zlib::inflate"s);
+        }
+    }
+  crc = crc32_z(crc, reinterpret_cast<Bytef const *>(b.data.data()),
+                b.data.size());
+}
+
+void zip_source::member_stream::check_crc() const
+{
+  if ((crc & 0xffffffffu) != e.crc)
+    throw std::runtime_error("CRC mismatch in zip member "s + e.path);
+}
+
+std::vector<zip_entry> zip_source::read_directory() const
+{
+  auto const base = reinterpret_cast<unsigned char const *>(file->data());
+  auto const size = file->size();
+  if (size < 22)
+    throw invalid_zip();
+
+  auto const lowest = size > 22 + 0xffff ? size - 22 - 0xffff : 0;
+  auto eocd = size - 22;
+  while (le32(base + eocd) != zip_end_magic)
+    {
+      if (eocd == lowest)
+        throw invalid_zip();
+      --eocd;
+    }
+
+  uint64_t count = le16(base + eocd + 10);
+  uint64_t cd_size = le32(base + eocd + 12);
+  uint64_t cd_offset = le32(base + eocd + 16);
+  if (eocd >= 20 && le32(base + eocd - 20) == zip64_locator_magic)
+    {
+      auto const end64 = le64(base + eocd - 20 + 8);
+      if (end64 > size - 56 || le32(base + end64) != zip64_end_magic)
+        throw invalid_zip();
+      count = le64(base + end64 + 32);
+      cd_size = le64(base + end64 + 40);
+      cd_offset = le64(base + end64 + 48);
+    }
+  if (cd_offset > size || cd_size > size - cd_offset)
+    throw invalid_zip();
+
+  std::vector<zip_entry> result;
+  auto p = base + cd_offset;
+  auto const cd_end = p + cd_size;
+  for (uint64_t i = 0; i < count; ++i)
+    {
+      if (cd_end - p < 46 || le32(p) != zip_central_magic)
+        throw invalid_zip();
+
+      std::size_t const name_len = le16(p + 28);
+      std::size_t const extra_len = le16(p + 30);
+      std::size_t const comment_len = le16(p + 32);
+      auto const name = p + 46;
+      auto const extra = name + name_len;
+      if (std::size_t(cd_end - name) < name_len + extra_len + comment_len)
+        throw invalid_zip();
+
+      zip_entry e;
+      e.path.assign(reinterpret_cast<char const *>(name), name_len);
+      e.method = le16(p + 10);
+      e.time = dos_time(le16(p + 14), le16(p + 12));
+      e.crc = le32(p + 16);
+      e.compressed_size = le32(p + 20);
+      e.size = le32(p + 24);
+      uint64_t local = le32(p + 42);
+      read_extra(e, extra, extra + extra_len, local);
+
+      if (le16(p + 8) & 1)
+        throw std::runtime_error("encrypted zip members are not supported"s);
+      if (e.method != 0 && e.method != 8)
+        throw std::runtime_error("unsupported zip compression method"s);
+
+      if (local > size - 30 || le32(base + local) != zip_local_magic)
+        throw invalid_zip();
+      e.data_offset = local + 30 + le16(base + local + 26) +
+                      le16(base + local + 28);
+      if (e.data_offset > size || e.compressed_size > size - e.data_offset)
+        throw invalid_zip();
+
+      uint32_t const unix_mode = le32(p + 38) >> 16;
+      bool const is_dir = !e.path.empty() && e.path.back() == '/';
+      if (le16(p + 4) >> 8 == zip_host_unix && unix_mode != 0)
+        {
+          e.perm = unix_mode & 07777;
+          switch (unix_mode & AE_IFMT)
+            {
+              case AE_IFDIR:
+              case AE_IFLNK:
+                e.type = unix_mode & AE_IFMT;
+                break;
+              default:
+                e.type = is_dir ? AE_IFDIR : AE_IFREG;
+                break;
+            }
+        }
+      else
+        {
+          e.type = is_dir ? AE_IFDIR : AE_IFREG;
+          e.perm = is_dir ? 0755 : 0644;
+          if (le32(p + 38) & 1)
+            e.perm &= ~0222;
+        }
+
+      if (e.type == AE_IFLNK && e.size != 0)
+        {
+          member_stream stream(e, file->data());
+          ingest_block target;
+          stream.read_block(target, e.size);
+          stream.check_crc();
+          e.link.assign(target.data.begin(), target.data.end());
+        }
+
+      result.push_back(std::move(e));
+      p = extra + extra_len + comment_len;
+    }
+
+  std::stable_sort(result.begin(), result.end(),
+                   [](auto const & a, auto const & b) {
+                     return a.data_offset < b.data_offset;
+                   });
+  return result;
+}
+
+/* Waits for the task reading the range before to hand over the stream of
+   member i, positioned at block next of the member. That task leaves no
+   stream if it failed. */
+std::unique_ptr<zip_source::member_stream>
+zip_source::take_stream(std::size_t const i, std::size_t const next) const
+{
+  std::unique_lock<std::mutex> lock(streams_mutex);
+  decltype(streams)::iterator found;
+  streams_cv.wait(lock, [&]() {
+    found = streams.find(i);
+    return found != streams.end() &&
+           (!found->second || found->second->next_block == next);
+  });
+  if (!found->second)
+    throw std::runtime_error("failed to read zip member "s +
+                             members[i].path);
+  auto stream = std::move(found->second);
+  streams.erase(found);
+  return stream;
+}
+
+void zip_source::put_stream(std::size_t const i,
+                            std::unique_ptr<member_stream> && stream) const
+{
+  {
+    std::lock_guard<std::mutex> lock(streams_mutex);
+    streams[i] = std::move(stream);
+  }
+  streams_cv.notify_all();
+}
+
+/* Decodes blocks first to last of member i, checking its CRC once the
+   last of its blocks is decoded. */
+void zip_source::read_member(std::size_t const i, std::size_t const first,
+                             std::size_t const last,
+                             std::vector<ingest_block> & blocks) const
+{
+  auto const & e = members[i];
+  bool const ends = last == first_block[i + 1] - first_block[i];
+  auto stream = first == 0 ? nullptr : take_stream(i, first);
+  try
+    {
+      if (!stream)
+        stream = std::make_unique<member_stream>(e, file->data());
+      while (stream->next_block < last)
+        {
+          blocks.emplace_back();
+          stream->read_block(blocks.back(), block_size);
+        }
+    }
+  catch (...)
+    {
+      if (!ends)
+        put_stream(i, nullptr);
+      throw;
+    }
+
+  if (ends)
+    stream->check_crc();
+  else
+    put_stream(i, std::move(stream));
+}
+
+bool zip_source::recognizes(mapped_file const & f)
+{
+  return f.size() >= 4 && (std::memcmp(f.data(), "PK\3\4", 4) == 0 ||
+                           std::memcmp(f.data(), "PK\5\6", 4) == 0);
+}
+
+std::vector<ingest_block> zip_source::prepare(std::size_t const first,
+                                              std::size_t const last) const
+{
+  std::vector<ingest_block> blocks;
+  std::size_t i =
+      std::upper_bound(first_block.begin(), first_block.end(), first) -
+      first_block.begin() - 1;
+  for (; i < members.size() && first_block[i] < last; ++i)
+    {
+      auto const begin = std::max(first, first_block[i]);
+      auto const end = std::min(last, first_block[i + 1]);
+      if (begin < end)
+        read_member(i, begin - first_block[i], end - first_block[i], blocks);
+    }
+
+  if (hash)
+    for (auto & b : blocks)
+      b.compute_hash();
+  return blocks;
+}
@@ -0,0 +1,164 @@
+/*
+Copyright (C) 2018  Charles Cagle
+
+This file is part of archive2sqfs.
+
+archive2sqfs is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, version 3.
+
+archive2sqfs is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with archive2sqfs.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef LSL_ZIP_INGEST_H
+#define LSL_ZIP_INGEST_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <archive_entry.h>
+#include <zlib.h>
+
+#include "block_ingest.h"
+#include "entry_header.h"
+#include "mapped_input.h"
+
+/* One member of a ZIP file as described by its central directory, with
+   the same accessors as archive_reader. */
+struct zip_entry
+{
+  std::string path;
+  std::string link;
+  unsigned type;
+  uint16_t perm;
+  int64_t user = 0;
+  int64_t group = 0;
+  int64_t time;
+  uint64_t size;
+
+  std::size_t data_offset;
+  uint64_t compressed_size;
+  uint16_t method;
+  uint32_t crc;
+
+  char const * pathname() const { return path.data(); }
+  unsigned filetype() const { return type; }
+  uint16_t mode() const { return perm; }
+  int64_t uid() const { return user; }
+  int64_t gid() const { return group; }
+  int64_t mtime() const { return time; }
+  int64_t filesize() const { return type == AE_IFREG ? size : 0; }
+  uint64_t rdev() const { return 0; }
+  char const * symlink_target() const { return link.data(); }
+  char const * hardlink_target() const { return nullptr; }
+};
+
+/* Reads the central directory of a mapped ZIP file up front and orders
+   its members by their position in the file. Their data is cut into
+   ranges of whole blocks, which block_ingest's tasks inflate
+   concurrently. A member cut across ranges is decoded as one stream,
+   which the task for each of its ranges takes over from the task for the
+   range before, so no more than a range of it is held at once. */
+class zip_source
+{
+  /* Where decoding a member has got to: the inflate stream, the input
+     not yet consumed, and the CRC of the data so far. */
+  struct member_stream
+  {
+    zip_entry const & e;
+    unsigned char const * in;
+    uint64_t in_left;
+    z_stream zs = {};
+    uLong crc = crc32_z(0, Z_NULL, 0);
+    std::size_t next_block = 0;
+
+    member_stream(zip_entry const &, char const *);
+    member_stream(member_stream const &) = delete;
+    ~member_stream();
+
+    void read_block(ingest_block &, std::size_t);
+    void check_crc() const;
+  };
+
+  std::unique_ptr<mapped_file> file;
+  std::size_t const block_size;
+  bool const hash;
+  std::vector<zip_entry> members;
+
+  mutable std::mutex streams_mutex;
+  mutable std::condition_variable streams_cv;
+  mutable std::map<std::size_t, std::unique_ptr<member_stream>> streams;
+
+  std::vector<zip_entry> read_directory() const;
+  std::unique_ptr<member_stream> take_stream(std::size_t, std::size_t) const;
+  void put_stream(std::size_t, std::unique_ptr<member_stream> &&) const;
+  void read_member(std::size_t, std::size_t, std::size_t,
+                   std::vector<ingest_block> &) const;
+
+public:
+  std::vector<entry_header> entries;
+  std::vector<std::size_t> first_block;
+  std::vector<std::size_t> range_ends;
+
+  template <typename P>
+  zip_source(std::unique_ptr<mapped_file> &&, P selected,
+             std::size_t block_size, bool hash);
+
+  static bool recognizes(mapped_file const &);
+
+  std::vector<ingest_block> prepare(std::size_t, std::size_t) const;
+};
+
+using zip_ingest = block_ingest<zip_source>;
+
+template <typename P>
+zip_source::zip_source(std::unique_ptr<mapped_file> && f, P selected,
+                       std::size_t const block_size, bool const hash)
+    : file(std::move(f)), block_size(block_size), hash(hash)
+{
+  static uint64_t constexpr range_bytes = 4 << 20;
+  static std::size_t constexpr range_blocks = 1024;
+
+  std::size_t blocks = 0;
+  uint64_t bytes = 0;
+  for (auto & member : read_directory())
+    {
+      if (!selected(member))
+        continue;
+
+      entries.emplace_back(member);
+      first_block.push_back(blocks);
+      uint64_t const size = member.filesize();
+      members.push_back(std::move(member));
+      for (uint64_t off = 0; off < size; off += block_size)
+        {
+          ++blocks;
+          bytes += std::min<uint64_t>(block_size, size - off);
+          auto const first = range_ends.empty() ? 0 : range_ends.back();
+          if (bytes >= range_bytes || blocks - first >= range_blocks)
+            {
+              range_ends.push_back(blocks);
+              bytes = 0;
+            }
+        }
+    }
+  first_block.push_back(blocks);
+  if (range_ends.empty() || range_ends.back() != blocks)
+    range_ends.push_back(blocks);
+}
+
+#endif